@@ -0,0 +1,120 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef ADMISSION_SKETCH_H
+#define ADMISSION_SKETCH_H
+
+/* Count-min sketch of how many times the pages fetched referred to an
+   object. 4 rows of 256K one byte counters. */
+#define ADMISSION_SKETCH_ROWS 4
+#define ADMISSION_SKETCH_WIDTH (1 << 18)
+
+/* After this many references all the counters are halved, so what was
+   popular long ago fades out. */
+#define ADMISSION_SKETCH_SAMPLE (10 * ADMISSION_SKETCH_WIDTH)
+
+int AdmissionInit(void);
+int AdmissionRecord(const char *name);
+int AdmissionEstimate(const char *name);
+
+#endif /* ADMISSION_SKETCH_H */
+
+static uint8_t *admission_sketch;
+static uint32_t admission_references;
+
+int
+AdmissionInit(void)
+{
+  admission_sketch = (uint8_t *)calloc(ADMISSION_SKETCH_ROWS, ADMISSION_SKETCH_WIDTH);
+  return admission_sketch ? 0 : -1;
+}
+
+static void
+admission_counters(const char *name, uint8_t **counters)
+{
+  uint64_t hash = CacheNameHash(name);
+  uint32_t h1   = (uint32_t)hash;
+  uint32_t h2   = (uint32_t)(hash >> 32) | 1;
+  int i;
+
+  for (i = 0; i < ADMISSION_SKETCH_ROWS; i++)
+    counters[i] = admission_sketch + i * ADMISSION_SKETCH_WIDTH + ((h1 + i * h2) & (ADMISSION_SKETCH_WIDTH - 1));
+}
+
+static int
+admission_min(uint8_t **counters)
+{
+  int i, count, min = UINT8_MAX;
+
+  for (i = 0; i < ADMISSION_SKETCH_ROWS; i++) {
+    count = __atomic_load_n(counters[i], __ATOMIC_RELAXED);
+    if (count < min)
+      min = count;
+  }
+  return min;
+}
+
+static void
+admission_age(void)
+{
+  int i;
+
+  for (i = 0; i < ADMISSION_SKETCH_ROWS * ADMISSION_SKETCH_WIDTH; i++)
+    __atomic_store_n(&admission_sketch[i], admission_sketch[i] >> 1, __ATOMIC_RELAXED);
+}
+
+/* Count one more reference to name, returns how many it has had. Only
+   the smallest counters go up (conservative update), which keeps the
+   estimates of rare objects from being inflated by the popular ones. */
+int
+AdmissionRecord(const char *name)
+{
+  uint8_t *counters[ADMISSION_SKETCH_ROWS];
+  int i, min;
+
+  if (admission_sketch == NULL)
+    return INT32_MAX;
+  admission_counters(name, counters);
+  min = admission_min(counters);
+  if (min < UINT8_MAX) {
+    for (i = 0; i < ADMISSION_SKETCH_ROWS; i++) {
+      uint8_t count = min;
+
+      __atomic_compare_exchange_n(counters[i], &count, min + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    min++;
+  }
+
+  if (__atomic_add_fetch(&admission_references, 1, __ATOMIC_RELAXED) % ADMISSION_SKETCH_SAMPLE == 0)
+    admission_age();
+  return min;
+}
+
+int
+AdmissionEstimate(const char *name)
+{
+  uint8_t *counters[ADMISSION_SKETCH_ROWS];
+
+  if (admission_sketch == NULL)
+    return INT32_MAX;
+  admission_counters(name, counters);
+  return admission_min(counters);
+}
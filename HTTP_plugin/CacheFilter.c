@@ -0,0 +1,257 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef CACHE_FILTER_H
+#define CACHE_FILTER_H
+
+/* Counting bloom filter of the names of the objects this plugin has in
+   the cache. One byte counter per slot: 1M slots and 4 hashes keep
+   false positives around 1% up to 100k objects. */
+#define CACHE_FILTER_SLOTS (1 << 20)
+#define CACHE_FILTER_HASHES 4
+
+/* The hashes of the names counted in the filter, CACHE_FILTER_WAYS to
+   a set, so that only those are ever taken out of it: 512k names in
+   4MB. */
+#define CACHE_FILTER_SETS (1 << 17)
+#define CACHE_FILTER_WAYS 4
+
+/* The cache outlives the plugin, so after a start the filter doesn't
+   know what is already stored. Until it has seen the traffic of this
+   long, every name is looked up and the hits are learnt. */
+#define CACHE_FILTER_WARMUP_SECONDS 600
+
+uint64_t CacheNameHash(const char *name);
+int CacheFilterInit(void);
+int CacheFilterMayContain(const char *name);
+int CacheFilterTrusted(void);
+void CacheFilterAdd(const char *name);
+void CacheFilterRemove(const char *name);
+
+/* Names looked up in the cache that weren't there: the last one of
+   each of CACHE_MISS_SLOTS slots, and the share of the recent lookups
+   that missed, in per ten thousand, each new one weighing
+   1/CACHE_MISS_WEIGHT. */
+#define CACHE_MISS_SLOTS (1 << 16)
+#define CACHE_MISS_WEIGHT 32
+#define CACHE_MISS_LIKELY_RATIO 5000
+
+void CacheMissRecord(const char *name, int missed);
+int CacheMissLikely(const char *name);
+
+#endif /* CACHE_FILTER_H */
+
+static uint8_t *cache_filter;
+static uint64_t *cache_filter_names;
+static TSHRTime cache_filter_trusted_at;
+static uint64_t cache_miss_names[CACHE_MISS_SLOTS];
+static int cache_miss_ratio;
+
+int
+CacheFilterInit(void)
+{
+  cache_filter       = (uint8_t *)calloc(CACHE_FILTER_SLOTS, 1);
+  cache_filter_names = (uint64_t *)calloc(CACHE_FILTER_SETS * CACHE_FILTER_WAYS, sizeof(uint64_t));
+  if (cache_filter == NULL || cache_filter_names == NULL) {
+    free(cache_filter);
+    free(cache_filter_names);
+    cache_filter       = NULL;
+    cache_filter_names = NULL;
+    return -1;
+  }
+  cache_filter_trusted_at = TShrtime() + (TSHRTime)CACHE_FILTER_WARMUP_SECONDS * 1000000000;
+  return 0;
+}
+
+/* 64 bit FNV-1a hash of the name of a cached object. */
+uint64_t
+CacheNameHash(const char *name)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (; *name; name++) {
+    hash ^= (unsigned char)*name;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* Slots of the name of hash: double hashing over its two halves. */
+static void
+cache_filter_slots(uint64_t hash, uint32_t *slots)
+{
+  uint32_t h1, h2;
+  int i;
+
+  h1 = (uint32_t)hash;
+  h2 = (uint32_t)(hash >> 32) | 1;
+  for (i = 0; i < CACHE_FILTER_HASHES; i++)
+    slots[i] = (h1 + i * h2) & (CACHE_FILTER_SLOTS - 1);
+}
+
+static int
+cache_filter_has(const uint32_t *slots)
+{
+  int i;
+
+  for (i = 0; i < CACHE_FILTER_HASHES; i++) {
+    if (__atomic_load_n(&cache_filter[slots[i]], __ATOMIC_RELAXED) == 0)
+      return 0;
+  }
+  return 1;
+}
+
+int
+CacheFilterTrusted(void)
+{
+  return cache_filter != NULL && TShrtime() >= cache_filter_trusted_at;
+}
+
+/* 0 only if name is surely not in the cache. */
+int
+CacheFilterMayContain(const char *name)
+{
+  uint32_t slots[CACHE_FILTER_HASHES];
+
+  if (!CacheFilterTrusted())
+    return 1;
+  cache_filter_slots(CacheNameHash(name), slots);
+  return cache_filter_has(slots);
+}
+
+/* The set of the counted names where hash goes, picked by Fibonacci
+   hashing: the high bits of FNV-1a are spread too little for names
+   that differ at the end. 0 marks a free way. */
+static uint64_t *
+cache_filter_set(uint64_t *hash)
+{
+  if (*hash == 0)
+    *hash = 1;
+  return &cache_filter_names[((*hash * 11400714819323198485ULL) >> 32) % CACHE_FILTER_SETS * CACHE_FILTER_WAYS];
+}
+
+/* Move the counters of slots by step, one that reached 255 stays
+   there. */
+static void
+cache_filter_count(const uint32_t *slots, int step)
+{
+  uint8_t count;
+  int i;
+
+  for (i = 0; i < CACHE_FILTER_HASHES; i++) {
+    count = __atomic_load_n(&cache_filter[slots[i]], __ATOMIC_RELAXED);
+    while (count < UINT8_MAX && (step > 0 || count > 0) &&
+           !__atomic_compare_exchange_n(&cache_filter[slots[i]], &count, count + step, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+}
+
+/* Counters only go up for a name not counted yet, so rewriting an
+   object again and again doesn't keep it in the filter once it is
+   evicted. The name is remembered in its set. If the set is full it is
+   counted once, as long as the filter doesn't have it, and never taken
+   out: that only costs lookups. Two threads adding the same name at
+   once may both count it, with the same outcome. */
+void
+CacheFilterAdd(const char *name)
+{
+  uint32_t slots[CACHE_FILTER_HASHES];
+  uint64_t hash = CacheNameHash(name), free_way;
+  uint64_t *set;
+  int i;
+
+  if (cache_filter == NULL)
+    return;
+  set = cache_filter_set(&hash);
+  for (i = 0; i < CACHE_FILTER_WAYS; i++) {
+    if (__atomic_load_n(&set[i], __ATOMIC_RELAXED) == hash)
+      return;
+  }
+  cache_filter_slots(hash, slots);
+  for (i = 0; i < CACHE_FILTER_WAYS; i++) {
+    free_way = 0;
+    if (__atomic_compare_exchange_n(&set[i], &free_way, hash, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+  }
+  if (i == CACHE_FILTER_WAYS && cache_filter_has(slots))
+    return;
+  cache_filter_count(slots, 1);
+}
+
+/* The cache evicts without telling, so a lookup that misses a counted
+   name removes it. Only a name found in its set is taken out: a false
+   positive of the filter was never counted, and taking it out would
+   make other names look missing, which skips their lookups. */
+void
+CacheFilterRemove(const char *name)
+{
+  uint32_t slots[CACHE_FILTER_HASHES];
+  uint64_t hash = CacheNameHash(name), counted;
+  uint64_t *set;
+  int i;
+
+  if (cache_filter == NULL)
+    return;
+  set = cache_filter_set(&hash);
+  for (i = 0; i < CACHE_FILTER_WAYS; i++) {
+    counted = hash;
+    if (__atomic_compare_exchange_n(&set[i], &counted, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      cache_filter_slots(hash, slots);
+      cache_filter_count(slots, -1);
+      return;
+    }
+  }
+}
+
+/* The cache said whether name was there. An object that misses once
+   often misses again: it isn't cacheable, or is evicted early. */
+void
+CacheMissRecord(const char *name, int missed)
+{
+  uint64_t hash  = CacheNameHash(name);
+  uint64_t *slot = &cache_miss_names[hash % CACHE_MISS_SLOTS];
+  int ratio;
+
+  if (missed)
+    __atomic_store_n(slot, hash, __ATOMIC_RELAXED);
+  else if (__atomic_load_n(slot, __ATOMIC_RELAXED) == hash)
+    __atomic_store_n(slot, 0, __ATOMIC_RELAXED);
+
+  /* Racy: a lost update only delays the average a little. */
+  ratio = __atomic_load_n(&cache_miss_ratio, __ATOMIC_RELAXED);
+  ratio += ((missed ? 10000 : 0) - ratio) / CACHE_MISS_WEIGHT;
+  __atomic_store_n(&cache_miss_ratio, ratio, __ATOMIC_RELAXED);
+}
+
+/* 1 if a lookup of name will likely miss: the filter doesn't have it,
+   it missed last time, or most lookups miss these days, as right after
+   a start. */
+int
+CacheMissLikely(const char *name)
+{
+  uint64_t hash = CacheNameHash(name);
+
+  if (!CacheFilterMayContain(name))
+    return 1;
+  if (__atomic_load_n(&cache_miss_names[hash % CACHE_MISS_SLOTS], __ATOMIC_RELAXED) == hash)
+    return 1;
+  return __atomic_load_n(&cache_miss_ratio, __ATOMIC_RELAXED) >= CACHE_MISS_LIKELY_RATIO;
+}
@@ -0,0 +1,345 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+/* Compressed variants are made once, when the object is written into
+   the cache, on the thread of the prefetch, so the levels favour size
+   over speed. */
+#define ENCODING_GZIP_LEVEL 9
+#define ENCODING_BROTLI_QUALITY 9
+
+/* Bodies smaller than this aren't worth a variant. */
+#define ENCODING_MIN_BODY_LENGTH 256
+
+/* Names whose variants are known to be stored, and to go with the
+   identity object stored now. Only those are looked up, so a request
+   for anything else costs one cache read, and a variant left from an
+   older identity object is never served. One slot per name, by hash:
+   a name pushed out only loses its variants until the next fill. */
+#define ENCODING_VARIANT_SLOTS (1 << 16)
+
+typedef enum {
+  TXN_ENCODING_IDENTITY = 0,
+  TXN_ENCODING_GZIP,
+  TXN_ENCODING_BR,
+  TXN_ENCODING_COUNT
+} TxnEncoding;
+
+TxnEncoding EncodingSelect(const char *request, const char *file_name);
+void EncodingStored(const char *name);
+void EncodingForget(const char *file_name);
+char *EncodingVariantName(TxnArena *arena, const char *file_name, TxnEncoding encoding);
+int EncodingCompressible(const char *response);
+char *EncodingCompress(TxnArena *arena, const char *response, int length, TxnEncoding encoding, int *encoded_length);
+
+#endif /* CONTENT_ENCODING_H */
+
+static const char *encoding_name[TXN_ENCODING_COUNT] = {"identity", "gzip", "br"};
+
+/* Hash of the name, its low bits replaced by a bit per stored variant. */
+#define ENCODING_VARIANT_BITS ((uint64_t)(1 << TXN_ENCODING_COUNT) - 1)
+
+static uint64_t encoding_variants[ENCODING_VARIANT_SLOTS];
+
+/* Types worth compressing. Images and fonts are compressed already. */
+static const char *encoding_types[] = {"text/html", "text/css", "text/javascript", "application/javascript",
+                                       "application/x-javascript", "application/json", "text/plain", "image/svg+xml",
+                                       NULL};
+
+/* Bits of the variants of file_name stored with its identity object. */
+static uint64_t
+encoding_available(const char *file_name)
+{
+  uint64_t hash  = CacheNameHash(file_name);
+  uint64_t value = __atomic_load_n(&encoding_variants[hash % ENCODING_VARIANT_SLOTS], __ATOMIC_RELAXED);
+
+  if ((value & ~ENCODING_VARIANT_BITS) != (hash & ~ENCODING_VARIANT_BITS))
+    return 0;
+  return value & ENCODING_VARIANT_BITS;
+}
+
+/* Pick the variant of file_name to serve from the Accept-Encoding of
+   the request: the stored coding with the highest q value, br before
+   gzip when they tie. "*" stands for the codings not listed. */
+TxnEncoding
+EncodingSelect(const char *request, const char *file_name)
+{
+  const char *value, *token, *end;
+  double q[TXN_ENCODING_COUNT], star_q = -1.0, best_q = 0.0;
+  TxnEncoding best = TXN_ENCODING_IDENTITY;
+  TxnEncoding encoding;
+  uint64_t available;
+  int length, token_length, name_length;
+
+  available = encoding_available(file_name);
+  if (available == 0)
+    return TXN_ENCODING_IDENTITY;
+  value = find_request_header(request, "Accept-Encoding", &length);
+  if (value == NULL)
+    return TXN_ENCODING_IDENTITY;
+
+  for (encoding = TXN_ENCODING_IDENTITY; encoding < TXN_ENCODING_COUNT; encoding++)
+    q[encoding] = -1.0;
+
+  end = value + length;
+  for (token = value; token < end; token += token_length + 1) {
+    const char *param;
+    double token_q;
+
+    token_length = strcspn(token, ",\r\n");
+    if (token + token_length > end)
+      token_length = end - token;
+    while (token_length > 0 && (*token == ' ' || *token == '\t')) {
+      token++;
+      token_length--;
+    }
+    name_length = strcspn(token, "; \t,\r\n");
+    if (name_length > token_length)
+      name_length = token_length;
+
+    token_q = 1.0;
+    param   = memchr(token, ';', token_length);
+    if (param) {
+      param++;
+      while (*param == ' ')
+        param++;
+      if (strncasecmp(param, "q=", 2) == 0)
+        token_q = atof(param + 2);
+    }
+
+    if (name_length == 1 && token[0] == '*')
+      star_q = token_q;
+    else if (name_length == 2 && strncasecmp(token, "br", 2) == 0)
+      q[TXN_ENCODING_BR] = token_q;
+    else if ((name_length == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+             (name_length == 6 && strncasecmp(token, "x-gzip", 6) == 0))
+      q[TXN_ENCODING_GZIP] = token_q;
+  }
+
+  for (encoding = TXN_ENCODING_GZIP; encoding < TXN_ENCODING_COUNT; encoding++) {
+    if (q[encoding] < 0.0)
+      q[encoding] = star_q;
+    if (!(available & (1 << encoding)) || q[encoding] <= 0.0)
+      continue;
+    if (q[encoding] > best_q || (q[encoding] == best_q && encoding == TXN_ENCODING_BR)) {
+      best_q = q[encoding];
+      best   = encoding;
+    }
+  }
+  return best;
+}
+
+/* The object name was written into the cache. A variant is noted with
+   the identity object; a new identity object makes the variants of
+   the old one stale until they are written again. */
+void
+EncodingStored(const char *name)
+{
+  const char *space = strchr(name, ' ');
+  TxnEncoding encoding;
+  uint64_t hash, *slot, value, bits;
+  char file_name[MAX_FILE_NAME_LENGTH + 1];
+
+  if (space == NULL) {
+    EncodingForget(name);
+    return;
+  }
+
+  for (encoding = TXN_ENCODING_GZIP; encoding < TXN_ENCODING_COUNT; encoding++) {
+    if (strcmp(space + 1, encoding_name[encoding]) == 0)
+      break;
+  }
+  if (encoding == TXN_ENCODING_COUNT || space - name > MAX_FILE_NAME_LENGTH)
+    return;
+  memcpy(file_name, name, space - name);
+  file_name[space - name] = '\0';
+
+  hash  = CacheNameHash(file_name);
+  slot  = &encoding_variants[hash % ENCODING_VARIANT_SLOTS];
+  value = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  do {
+    bits = (value & ~ENCODING_VARIANT_BITS) == (hash & ~ENCODING_VARIANT_BITS) ? value & ENCODING_VARIANT_BITS : 0;
+  } while (!__atomic_compare_exchange_n(slot, &value, (hash & ~ENCODING_VARIANT_BITS) | bits | (1 << encoding), 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* No variant of file_name is to be served: its identity object changed,
+   or a variant was found missing. */
+void
+EncodingForget(const char *file_name)
+{
+  uint64_t hash  = CacheNameHash(file_name);
+  uint64_t *slot = &encoding_variants[hash % ENCODING_VARIANT_SLOTS];
+  uint64_t value = __atomic_load_n(slot, __ATOMIC_RELAXED);
+
+  if ((value & ~ENCODING_VARIANT_BITS) == (hash & ~ENCODING_VARIANT_BITS))
+    __atomic_compare_exchange_n(slot, &value, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Name the cache key of a variant is made from. A space can't appear
+   in a request path, so it can't clash with a real object. */
+char *
+EncodingVariantName(TxnArena *arena, const char *file_name, TxnEncoding encoding)
+{
+  size_t length = strlen(file_name) + strlen(encoding_name[encoding]) + 2;
+  char *name    = (char *)TxnArenaAlloc(arena, length);
+
+  if (name)
+    snprintf(name, length, "%s %s", file_name, encoding_name[encoding]);
+  return name;
+}
+
+/* A 200 response of a text type that isn't encoded yet. response
+   must be NUL terminated. */
+int
+EncodingCompressible(const char *response)
+{
+  const char *value;
+  int value_length, i;
+
+  if (strncmp(response, "HTTP/1.", 7) != 0 || strncmp(response + 9, "200", 3) != 0)
+    return 0;
+  if (strstr(response, "\r\n\r\n") == NULL)
+    return 0;
+  if (find_request_header(response, "Content-Encoding", &value_length) != NULL ||
+      find_request_header(response, "Transfer-Encoding", &value_length) != NULL)
+    return 0;
+
+  value = find_request_header(response, "Content-Type", &value_length);
+  if (value == NULL)
+    return 0;
+  for (i = 0; encoding_types[i]; i++) {
+    if (strncasecmp(value, encoding_types[i], strlen(encoding_types[i])) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static char *
+encoding_gzip(TxnArena *arena, const char *data, size_t length, size_t *encoded_length)
+{
+  z_stream zs;
+  char *out;
+  size_t bound;
+  int ret;
+
+  memset(&zs, 0, sizeof(zs));
+  /* 16 + window bits asks zlib for a gzip wrapper. */
+  if (deflateInit2(&zs, ENCODING_GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  bound = deflateBound(&zs, length);
+  out   = (char *)TxnArenaAlloc(arena, bound);
+  if (out == NULL) {
+    deflateEnd(&zs);
+    return NULL;
+  }
+
+  zs.next_in   = (Bytef *)data;
+  zs.avail_in  = length;
+  zs.next_out  = (Bytef *)out;
+  zs.avail_out = bound;
+  ret          = deflate(&zs, Z_FINISH);
+  *encoded_length = zs.total_out;
+  deflateEnd(&zs);
+
+  return ret == Z_STREAM_END ? out : NULL;
+}
+
+static char *
+encoding_brotli(TxnArena *arena, const char *data, size_t length, size_t *encoded_length)
+{
+  char *out;
+
+  *encoded_length = BrotliEncoderMaxCompressedSize(length);
+  if (*encoded_length == 0)
+    return NULL;
+  out = (char *)TxnArenaAlloc(arena, *encoded_length);
+  if (out == NULL)
+    return NULL;
+
+  if (!BrotliEncoderCompress(ENCODING_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, length,
+                             (const uint8_t *)data, encoded_length, (uint8_t *)out))
+    return NULL;
+  return out;
+}
+
+/* Build the encoded variant of a stored response: the same header
+   without the length and validator of the identity body, plus the
+   coding, the new length and Vary. Returns NULL if the body is too
+   small to bother or the variant isn't smaller than the original. */
+char *
+EncodingCompress(TxnArena *arena, const char *response, int length, TxnEncoding encoding, int *encoded_length)
+{
+  const char *header_end, *line, *next;
+  const char *body;
+  char *body_encoded, *variant, *p;
+  size_t body_length, body_encoded_length;
+  int header_length, n;
+
+  header_end = strstr(response, "\r\n\r\n");
+  if (header_end == NULL)
+    return NULL;
+  header_length = header_end - response + 4;
+  body          = response + header_length;
+  body_length   = length - header_length;
+  if (length - header_length < ENCODING_MIN_BODY_LENGTH)
+    return NULL;
+
+  if (encoding == TXN_ENCODING_GZIP)
+    body_encoded = encoding_gzip(arena, body, body_length, &body_encoded_length);
+  else if (encoding == TXN_ENCODING_BR)
+    body_encoded = encoding_brotli(arena, body, body_length, &body_encoded_length);
+  else
+    return NULL;
+
+  if (body_encoded == NULL || body_encoded_length >= body_length)
+    return NULL;
+
+  variant = (char *)TxnArenaAlloc(arena, header_length + 128 + body_encoded_length);
+  if (variant == NULL)
+    return NULL;
+
+  /* Status line and the headers still true for the variant. */
+  p = variant;
+  for (line = response; line < header_end + 2; line = next) {
+    next = strstr(line, "\r\n") + 2;
+    if (line != response && (strncasecmp(line, "Content-Length:", 15) == 0 || strncasecmp(line, "ETag:", 5) == 0 ||
+                             strncasecmp(line, "Vary:", 5) == 0))
+      continue;
+    memcpy(p, line, next - line);
+    p += next - line;
+  }
+  n = sprintf(p, "Content-Encoding: %s\r\nContent-Length: %zu\r\nVary: Accept-Encoding\r\n\r\n", encoding_name[encoding],
+              body_encoded_length);
+  p += n;
+  memcpy(p, body_encoded, body_encoded_length);
+  p += body_encoded_length;
+
+  *encoded_length = p - variant;
+  return variant;
+}
@@ -0,0 +1,135 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#ifndef EARLY_HINTS_H
+#define EARLY_HINTS_H
+
+/* At most this many objects are announced for one page. */
+#define MAX_PRELOAD_LINKS 32
+
+char *PreloadLinks(TxnArena *arena, char **paths, int count, int *length);
+char *PreloadAddLinks(TxnArena *arena, const char *response, int length, const char *links, int links_length,
+                      int *new_length);
+char *EarlyHintsBuild(TxnArena *arena, const char *links, int links_length, int *length);
+
+#endif /* EARLY_HINTS_H */
+
+typedef struct {
+  const char *extension;
+  const char *as; /* destination of the preload */
+} PreloadType;
+
+/* A preload without the right "as" is fetched twice by the browser,
+   so objects of other types aren't announced. */
+static const PreloadType preload_types[] = {
+  {".css", "style"}, {".js", "script"}, {".png", "image"},  {".jpg", "image"},  {".jpeg", "image"},
+  {".gif", "image"}, {".webp", "image"}, {".svg", "image"},  {".ico", "image"},  {".woff2", "font"},
+  {".woff", "font"}, {".ttf", "font"},   {".otf", "font"},   {NULL, NULL},
+};
+
+static const char *
+preload_as(const char *path)
+{
+  size_t path_length = strcspn(path, "?#");
+  size_t n;
+  int i;
+
+  for (i = 0; preload_types[i].extension; i++) {
+    n = strlen(preload_types[i].extension);
+    if (path_length > n && strncasecmp(path + path_length - n, preload_types[i].extension, n) == 0)
+      return preload_types[i].as;
+  }
+  return NULL;
+}
+
+/* One Link header line per object, e.g.
+   Link: </css/main.css>; rel=preload; as=style
+   Fonts are always fetched in cors mode, their preload must say so. */
+char *
+PreloadLinks(TxnArena *arena, char **paths, int count, int *length)
+{
+  const char *as;
+  char *links, *p;
+  size_t size = 1;
+  int i, n = 0;
+
+  for (i = 0; i < count; i++)
+    size += strlen(paths[i]) + 64;
+  links = (char *)TxnArenaAlloc(arena, size);
+  if (links == NULL)
+    return NULL;
+
+  p = links;
+  for (i = 0; i < count && n < MAX_PRELOAD_LINKS; i++) {
+    as = preload_as(paths[i]);
+    if (as == NULL || strpbrk(paths[i], "<>\r\n"))
+      continue;
+    p += sprintf(p, "Link: <%s>; rel=preload; as=%s%s\r\n", paths[i], as, strcmp(as, "font") == 0 ? "; crossorigin" : "");
+    n++;
+  }
+  *p      = '\0';
+  *length = p - links;
+  return n > 0 ? links : NULL;
+}
+
+/* Copy of a stored response with the Link lines added at the end of
+   its header. */
+char *
+PreloadAddLinks(TxnArena *arena, const char *response, int length, const char *links, int links_length, int *new_length)
+{
+  const char *header_end;
+  char *linked;
+  int header_length;
+
+  header_end = strstr(response, "\r\n\r\n");
+  if (header_end == NULL)
+    return NULL;
+  header_length = header_end - response + 2;
+
+  linked = (char *)TxnArenaAlloc(arena, length + links_length + 1);
+  if (linked == NULL)
+    return NULL;
+
+  memcpy(linked, response, header_length);
+  memcpy(linked + header_length, links, links_length);
+  memcpy(linked + header_length + links_length, response + header_length, length - header_length);
+  *new_length         = length + links_length;
+  linked[*new_length] = '\0';
+  return linked;
+}
+
+/* The 103 interim response sent before the final one. */
+char *
+EarlyHintsBuild(TxnArena *arena, const char *links, int links_length, int *length)
+{
+  static const char status[] = "HTTP/1.1 103 Early Hints\r\n";
+  char *hints;
+
+  hints = (char *)TxnArenaAlloc(arena, sizeof(status) + links_length + 2);
+  if (hints == NULL)
+    return NULL;
+
+  memcpy(hints, status, sizeof(status) - 1);
+  memcpy(hints + sizeof(status) - 1, links, links_length);
+  memcpy(hints + sizeof(status) - 1 + links_length, "\r\n", 3);
+  *length = sizeof(status) - 1 + links_length + 2;
+  return hints;
+}
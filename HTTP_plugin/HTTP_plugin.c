@@ -54,6 +54,14 @@
 
 /* global variable */
 TSTextLogObject protocol_plugin_log;
+int early_hints_enabled;
+int speculative_connect_enabled;
+int prefetch_css_depth;
+int prefetch_admit_min;
+int crawl_depth;
+int crawl_rate;
+int prefetch_connections;
+char *origin_ca_file;
 
 /* static variable */
 static TSAction pending_action;
@@ -63,26 +71,23 @@ static int server_port;
 /* Functions only seen in this file, should be static. */
 static void protocol_init(int accept_port, int server_port);
 static int accept_handler(TSCont contp, TSEvent event, void *edata);
+static int queue_handler(TSCont contp, TSEvent event, void *edata);
 
 /* When the handle is called, the net_vc is returned. */
 static int
 accept_handler(TSCont contp, TSEvent event, void *edata)
 {
-  TSCont txn_sm;
-  TSMutex pmutex;
+  OverloadVerdict verdict;
 
   switch (event) {
   case TS_EVENT_NET_ACCEPT:
-    /* Create a new mutex for the TxnSM, which is going
-       to handle the incoming request. */
-    pmutex = (TSMutex)TSMutexCreate();
-    txn_sm = (TSCont)TxnSMCreate(pmutex, (TSVConn)edata, server_port);
-
-    /* This is no reason for not grabbing the lock.
-       So skip the routine which handle LockTry failure case. */
-    TSMutexLockTry(pmutex); // TODO: why should it not check if we got the lock??
-    TSContCall(txn_sm, 0, NULL);
-    TSMutexUnlock(pmutex);
+    /* Past the transaction limit the connection waits for a slot, or
+       is turned away when too many already wait. */
+    verdict = OverloadAdmit((TSVConn)edata);
+    if (verdict == OVERLOAD_START || verdict == OVERLOAD_ANSWER)
+      TxnSMStart((TSVConn)edata, server_port, verdict);
+    else if (verdict == OVERLOAD_CLOSE)
+      TSVConnClose((TSVConn)edata);
     break;
 
   default:
@@ -98,6 +103,25 @@ accept_handler(TSCont contp, TSEvent event, void *edata)
   return TS_EVENT_NONE;
 }
 
+/* Runs every OVERLOAD_QUEUE_SWEEP_MS: the connections that waited for
+   a transaction slot too long are answered 503, even if no transaction
+   ends to take them out of the queue. */
+static int
+queue_handler(TSCont contp, TSEvent event ATS_UNUSED, void *edata ATS_UNUSED)
+{
+  OverloadVerdict verdict;
+  TSVConn vc;
+
+  while ((vc = OverloadExpired(&verdict)) != NULL) {
+    if (verdict == OVERLOAD_CLOSE)
+      TSVConnClose(vc);
+    else
+      TxnSMStart(vc, server_port, verdict);
+  }
+  TSContSchedule(contp, OVERLOAD_QUEUE_SWEEP_MS, TS_THREAD_POOL_DEFAULT);
+  return TS_EVENT_NONE;
+}
+
 static void
 protocol_init(int accept_port, int server_port ATS_UNUSED)
 {
@@ -110,6 +134,44 @@ protocol_init(int accept_port, int server_port ATS_UNUSED)
     TSError("[protocol] Failed to create log");
   }
 
+  /* Without the filter every name is looked up in the cache. */
+  if (CacheFilterInit() != 0) {
+    TSError("[protocol] Failed to create the cache filter");
+  }
+  if (HotCacheInit() != 0) {
+    TSError("[protocol] Failed to create the RAM cache");
+  }
+  /* Without the sketch every prefetched object is admitted. */
+  if (AdmissionInit() != 0) {
+    TSError("[protocol] Failed to create the admission sketch");
+  }
+  /* Without the statistics prefetch isn't adapted. */
+  if (PrefetchStatsInit() != 0) {
+    TSError("[protocol] Failed to create the prefetch statistics");
+  }
+  /* Without the model no next page is predicted. */
+  if (NextPageInit() != 0) {
+    TSError("[protocol] Failed to create the next page model");
+  }
+  /* Without replicas requests go to the server name. */
+  if (OriginInit(HOST_CONF_PATH) != 0) {
+    TSError("[protocol] Failed to read the origin replicas of %s", HOST_CONF_PATH);
+  }
+  /* Without TLS only the http:// replicas can be asked. */
+  if (OriginTlsInit(origin_ca_file) != 0) {
+    TSError("[protocol] Failed to set up TLS to the origin");
+  }
+  /* Without the rules no page is crawled. */
+  if (crawl_depth > 0 && CrawlInit(HOST_CONF_PATH, crawl_rate) != 0) {
+    TSError("[protocol] Failed to read the crawl rules of %s", HOST_CONF_PATH);
+  }
+
+  /* Connections only wait for a slot under a transaction limit. */
+  if (overload_limits.transactions > 0) {
+    contp = TSContCreate(queue_handler, TSMutexCreate());
+    TSContSchedule(contp, OVERLOAD_QUEUE_SWEEP_MS, TS_THREAD_POOL_DEFAULT);
+  }
+
   contp = TSContCreate(accept_handler, TSMutexCreate());
 
   /* Accept network traffic from the accept_port.
@@ -124,7 +186,7 @@ TSPluginInit(int argc, const char *argv[])
 {
   TSPluginRegistrationInfo info;
   char *end;
-  int tmp;
+  int tmp, i;
 
   info.plugin_name   = "HTTP_plugin";
   info.vendor_name   = "MyCompany";
@@ -137,12 +199,17 @@ TSPluginInit(int argc, const char *argv[])
   }
 
   /* default value */
-  accept_port = 4666;
-  server_port = 4666;
+  accept_port          = 4666;
+  server_port          = 4666;
+  prefetch_css_depth   = 2;
+  prefetch_admit_min   = 2;
+  crawl_depth          = 0;
+  crawl_rate           = 1;
+  prefetch_connections = 0;
 
   if (argc < 3) {
-    TSDebug("HTTP_plugin", "Usage: protocol.so accept_port server_port");
-    printf("[protocol_plugin] Usage: protocol.so accept_port server_port\n");
+    TSDebug("HTTP_plugin", "Usage: protocol.so accept_port server_port [early_hints] [speculative_connect] [css_depth=N] [prefetch_admit=N] [crawl_depth=N] [crawl_rate=N] [connect_timeout=MS] [first_byte_timeout=MS] [idle_timeout=MS] [origin_retries=N] [prefetch_timeout=MS] [hedge=P] [hedge_budget=PCT] [origin_ca=FILE] [prefetch_connections=N] [max_transactions=N] [max_fetches=N]");
+    printf("[protocol_plugin] Usage: protocol.so accept_port server_port [early_hints] [speculative_connect] [css_depth=N] [prefetch_admit=N] [crawl_depth=N] [crawl_rate=N] [connect_timeout=MS] [first_byte_timeout=MS] [idle_timeout=MS] [origin_retries=N] [prefetch_timeout=MS] [hedge=P] [hedge_budget=PCT] [origin_ca=FILE] [prefetch_connections=N] [max_transactions=N] [max_fetches=N]\n");
     printf("[protocol_plugin] Wrong arguments. Using deafult ports.\n");
   } else {
     tmp = strtol(argv[1], &end, 10);
@@ -164,6 +231,195 @@ TSPluginInit(int argc, const char *argv[])
       printf("[protocol_plugin] Wrong argument for server_port.");
       printf("Using deafult port %d\n", server_port);
     }
+
+    for (i = 3; i < argc; i++) {
+      /* Send 103 Early Hints before the response of a page miss. */
+      if (strcmp(argv[i], "early_hints") == 0) {
+        early_hints_enabled = 1;
+        TSDebug("HTTP_plugin", "early hints enabled");
+        printf("[protocol_plugin] early hints enabled\n");
+      } else if (strcmp(argv[i], "speculative_connect") == 0) {
+        /* Connect to the origin during the cache lookup of a request
+           that will likely miss. */
+        speculative_connect_enabled = 1;
+        TSDebug("HTTP_plugin", "speculative connect enabled");
+        printf("[protocol_plugin] speculative connect enabled\n");
+      } else if (strncmp(argv[i], "css_depth=", 10) == 0) {
+        /* 1: objects of the page only, 2: and the ones their css
+           refers to, and so on. */
+        tmp = strtol(argv[i] + 10, &end, 10);
+        if (*end == '\0' && tmp >= 1) {
+          prefetch_css_depth = tmp;
+          TSDebug("HTTP_plugin", "using css_depth %d", prefetch_css_depth);
+          printf("[protocol_plugin] using css_depth %d\n", prefetch_css_depth);
+        } else {
+          printf("[protocol_plugin] Wrong argument for css_depth.");
+          printf("Using default depth %d\n", prefetch_css_depth);
+        }
+      } else if (strncmp(argv[i], "prefetch_admit=", 15) == 0) {
+        /* Pages that must refer to an object before it is prefetched,
+           1 prefetches everything. */
+        tmp = strtol(argv[i] + 15, &end, 10);
+        if (*end == '\0' && tmp >= 1) {
+          prefetch_admit_min = tmp;
+          TSDebug("HTTP_plugin", "using prefetch_admit %d", prefetch_admit_min);
+          printf("[protocol_plugin] using prefetch_admit %d\n", prefetch_admit_min);
+        } else {
+          printf("[protocol_plugin] Wrong argument for prefetch_admit.");
+          printf("Using default %d\n", prefetch_admit_min);
+        }
+      } else if (strncmp(argv[i], "crawl_depth=", 12) == 0) {
+        /* Follow the links of the pages selected in host.conf this many
+           levels down, 0 doesn't crawl. */
+        tmp = strtol(argv[i] + 12, &end, 10);
+        if (*end == '\0' && tmp >= 0) {
+          crawl_depth = tmp;
+          TSDebug("HTTP_plugin", "using crawl_depth %d", crawl_depth);
+          printf("[protocol_plugin] using crawl_depth %d\n", crawl_depth);
+        } else {
+          printf("[protocol_plugin] Wrong argument for crawl_depth.");
+          printf("Using default depth %d\n", crawl_depth);
+        }
+      } else if (strncmp(argv[i], "crawl_rate=", 11) == 0) {
+        /* Links followed per second and origin. */
+        tmp = strtol(argv[i] + 11, &end, 10);
+        if (*end == '\0' && tmp >= 1) {
+          crawl_rate = tmp;
+          TSDebug("HTTP_plugin", "using crawl_rate %d", crawl_rate);
+          printf("[protocol_plugin] using crawl_rate %d\n", crawl_rate);
+        } else {
+          printf("[protocol_plugin] Wrong argument for crawl_rate.");
+          printf("Using default %d\n", crawl_rate);
+        }
+      } else if (strncmp(argv[i], "connect_timeout=", 16) == 0) {
+        /* Milliseconds to connect to the origin server. */
+        tmp = strtol(argv[i] + 16, &end, 10);
+        if (*end == '\0' && tmp >= 1) {
+          origin_timeouts.connect_ms = tmp;
+          TSDebug("HTTP_plugin", "using connect_timeout %d ms", origin_timeouts.connect_ms);
+          printf("[protocol_plugin] using connect_timeout %d ms\n", origin_timeouts.connect_ms);
+        } else {
+          printf("[protocol_plugin] Wrong argument for connect_timeout.");
+          printf("Using default %d ms\n", origin_timeouts.connect_ms);
+        }
+      } else if (strncmp(argv[i], "first_byte_timeout=", 19) == 0) {
+        /* Milliseconds from the request sent to the first byte of the
+           response. */
+        tmp = strtol(argv[i] + 19, &end, 10);
+        if (*end == '\0' && tmp >= 1) {
+          origin_timeouts.first_byte_ms = tmp;
+          TSDebug("HTTP_plugin", "using first_byte_timeout %d ms", origin_timeouts.first_byte_ms);
+          printf("[protocol_plugin] using first_byte_timeout %d ms\n", origin_timeouts.first_byte_ms);
+        } else {
+          printf("[protocol_plugin] Wrong argument for first_byte_timeout.");
+          printf("Using default %d ms\n", origin_timeouts.first_byte_ms);
+        }
+      } else if (strncmp(argv[i], "idle_timeout=", 13) == 0) {
+        /* Milliseconds the origin server may stay silent in the middle of
+           a response. */
+        tmp = strtol(argv[i] + 13, &end, 10);
+        if (*end == '\0' && tmp >= 1) {
+          origin_timeouts.idle_ms = tmp;
+          TSDebug("HTTP_plugin", "using idle_timeout %d ms", origin_timeouts.idle_ms);
+          printf("[protocol_plugin] using idle_timeout %d ms\n", origin_timeouts.idle_ms);
+        } else {
+          printf("[protocol_plugin] Wrong argument for idle_timeout.");
+          printf("Using default %d ms\n", origin_timeouts.idle_ms);
+        }
+      } else if (strncmp(argv[i], "origin_retries=", 15) == 0) {
+        /* Times a request that got nothing from the origin server is tried
+           again, 0 never retries. */
+        tmp = strtol(argv[i] + 15, &end, 10);
+        if (*end == '\0' && tmp >= 0) {
+          origin_timeouts.retries = tmp;
+          TSDebug("HTTP_plugin", "using origin_retries %d", origin_timeouts.retries);
+          printf("[protocol_plugin] using origin_retries %d\n", origin_timeouts.retries);
+        } else {
+          printf("[protocol_plugin] Wrong argument for origin_retries.");
+          printf("Using default %d\n", origin_timeouts.retries);
+        }
+      } else if (strncmp(argv[i], "prefetch_timeout=", 17) == 0) {
+        /* Milliseconds a batch of prefetches may take as a whole, retries
+           included. */
+        tmp = strtol(argv[i] + 17, &end, 10);
+        if (*end == '\0' && tmp >= 1) {
+          origin_timeouts.batch_ms = tmp;
+          TSDebug("HTTP_plugin", "using prefetch_timeout %d ms", origin_timeouts.batch_ms);
+          printf("[protocol_plugin] using prefetch_timeout %d ms\n", origin_timeouts.batch_ms);
+        } else {
+          printf("[protocol_plugin] Wrong argument for prefetch_timeout.");
+          printf("Using default %d ms\n", origin_timeouts.batch_ms);
+        }
+      } else if (strncmp(argv[i], "hedge=", 6) == 0) {
+        /* Ask a second replica when the first byte is later than this
+           percentile of them, 0 doesn't hedge. */
+        tmp = strtol(argv[i] + 6, &end, 10);
+        if (*end == '\0' && tmp >= 0 && tmp < 100) {
+          origin_hedging.percentile = tmp;
+          TSDebug("HTTP_plugin", "using hedge %d", origin_hedging.percentile);
+          printf("[protocol_plugin] using hedge %d\n", origin_hedging.percentile);
+        } else {
+          printf("[protocol_plugin] Wrong argument for hedge.");
+          printf("Using default %d\n", origin_hedging.percentile);
+        }
+      } else if (strncmp(argv[i], "hedge_budget=", 13) == 0) {
+        /* Percentage of the requests that may be sent twice. */
+        tmp = strtol(argv[i] + 13, &end, 10);
+        if (*end == '\0' && tmp >= 1 && tmp <= 100) {
+          origin_hedging.budget = tmp;
+          TSDebug("HTTP_plugin", "using hedge_budget %d", origin_hedging.budget);
+          printf("[protocol_plugin] using hedge_budget %d\n", origin_hedging.budget);
+        } else {
+          printf("[protocol_plugin] Wrong argument for hedge_budget.");
+          printf("Using default %d\n", origin_hedging.budget);
+        }
+      } else if (strncmp(argv[i], "origin_ca=", 10) == 0) {
+        /* CAs the certificates of the https:// replicas are checked
+           against, instead of the system ones. */
+        free(origin_ca_file);
+        origin_ca_file = strdup(argv[i] + 10);
+        TSDebug("HTTP_plugin", "using origin_ca %s", origin_ca_file);
+        printf("[protocol_plugin] using origin_ca %s\n", origin_ca_file);
+      } else if (strncmp(argv[i], "prefetch_connections=", 21) == 0) {
+        /* Keep-alive connections the prefetches of a page are pipelined
+           on, 0 opens one per object. */
+        tmp = strtol(argv[i] + 21, &end, 10);
+        if (*end == '\0' && tmp >= 0) {
+          prefetch_connections = tmp;
+          TSDebug("HTTP_plugin", "using prefetch_connections %d", prefetch_connections);
+          printf("[protocol_plugin] using prefetch_connections %d\n", prefetch_connections);
+        } else {
+          printf("[protocol_plugin] Wrong argument for prefetch_connections.");
+          printf("Using default %d\n", prefetch_connections);
+        }
+      } else if (strncmp(argv[i], "max_transactions=", 17) == 0) {
+        /* Transactions run at once, the next connections wait; 0 doesn't
+           limit. */
+        tmp = strtol(argv[i] + 17, &end, 10);
+        if (*end == '\0' && tmp >= 0) {
+          overload_limits.transactions = tmp;
+          TSDebug("HTTP_plugin", "using max_transactions %d", overload_limits.transactions);
+          printf("[protocol_plugin] using max_transactions %d\n", overload_limits.transactions);
+        } else {
+          printf("[protocol_plugin] Wrong argument for max_transactions.");
+          printf("Using default %d\n", overload_limits.transactions);
+        }
+      } else if (strncmp(argv[i], "max_fetches=", 12) == 0) {
+        /* Origin fetches, demand and prefetch, past which only hits are
+           served; 0 doesn't limit. */
+        tmp = strtol(argv[i] + 12, &end, 10);
+        if (*end == '\0' && tmp >= 0) {
+          overload_limits.fetches = tmp;
+          TSDebug("HTTP_plugin", "using max_fetches %d", overload_limits.fetches);
+          printf("[protocol_plugin] using max_fetches %d\n", overload_limits.fetches);
+        } else {
+          printf("[protocol_plugin] Wrong argument for max_fetches.");
+          printf("Using default %d\n", overload_limits.fetches);
+        }
+      } else {
+        printf("[protocol_plugin] Unknown argument %s\n", argv[i]);
+      }
+    }
   }
 
   protocol_init(accept_port, server_port);
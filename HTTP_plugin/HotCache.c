@@ -0,0 +1,343 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef HOT_CACHE_H
+#define HOT_CACHE_H
+
+/* RAM copy of small objects served from the cache, checked before the
+   cache itself. The objects are spread over shards by the hash of
+   their name, each with its own lock and its own part of the size. */
+#define HOT_CACHE_SIZE (32 * 1024 * 1024)
+#define HOT_CACHE_SHARDS 16
+#define HOT_CACHE_BUCKETS 1024
+
+/* Bigger objects are read from the cache. */
+#define HOT_CACHE_MAX_OBJECT_SIZE (32 * 1024)
+
+/* Names recently evicted from the small queue, per shard. */
+#define HOT_CACHE_GHOST_ENTRIES 1024
+
+int HotCacheInit(void);
+int64_t HotCacheWrite(const char *name, TSIOBuffer buffer);
+void HotCacheInsert(const char *name, const char *data, int length);
+void HotCacheRemove(const char *name);
+
+#endif /* HOT_CACHE_H */
+
+/* The eviction is S3-FIFO: new objects go through a small FIFO queue,
+   and only the ones hit again while there move to the main queue. A
+   burst of objects seen once, such as a prefetch, only churns the
+   small queue and can't push the hot objects out. */
+
+typedef struct _HotObject {
+  struct _HotObject *hash_next;
+  struct _HotObject *queue_next;
+  struct _HotObject *queue_prev;
+  uint64_t hash;
+  char *name;
+  char *data;
+  int length;
+  int freq;    /* hits since it was queued, up to 3 */
+  int in_main; /* in the main queue, not the small one */
+} HotObject;
+
+typedef struct {
+  HotObject *head;
+  HotObject *tail;
+  int64_t bytes;
+} HotQueue;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  HotObject *table[HOT_CACHE_BUCKETS];
+  HotQueue small;
+  HotQueue main;
+  uint64_t ghost[HOT_CACHE_GHOST_ENTRIES];
+  int ghost_next;
+} HotShard;
+
+static HotShard *hot_shards;
+
+int
+HotCacheInit(void)
+{
+  int i;
+
+  hot_shards = (HotShard *)calloc(HOT_CACHE_SHARDS, sizeof(HotShard));
+  if (hot_shards == NULL)
+    return -1;
+  for (i = 0; i < HOT_CACHE_SHARDS; i++)
+    pthread_mutex_init(&hot_shards[i].mutex, NULL);
+  return 0;
+}
+
+static HotShard *
+hot_shard(uint64_t hash)
+{
+  return &hot_shards[(hash >> 32) % HOT_CACHE_SHARDS];
+}
+
+static HotObject **
+hot_bucket(HotShard *shard, uint64_t hash)
+{
+  return &shard->table[hash % HOT_CACHE_BUCKETS];
+}
+
+static HotObject *
+hot_find(HotShard *shard, uint64_t hash, const char *name)
+{
+  HotObject *object;
+
+  for (object = *hot_bucket(shard, hash); object; object = object->hash_next) {
+    if (object->hash == hash && strcmp(object->name, name) == 0)
+      return object;
+  }
+  return NULL;
+}
+
+static void
+hot_queue_push(HotQueue *queue, HotObject *object)
+{
+  object->queue_next = NULL;
+  object->queue_prev = queue->tail;
+  if (queue->tail)
+    queue->tail->queue_next = object;
+  else
+    queue->head = object;
+  queue->tail = object;
+}
+
+static void
+hot_queue_remove(HotQueue *queue, HotObject *object)
+{
+  if (object->queue_prev)
+    object->queue_prev->queue_next = object->queue_next;
+  else
+    queue->head = object->queue_next;
+  if (object->queue_next)
+    object->queue_next->queue_prev = object->queue_prev;
+  else
+    queue->tail = object->queue_prev;
+  object->queue_next = NULL;
+  object->queue_prev = NULL;
+}
+
+static HotObject *
+hot_queue_pop(HotQueue *queue)
+{
+  HotObject *object = queue->head;
+
+  if (object)
+    hot_queue_remove(queue, object);
+  return object;
+}
+
+/* Take the object out of the table and free it. It is out of its
+   queue already, its bytes are still counted in queue. */
+static void
+hot_free(HotShard *shard, HotQueue *queue, HotObject *object)
+{
+  HotObject **p;
+
+  for (p = hot_bucket(shard, object->hash); *p; p = &(*p)->hash_next) {
+    if (*p == object) {
+      *p = object->hash_next;
+      break;
+    }
+  }
+  queue->bytes -= object->length;
+  free(object->data);
+  free(object->name);
+  free(object);
+}
+
+/* Take the object out of its queue and the table, and free it. */
+static void
+hot_unlink(HotShard *shard, HotQueue *queue, HotObject *object)
+{
+  hot_queue_remove(queue, object);
+  hot_free(shard, queue, object);
+}
+
+static int
+hot_ghost_has(HotShard *shard, uint64_t hash)
+{
+  int i;
+
+  for (i = 0; i < HOT_CACHE_GHOST_ENTRIES; i++) {
+    if (shard->ghost[i] == hash)
+      return 1;
+  }
+  return 0;
+}
+
+/* Objects hit more than once while in the small queue are moved to the
+   main one, the others are dropped and remembered in the ghost. */
+static void
+hot_evict_small(HotShard *shard)
+{
+  HotObject *object = hot_queue_pop(&shard->small);
+
+  if (object->freq > 1) {
+    shard->small.bytes -= object->length;
+    shard->main.bytes += object->length;
+    object->freq    = 0;
+    object->in_main = 1;
+    hot_queue_push(&shard->main, object);
+  } else {
+    shard->ghost[shard->ghost_next] = object->hash;
+    shard->ghost_next               = (shard->ghost_next + 1) % HOT_CACHE_GHOST_ENTRIES;
+    hot_free(shard, &shard->small, object);
+  }
+}
+
+/* Objects of the main queue hit since they were queued go round once
+   more, with one hit less. */
+static void
+hot_evict_main(HotShard *shard)
+{
+  HotObject *object = hot_queue_pop(&shard->main);
+
+  if (object->freq > 0) {
+    object->freq--;
+    hot_queue_push(&shard->main, object);
+  } else {
+    hot_free(shard, &shard->main, object);
+  }
+}
+
+static void
+hot_evict(HotShard *shard)
+{
+  const int64_t size = HOT_CACHE_SIZE / HOT_CACHE_SHARDS;
+
+  while (shard->small.bytes + shard->main.bytes > size) {
+    if (shard->small.head && (shard->small.bytes > size / 10 || shard->main.head == NULL))
+      hot_evict_small(shard);
+    else if (shard->main.head)
+      hot_evict_main(shard);
+    else
+      break;
+  }
+}
+
+static HotQueue *
+hot_queue_of(HotShard *shard, HotObject *object)
+{
+  return object->in_main ? &shard->main : &shard->small;
+}
+
+/* Write the stored response of name into buffer. Returns its length,
+   or -1 if it isn't in RAM. */
+int64_t
+HotCacheWrite(const char *name, TSIOBuffer buffer)
+{
+  uint64_t hash;
+  HotShard *shard;
+  HotObject *object;
+  int64_t length = -1;
+
+  if (hot_shards == NULL)
+    return -1;
+  hash  = CacheNameHash(name);
+  shard = hot_shard(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  object = hot_find(shard, hash, name);
+  if (object) {
+    if (object->freq < 3)
+      object->freq++;
+    TSIOBufferWrite(buffer, object->data, object->length);
+    length = object->length;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return length;
+}
+
+void
+HotCacheRemove(const char *name)
+{
+  uint64_t hash;
+  HotShard *shard;
+  HotObject *object;
+
+  if (hot_shards == NULL)
+    return;
+  hash  = CacheNameHash(name);
+  shard = hot_shard(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  object = hot_find(shard, hash, name);
+  if (object)
+    hot_unlink(shard, hot_queue_of(shard, object), object);
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Keep a copy of a stored response. It replaces the one of the same
+   name; a name evicted lately goes straight to the main queue. */
+void
+HotCacheInsert(const char *name, const char *data, int length)
+{
+  uint64_t hash;
+  HotShard *shard;
+  HotObject *object;
+  HotQueue *queue;
+
+  if (hot_shards == NULL)
+    return;
+  if (length <= 0 || length > HOT_CACHE_MAX_OBJECT_SIZE) {
+    HotCacheRemove(name);
+    return;
+  }
+
+  object = (HotObject *)calloc(1, sizeof(HotObject));
+  if (object == NULL)
+    return;
+  object->name = strdup(name);
+  object->data = (char *)malloc(length);
+  if (!object->name || !object->data) {
+    free(object->name);
+    free(object->data);
+    free(object);
+    return;
+  }
+  memcpy(object->data, data, length);
+  object->length = length;
+  object->hash   = hash = CacheNameHash(name);
+  shard          = hot_shard(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  {
+    HotObject *old = hot_find(shard, hash, name);
+
+    if (old)
+      hot_unlink(shard, hot_queue_of(shard, old), old);
+  }
+  object->in_main = hot_ghost_has(shard, hash);
+  queue           = hot_queue_of(shard, object);
+  object->hash_next        = *hot_bucket(shard, hash);
+  *hot_bucket(shard, hash) = object;
+  queue->bytes += length;
+  hot_queue_push(queue, object);
+  hot_evict(shard);
+  pthread_mutex_unlock(&shard->mutex);
+}
@@ -0,0 +1,134 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <pthread.h>
+#include <ts/ts.h>
+#ifndef IO_BUFFER_POOL_H
+#define IO_BUFFER_POOL_H
+
+/* Object classes of the buffers used by a TxnSM. Each class has its
+   own block size and water mark, and its own free list. */
+typedef enum {
+  TXN_BUFFER_REQUEST = 0, /* client request, request to the origin */
+  TXN_BUFFER_OBJECT,      /* small embedded objects (js, css, icons) */
+  TXN_BUFFER_LARGE,       /* pages, cache reads and big objects */
+  TXN_BUFFER_CLASS_COUNT
+} TxnBufferClass;
+
+/* Objects up to this size are written through a TXN_BUFFER_OBJECT buffer. */
+#define TXN_BUFFER_SMALL_OBJECT_SIZE (32 * 1024)
+
+/* Number of idle buffers kept for each class. */
+#define TXN_BUFFER_POOL_MAX 128
+
+TSIOBuffer IOBufferPoolGet(TxnBufferClass buffer_class, TSIOBufferReader *reader);
+void IOBufferPoolPut(TxnBufferClass buffer_class, TSIOBuffer buffer, TSIOBufferReader reader);
+TxnBufferClass IOBufferClassForSize(int64_t size);
+
+#endif /* IO_BUFFER_POOL_H */
+
+typedef struct {
+  TSIOBufferSizeIndex size_index;
+  int64_t water_mark;
+} TxnBufferClassInfo;
+
+/* The water mark of the large class lets the producer run ahead of
+   the consumer by a few blocks, so big transfers don't stall on every
+   block, while still bounding the memory held by one transfer. */
+static const TxnBufferClassInfo txn_buffer_class_info[TXN_BUFFER_CLASS_COUNT] = {
+  {TS_IOBUFFER_SIZE_INDEX_4K, 4 * 1024},
+  {TS_IOBUFFER_SIZE_INDEX_8K, 32 * 1024},
+  {TS_IOBUFFER_SIZE_INDEX_32K, 128 * 1024},
+};
+
+/* A pooled buffer always keeps its first reader. When it is put back
+   the reader consumes what is left, so the next user starts with an
+   empty buffer and a reader at the right position. */
+static TSIOBuffer pool_buffer[TXN_BUFFER_CLASS_COUNT][TXN_BUFFER_POOL_MAX];
+static TSIOBufferReader pool_reader[TXN_BUFFER_CLASS_COUNT][TXN_BUFFER_POOL_MAX];
+static int pool_count[TXN_BUFFER_CLASS_COUNT];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+TxnBufferClass
+IOBufferClassForSize(int64_t size)
+{
+  return size <= TXN_BUFFER_SMALL_OBJECT_SIZE ? TXN_BUFFER_OBJECT : TXN_BUFFER_LARGE;
+}
+
+/* Get a buffer of the given class with its reader. Returns NULL if
+   the buffer can't be created. */
+TSIOBuffer
+IOBufferPoolGet(TxnBufferClass buffer_class, TSIOBufferReader *reader)
+{
+  TSIOBuffer buffer = NULL;
+
+  *reader = NULL;
+
+  pthread_mutex_lock(&pool_lock);
+  if (pool_count[buffer_class] > 0) {
+    pool_count[buffer_class]--;
+    buffer  = pool_buffer[buffer_class][pool_count[buffer_class]];
+    *reader = pool_reader[buffer_class][pool_count[buffer_class]];
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (buffer)
+    return buffer;
+
+  buffer = TSIOBufferSizedCreate(txn_buffer_class_info[buffer_class].size_index);
+  if (!buffer)
+    return NULL;
+  TSIOBufferWaterMarkSet(buffer, txn_buffer_class_info[buffer_class].water_mark);
+
+  *reader = TSIOBufferReaderAlloc(buffer);
+  if (!*reader) {
+    TSIOBufferDestroy(buffer);
+    return NULL;
+  }
+  return buffer;
+}
+
+/* Return a buffer and its reader. Other readers of the buffer must be
+   freed already and no VIO may still use it. */
+void
+IOBufferPoolPut(TxnBufferClass buffer_class, TSIOBuffer buffer, TSIOBufferReader reader)
+{
+  if (!buffer)
+    return;
+
+  if (!reader) {
+    TSIOBufferDestroy(buffer);
+    return;
+  }
+
+  TSIOBufferReaderConsume(reader, TSIOBufferReaderAvail(reader));
+
+  pthread_mutex_lock(&pool_lock);
+  if (pool_count[buffer_class] < TXN_BUFFER_POOL_MAX) {
+    pool_buffer[buffer_class][pool_count[buffer_class]] = buffer;
+    pool_reader[buffer_class][pool_count[buffer_class]] = reader;
+    pool_count[buffer_class]++;
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (buffer) {
+    TSIOBufferReaderFree(reader);
+    TSIOBufferDestroy(buffer);
+  }
+}
@@ -0,0 +1,216 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#ifndef LINK_CRAWL_H
+#define LINK_CRAWL_H
+
+/* The first line is the name of the origin server, the next ones its
+   replicas (see OriginHealth.c) and the crawl rules, robots.txt style:
+     Crawl: /news/          pages whose links are followed
+     Disallow: /news/old/   links never followed
+     Allow: /news/old/today.htm
+   A pattern matches the start of a path, '*' any characters and a
+   final '$' the end of the path. Between Allow and Disallow the
+   longest matching pattern wins, Allow if they are as long. */
+#define HOST_CONF_PATH "/srv/datavol/cdn/host.conf"
+#define CRAWL_MAX_RULES 64
+#define CRAWL_MAX_PATTERN_LENGTH 200
+
+/* Links of the pages of each origin followed per second, with bursts
+   of up to CRAWL_BURST_SECONDS worth of them. */
+#define CRAWL_MAX_ORIGINS 8
+#define CRAWL_BURST_SECONDS 10
+
+int CrawlInit(const char *path, int rate);
+int CrawlSelected(const char *path);
+int CrawlAllowed(const char *path);
+int CrawlTake(const char *origin);
+
+#endif /* LINK_CRAWL_H */
+
+typedef enum {
+  CRAWL_RULE_CRAWL,
+  CRAWL_RULE_ALLOW,
+  CRAWL_RULE_DISALLOW,
+} CrawlRuleKind;
+
+typedef struct {
+  CrawlRuleKind kind;
+  char pattern[CRAWL_MAX_PATTERN_LENGTH];
+  int length;
+} CrawlRule;
+
+typedef struct {
+  char name[MAX_SERVER_NAME_LENGTH + 1];
+  double tokens;
+  TSHRTime refilled_at;
+} CrawlOrigin;
+
+static CrawlRule crawl_rules[CRAWL_MAX_RULES];
+static int crawl_rule_count;
+static CrawlOrigin crawl_origins[CRAWL_MAX_ORIGINS];
+static int crawl_tokens_per_second;
+static pthread_mutex_t crawl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct {
+  const char *key;
+  CrawlRuleKind kind;
+} crawl_keys[] = {
+  {"Crawl:", CRAWL_RULE_CRAWL},
+  {"Allow:", CRAWL_RULE_ALLOW},
+  {"Disallow:", CRAWL_RULE_DISALLOW},
+};
+
+/* Read the rules of the file path. Lines that aren't rules, such as
+   the server name, are skipped. */
+int
+CrawlInit(const char *path, int rate)
+{
+  char line[CRAWL_MAX_PATTERN_LENGTH + 16];
+  FILE *file;
+  size_t i;
+
+  crawl_tokens_per_second = rate;
+  file                    = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+
+  while (fgets(line, sizeof(line), file) && crawl_rule_count < CRAWL_MAX_RULES) {
+    for (i = 0; i < sizeof(crawl_keys) / sizeof(crawl_keys[0]); i++) {
+      size_t key_length = strlen(crawl_keys[i].key);
+      CrawlRule *rule   = &crawl_rules[crawl_rule_count];
+      char *value;
+
+      if (strncasecmp(line, crawl_keys[i].key, key_length) != 0)
+        continue;
+      value = line + key_length;
+      value += strspn(value, " \t");
+      value[strcspn(value, " \t\r\n#")] = '\0';
+      /* An empty Disallow allows everything, like in robots.txt. */
+      if (*value != '/')
+        break;
+      rule->kind = crawl_keys[i].kind;
+      snprintf(rule->pattern, sizeof(rule->pattern), "%s", value);
+      rule->length = strlen(rule->pattern);
+      crawl_rule_count++;
+      break;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+static int
+crawl_match(const char *pattern, const char *path)
+{
+  for (; *pattern; pattern++, path++) {
+    if (*pattern == '*') {
+      do {
+        if (crawl_match(pattern + 1, path))
+          return 1;
+      } while (*path++);
+      return 0;
+    }
+    if (*pattern == '$' && pattern[1] == '\0')
+      return *path == '\0';
+    if (*pattern != *path)
+      return 0;
+  }
+  return 1;
+}
+
+/* 1 if path may be crawled, 0 if a Disallow rule says otherwise. */
+int
+CrawlAllowed(const char *path)
+{
+  int i, longest = -1, allowed = 1;
+
+  for (i = 0; i < crawl_rule_count; i++) {
+    CrawlRule *rule = &crawl_rules[i];
+
+    if (rule->kind == CRAWL_RULE_CRAWL || rule->length < longest || !crawl_match(rule->pattern, path))
+      continue;
+    if (rule->length > longest)
+      allowed = rule->kind == CRAWL_RULE_ALLOW;
+    else
+      allowed |= rule->kind == CRAWL_RULE_ALLOW;
+    longest = rule->length;
+  }
+  return allowed;
+}
+
+/* 1 if the links of the page path are to be followed. */
+int
+CrawlSelected(const char *path)
+{
+  int i;
+
+  for (i = 0; i < crawl_rule_count; i++) {
+    if (crawl_rules[i].kind == CRAWL_RULE_CRAWL && crawl_match(crawl_rules[i].pattern, path))
+      return CrawlAllowed(path);
+  }
+  return 0;
+}
+
+/* Take the right to fetch one more link from origin. 0 when its
+   bucket is empty, or when all the buckets are already given to other
+   origins. */
+int
+CrawlTake(const char *origin)
+{
+  CrawlOrigin *bucket = NULL;
+  TSHRTime now;
+  int i, taken = 0;
+
+  if (crawl_tokens_per_second <= 0)
+    return 0;
+  now = TShrtime();
+
+  pthread_mutex_lock(&crawl_mutex);
+  for (i = 0; i < CRAWL_MAX_ORIGINS; i++) {
+    if (crawl_origins[i].name[0] == '\0') {
+      bucket = &crawl_origins[i];
+      snprintf(bucket->name, sizeof(bucket->name), "%s", origin);
+      bucket->tokens      = crawl_tokens_per_second * CRAWL_BURST_SECONDS;
+      bucket->refilled_at = now;
+      break;
+    }
+    if (strcmp(crawl_origins[i].name, origin) == 0) {
+      bucket = &crawl_origins[i];
+      break;
+    }
+  }
+
+  if (bucket) {
+    bucket->tokens += (double)(now - bucket->refilled_at) * crawl_tokens_per_second / 1000000000.0;
+    if (bucket->tokens > crawl_tokens_per_second * CRAWL_BURST_SECONDS)
+      bucket->tokens = crawl_tokens_per_second * CRAWL_BURST_SECONDS;
+    bucket->refilled_at = now;
+    if (bucket->tokens >= 1) {
+      bucket->tokens--;
+      taken = 1;
+    }
+  }
+  pthread_mutex_unlock(&crawl_mutex);
+  return taken;
+}
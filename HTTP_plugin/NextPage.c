@@ -0,0 +1,149 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef NEXT_PAGE_H
+#define NEXT_PAGE_H
+
+/* First order Markov model of the navigation between pages: for each
+   page, the pages most often visited from it. Direct mapped by the
+   hash of the page, a collision forgets the older page. */
+#define NEXT_PAGE_SOURCES 2048
+#define NEXT_PAGE_CANDIDATES 4
+#define NEXT_PAGE_MAX_LENGTH 200
+
+/* A page is warmed when at least NEXT_PAGE_THRESHOLD percent of the
+   NEXT_PAGE_MIN_SAMPLES or more visits seen went there. Counts are
+   halved at NEXT_PAGE_MAX_SAMPLES, so old habits fade out. */
+#define NEXT_PAGE_MIN_SAMPLES 4
+#define NEXT_PAGE_MAX_SAMPLES 256
+#define NEXT_PAGE_THRESHOLD 30
+
+/* A predicted page isn't warmed again before this long. */
+#define NEXT_PAGE_REWARM_SECONDS 300
+
+int NextPageInit(void);
+void NextPageRecord(const char *from, const char *to);
+int NextPagePredict(const char *from, char (*paths)[NEXT_PAGE_MAX_LENGTH], int max);
+
+#endif /* NEXT_PAGE_H */
+
+typedef struct {
+  char path[NEXT_PAGE_MAX_LENGTH];
+  int count;
+  TSHRTime warmed_at;
+} NextPageCandidate;
+
+typedef struct {
+  uint64_t hash;
+  int total;
+  NextPageCandidate next[NEXT_PAGE_CANDIDATES];
+} NextPageSource;
+
+static NextPageSource *next_page_sources;
+static pthread_mutex_t next_page_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int
+NextPageInit(void)
+{
+  next_page_sources = (NextPageSource *)calloc(NEXT_PAGE_SOURCES, sizeof(NextPageSource));
+  return next_page_sources ? 0 : -1;
+}
+
+/* A client went from page from to page to. A new destination takes the
+   place of the least visited one. */
+void
+NextPageRecord(const char *from, const char *to)
+{
+  NextPageSource *source;
+  NextPageCandidate *candidate = NULL;
+  uint64_t hash;
+  int i;
+
+  if (next_page_sources == NULL || strlen(to) >= NEXT_PAGE_MAX_LENGTH || strcmp(from, to) == 0)
+    return;
+  hash = CacheNameHash(from);
+
+  pthread_mutex_lock(&next_page_mutex);
+  source = &next_page_sources[hash % NEXT_PAGE_SOURCES];
+  if (source->hash != hash) {
+    memset(source, 0, sizeof(*source));
+    source->hash = hash;
+  }
+
+  for (i = 0; i < NEXT_PAGE_CANDIDATES; i++) {
+    if (source->next[i].count > 0 && strcmp(source->next[i].path, to) == 0) {
+      candidate = &source->next[i];
+      break;
+    }
+    if (candidate == NULL || source->next[i].count < candidate->count)
+      candidate = &source->next[i];
+  }
+  if (candidate->count == 0 || strcmp(candidate->path, to) != 0) {
+    snprintf(candidate->path, sizeof(candidate->path), "%s", to);
+    candidate->count     = 0;
+    candidate->warmed_at = 0;
+  }
+  candidate->count++;
+
+  if (++source->total >= NEXT_PAGE_MAX_SAMPLES) {
+    source->total = 0;
+    for (i = 0; i < NEXT_PAGE_CANDIDATES; i++) {
+      source->next[i].count /= 2;
+      source->total += source->next[i].count;
+    }
+  }
+  pthread_mutex_unlock(&next_page_mutex);
+}
+
+/* Copy into paths the pages likely to be visited next from page from
+   and not warmed lately. Returns how many. */
+int
+NextPagePredict(const char *from, char (*paths)[NEXT_PAGE_MAX_LENGTH], int max)
+{
+  NextPageSource *source;
+  TSHRTime now;
+  uint64_t hash;
+  int i, n = 0;
+
+  if (next_page_sources == NULL)
+    return 0;
+  hash = CacheNameHash(from);
+  now  = TShrtime();
+
+  pthread_mutex_lock(&next_page_mutex);
+  source = &next_page_sources[hash % NEXT_PAGE_SOURCES];
+  if (source->hash == hash && source->total >= NEXT_PAGE_MIN_SAMPLES) {
+    for (i = 0; i < NEXT_PAGE_CANDIDATES && n < max; i++) {
+      NextPageCandidate *candidate = &source->next[i];
+
+      if (candidate->count * 100 < source->total * NEXT_PAGE_THRESHOLD)
+        continue;
+      if (candidate->warmed_at && now - candidate->warmed_at < (TSHRTime)NEXT_PAGE_REWARM_SECONDS * 1000000000)
+        continue;
+      candidate->warmed_at = now;
+      memcpy(paths[n++], candidate->path, NEXT_PAGE_MAX_LENGTH);
+    }
+  }
+  pthread_mutex_unlock(&next_page_mutex);
+  return n;
+}
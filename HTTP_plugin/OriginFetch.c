@@ -0,0 +1,804 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <ts/ts.h>
+#ifndef ORIGIN_FETCH_H
+#define ORIGIN_FETCH_H
+
+/* Bytes moved from the origin socket to the transaction at a time. */
+#define ORIGIN_FETCH_CHUNK_SIZE (16 * 1024)
+
+/* Socket buffer between the fetch thread and the transaction. When it
+   is full the fetch thread stops reading the origin server. */
+#define ORIGIN_FETCH_PIPE_SIZE (64 * 1024)
+
+/* Happy eyeballs (RFC 8305): the addresses of the origin are tried in
+   turn, IPv6 and IPv4 alternately, a new one every
+   ORIGIN_CONNECT_STAGGER_MS or as soon as the previous one fails, the
+   first connected one wins. */
+#define ORIGIN_CONNECT_STAGGER_MS 250
+#define ORIGIN_CONNECT_MAX_ADDRESSES 16
+
+/* A connection to a replica of the origin, through TLS if it wants. */
+typedef struct {
+  int fd;
+  SSL *ssl;
+  OriginServer *server;
+} OriginConn;
+
+/* Connections opened while the cache is looked up, for a request that
+   will likely miss. They wait for a request to the same replica, demand
+   or prefetch, for at most ORIGIN_WARM_IDLE_MS: origins close the
+   connections that send nothing. */
+#define ORIGIN_WARM_MAX 16
+#define ORIGIN_WARM_IDLE_MS 2000
+
+/* A demand fetch, shared by its thread and its transaction. */
+typedef struct _OriginFetchJob OriginFetchJob;
+
+void OriginDeadlineSet(TSHRTime deadline);
+int origin_connect(const char *server_name, int port);
+int origin_send_all(int fd, const char *data, size_t length);
+ssize_t origin_read(OriginConn *conn, char *buffer, size_t size, int timeout_ms);
+int OriginOpen(const char *server_name, int port, const char *request, int hedge, char *buffer, int size, int *length,
+               OriginConn *conn);
+void OriginClose(OriginConn *conn);
+void OriginWarm(const char *server_name, int port);
+TSVConn OriginFetchStart(const char *server_name, int port, const char *request, OriginFetchJob **job);
+int OriginFetchStatus(OriginFetchJob *job);
+void OriginFetchRelease(OriginFetchJob *job);
+
+#endif /* ORIGIN_FETCH_H */
+
+struct _OriginFetchJob {
+  char server_name[MAX_SERVER_NAME_LENGTH + 1];
+  int port;
+  int pipe_fd;
+  char request[MAX_REQUEST_LENGTH + 1];
+  int status; /* 502 or 504 if the origin was given up, set before the pipe is closed */
+  int refs;   /* the thread and the transaction */
+};
+
+typedef struct {
+  char server_name[MAX_SERVER_NAME_LENGTH + 1];
+  int port;
+} OriginWarmJob;
+
+typedef struct {
+  OriginConn conn;
+  TSHRTime opened_at;
+} OriginWarmConn;
+
+/* Time by which the origin requests of this thread must be done, 0 if
+   only their timeouts bound them. A prefetch batch sets one for its
+   threads, so the batch as a whole can't take longer. */
+static __thread TSHRTime origin_deadline;
+
+static OriginWarmConn origin_warm[ORIGIN_WARM_MAX];
+static int origin_warm_count;   /* waiting in origin_warm */
+static int origin_warm_pending; /* being opened */
+static pthread_mutex_t origin_warm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+OriginDeadlineSet(TSHRTime deadline)
+{
+  origin_deadline = deadline;
+}
+
+/* timeout_ms, cut to what is left before the deadline of the thread. */
+static int
+origin_timeout(int timeout_ms)
+{
+  TSHRTime now;
+
+  if (origin_deadline == 0)
+    return timeout_ms;
+  now = TShrtime();
+  if (now >= origin_deadline)
+    return 0;
+  if ((origin_deadline - now) / 1000000 < (TSHRTime)timeout_ms)
+    return (origin_deadline - now) / 1000000 + 1;
+  return timeout_ms;
+}
+
+/* Order the addresses of result like RFC 8305 says: the first family
+   first, then the other one and the first alternately. */
+static int
+origin_sort_addresses(struct addrinfo *result, struct addrinfo **addresses)
+{
+  struct addrinfo *first[ORIGIN_CONNECT_MAX_ADDRESSES], *other[ORIGIN_CONNECT_MAX_ADDRESSES];
+  struct addrinfo *ai;
+  int n_first = 0, n_other = 0, i, n = 0;
+
+  for (ai = result; ai != NULL; ai = ai->ai_next) {
+    if (ai->ai_family == result->ai_family && n_first < ORIGIN_CONNECT_MAX_ADDRESSES)
+      first[n_first++] = ai;
+    else if (ai->ai_family != result->ai_family && n_other < ORIGIN_CONNECT_MAX_ADDRESSES)
+      other[n_other++] = ai;
+  }
+  for (i = 0; n < ORIGIN_CONNECT_MAX_ADDRESSES && (i < n_first || i < n_other); i++) {
+    if (i < n_first)
+      addresses[n++] = first[i];
+    if (i < n_other && n < ORIGIN_CONNECT_MAX_ADDRESSES)
+      addresses[n++] = other[i];
+  }
+  return n;
+}
+
+/* Start a non-blocking connect to ai. Returns the socket, -1 if the
+   connect failed already. */
+static int
+origin_connect_start(struct addrinfo *ai)
+{
+  int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+
+  if (fd < 0)
+    return -1;
+  if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+    return fd;
+  close(fd);
+  return -1;
+}
+
+/* Open a TCP connection to server_name:port, racing its IPv6 and IPv4
+   addresses. Returns the non-blocking socket, or -1 if the name can't
+   be resolved or no address accepts within origin_timeouts.connect_ms. */
+int
+origin_connect(const char *server_name, int port)
+{
+  struct addrinfo hints;
+  struct addrinfo *result;
+  struct addrinfo *addresses[ORIGIN_CONNECT_MAX_ADDRESSES];
+  struct pollfd pfds[ORIGIN_CONNECT_MAX_ADDRESSES];
+  TSHRTime deadline, next_start;
+  socklen_t length;
+  char port_str[16];
+  int n, next = 0, pending = 0, sockfd = -1, i, ret, wait_ms, error;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_ADDRCONFIG;
+  snprintf(port_str, sizeof(port_str), "%d", port);
+
+  if (getaddrinfo(server_name, port_str, &hints, &result) != 0) {
+    TSError("[protocol] no such host %s", server_name);
+    return -1;
+  }
+  n = origin_sort_addresses(result, addresses);
+
+  deadline   = TShrtime() + (TSHRTime)origin_timeout(origin_timeouts.connect_ms) * 1000000;
+  next_start = 0;
+  errno      = ECONNREFUSED;
+  while (sockfd < 0) {
+    TSHRTime now = TShrtime();
+
+    /* Next address: its turn has come, or nothing is left to wait for. */
+    while (next < n && (pending == 0 || now >= next_start)) {
+      pfds[pending].fd     = origin_connect_start(addresses[next++]);
+      pfds[pending].events = POLLOUT;
+      if (pfds[pending].fd >= 0) {
+        pending++;
+        next_start = now + (TSHRTime)ORIGIN_CONNECT_STAGGER_MS * 1000000;
+        break;
+      }
+    }
+    if (pending == 0 || now >= deadline) {
+      if (pending > 0)
+        errno = ETIMEDOUT;
+      break;
+    }
+
+    wait_ms = (deadline - now) / 1000000 + 1;
+    if (next < n && (next_start - now) / 1000000 + 1 < wait_ms)
+      wait_ms = (next_start - now) / 1000000 + 1;
+    ret = poll(pfds, pending, wait_ms);
+    if (ret <= 0)
+      continue;
+
+    for (i = 0; i < pending; i++) {
+      if (!pfds[i].revents)
+        continue;
+      error  = 0;
+      length = sizeof(error);
+      if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+        sockfd = pfds[i].fd;
+      } else {
+        errno = error;
+        close(pfds[i].fd);
+      }
+      /* A failed address lets the next one start at once. */
+      pfds[i--] = pfds[--pending];
+      next_start = 0;
+      if (sockfd >= 0)
+        break;
+    }
+  }
+
+  for (i = 0; i < pending; i++)
+    close(pfds[i].fd);
+  freeaddrinfo(result);
+
+  if (sockfd < 0) {
+    error = errno;
+    TSError("[protocol] connect to %s:%d failed: %s", server_name, port, strerror(error));
+    errno = error;
+    return -1;
+  }
+  return sockfd;
+}
+
+/* Write all of data, the peer going away must not raise SIGPIPE. */
+int
+origin_send_all(int fd, const char *data, size_t length)
+{
+  ssize_t n;
+
+  while (length > 0) {
+    n = send(fd, data, length, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/* Read what conn has at hand. ORIGIN_AGAIN if it has to wait. */
+#define ORIGIN_AGAIN -2
+static ssize_t
+origin_read_some(OriginConn *conn, char *buffer, size_t size)
+{
+  ssize_t n;
+  int error;
+
+  if (conn->ssl == NULL) {
+    n = read(conn->fd, buffer, size);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return ORIGIN_AGAIN;
+    return n;
+  }
+
+  n = SSL_read(conn->ssl, buffer, size);
+  if (n > 0)
+    return n;
+  error = SSL_get_error(conn->ssl, n);
+  if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    return ORIGIN_AGAIN;
+  if (error == SSL_ERROR_ZERO_RETURN)
+    return 0;
+  ERR_clear_error();
+  errno = EIO;
+  return -1;
+}
+
+/* Wait up to timeout_ms for conn to be readable or writable. */
+static int
+origin_wait(OriginConn *conn, short events, int timeout_ms)
+{
+  struct pollfd pfd;
+  int ret;
+
+  if (timeout_ms <= 0) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  pfd.fd     = conn->fd;
+  pfd.events = events;
+  ret        = poll(&pfd, 1, timeout_ms);
+  if (ret == 0)
+    errno = ETIMEDOUT;
+  return ret < 0 && errno == EINTR ? 0 : (ret > 0 ? 0 : -1);
+}
+
+/* Read what conn has, waiting up to timeout_ms for it. Returns -1 with
+   errno ETIMEDOUT if nothing came. */
+ssize_t
+origin_read(OriginConn *conn, char *buffer, size_t size, int timeout_ms)
+{
+  TSHRTime deadline = TShrtime() + (TSHRTime)origin_timeout(timeout_ms) * 1000000;
+  ssize_t n;
+
+  for (;;) {
+    /* TLS may hold decrypted bytes the socket doesn't show. */
+    if (!conn->ssl || SSL_pending(conn->ssl) == 0) {
+      if (origin_wait(conn, POLLIN, (deadline - TShrtime()) / 1000000) < 0)
+        return -1;
+    }
+    n = origin_read_some(conn, buffer, size);
+    if (n != ORIGIN_AGAIN)
+      return n;
+  }
+}
+
+/* Write all of data to conn, waiting up to timeout_ms for room. */
+static int
+origin_write(OriginConn *conn, const char *data, size_t length, int timeout_ms)
+{
+  TSHRTime deadline = TShrtime() + (TSHRTime)origin_timeout(timeout_ms) * 1000000;
+  ssize_t n;
+  short events;
+  int error;
+
+  while (length > 0) {
+    events = POLLOUT;
+    if (conn->ssl) {
+      n = SSL_write(conn->ssl, data, length);
+      if (n <= 0) {
+        error = SSL_get_error(conn->ssl, n);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+          ERR_clear_error();
+          return -1;
+        }
+        events = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+      }
+    } else {
+      n = send(conn->fd, data, length, MSG_NOSIGNAL);
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
+    }
+    if (n > 0) {
+      data += n;
+      length -= n;
+    } else if (origin_wait(conn, events, (deadline - TShrtime()) / 1000000) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void
+OriginClose(OriginConn *conn)
+{
+  if (conn->ssl) {
+    /* Freed without a shutdown, the session would be made unusable.
+       Quiet: the origin isn't written to. */
+    SSL_set_quiet_shutdown(conn->ssl, 1);
+    SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+  }
+  if (conn->fd >= 0)
+    close(conn->fd);
+  conn->fd = -1;
+}
+
+/* Connect to server and shake hands if it wants TLS, offering HTTP/2
+   with h2. Returns -1 if it fails. */
+static int
+origin_open(OriginConn *conn, OriginServer *server, const char *server_name, int h2)
+{
+  conn->server = server;
+  conn->ssl    = NULL;
+  conn->fd     = origin_connect(server->host, server->port);
+  if (conn->fd < 0)
+    return -1;
+
+  if (server->tls) {
+    conn->ssl = OriginTlsConnect(conn->fd, server, server_name, origin_timeout(origin_timeouts.connect_ms), h2);
+    if (conn->ssl == NULL) {
+      OriginClose(conn);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* 1 if the origin hasn't closed conn. Before a request it sends
+   nothing, but TLS session tickets, which the peek takes in. */
+static int
+origin_warm_alive(OriginConn *conn)
+{
+  char c;
+  int n;
+
+  if (conn->ssl == NULL)
+    return recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  n = SSL_peek(conn->ssl, &c, 1);
+  if (n <= 0 && SSL_get_error(conn->ssl, n) == SSL_ERROR_WANT_READ)
+    return 1;
+  ERR_clear_error();
+  return 0;
+}
+
+/* Close the warm connections that waited too long. Called locked. */
+static void
+origin_warm_expire(TSHRTime now)
+{
+  int i = 0;
+
+  while (i < origin_warm_count) {
+    if (now - origin_warm[i].opened_at < (TSHRTime)ORIGIN_WARM_IDLE_MS * 1000000) {
+      i++;
+      continue;
+    }
+    TSDebug("HTTP_plugin", "warm connection to %s not used", origin_warm[i].conn.server->host);
+    OriginClose(&origin_warm[i].conn);
+    origin_warm[i] = origin_warm[--origin_warm_count];
+  }
+}
+
+/* Take a warm connection to server into conn. Returns 0 if there is
+   none. */
+static int
+origin_warm_take(OriginConn *conn, OriginServer *server)
+{
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&origin_warm_mutex);
+    origin_warm_expire(TShrtime());
+    for (i = 0; i < origin_warm_count && origin_warm[i].conn.server != server; i++)
+      ;
+    if (i == origin_warm_count) {
+      pthread_mutex_unlock(&origin_warm_mutex);
+      return 0;
+    }
+    *conn          = origin_warm[i].conn;
+    origin_warm[i] = origin_warm[--origin_warm_count];
+    pthread_mutex_unlock(&origin_warm_mutex);
+
+    if (origin_warm_alive(conn))
+      return 1;
+    OriginClose(conn);
+  }
+}
+
+static void *
+origin_warm_thread(void *data)
+{
+  OriginWarmJob *job   = (OriginWarmJob *)data;
+  OriginServer *server = OriginPickWarm(job->server_name, job->port);
+  OriginConn conn;
+  int opened = 0;
+
+  if (server) {
+    opened = origin_open(&conn, server, job->server_name, 0) == 0;
+    if (!opened)
+      OriginFailed(server);
+    OriginRelease(server);
+  }
+
+  pthread_mutex_lock(&origin_warm_mutex);
+  origin_warm_pending--;
+  if (opened) {
+    origin_warm[origin_warm_count].conn      = conn;
+    origin_warm[origin_warm_count].opened_at = TShrtime();
+    origin_warm_count++;
+  }
+  pthread_mutex_unlock(&origin_warm_mutex);
+  free(job);
+  return NULL;
+}
+
+/* Open a connection to a replica of server_name on a thread of its
+   own, for the next request to it. Nothing is done when
+   ORIGIN_WARM_MAX connections are already open or being opened. */
+void
+OriginWarm(const char *server_name, int port)
+{
+  OriginWarmJob *job;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int ret;
+
+  pthread_mutex_lock(&origin_warm_mutex);
+  origin_warm_expire(TShrtime());
+  if (origin_warm_count + origin_warm_pending >= ORIGIN_WARM_MAX) {
+    pthread_mutex_unlock(&origin_warm_mutex);
+    return;
+  }
+  origin_warm_pending++;
+  pthread_mutex_unlock(&origin_warm_mutex);
+
+  job = (OriginWarmJob *)malloc(sizeof(OriginWarmJob));
+  ret = -1;
+  if (job) {
+    snprintf(job->server_name, sizeof(job->server_name), "%s", server_name);
+    job->port = port;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, origin_warm_thread, job);
+    pthread_attr_destroy(&attr);
+  }
+  if (ret != 0) {
+    free(job);
+    pthread_mutex_lock(&origin_warm_mutex);
+    origin_warm_pending--;
+    pthread_mutex_unlock(&origin_warm_mutex);
+  }
+}
+
+/* Connect to server, shake hands if it wants TLS, and send request.
+   Returns -1 if any of it fails. */
+static int
+origin_send_request(OriginConn *conn, OriginServer *server, const char *server_name, const char *request)
+{
+  /* A warm connection saves the connect; if the origin dropped it
+     meanwhile, a new one is opened as usual. */
+  if (origin_warm_take(conn, server)) {
+    TSDebug("HTTP_plugin", "using a warm connection to %s", server->host);
+    if (origin_write(conn, request, strlen(request), origin_timeouts.idle_ms) == 0)
+      return 0;
+    OriginClose(conn);
+  }
+  if (origin_open(conn, server, server_name, 0) < 0)
+    return -1;
+  if (origin_write(conn, request, strlen(request), origin_timeouts.idle_ms) < 0) {
+    TSError("[protocol] ERROR writing to origin %s", server->host);
+    OriginClose(conn);
+    return -1;
+  }
+  return 0;
+}
+
+/* Wait up to timeout_ms for the first of the count requests of conns
+   to answer, and read its first bytes. The ones that fail are closed
+   and taken out. Returns the index of the answer, -1 if none came. */
+static int
+origin_first_answer(OriginConn *conns, int *count, int timeout_ms, char *buffer, int size, int *length)
+{
+  struct pollfd pfds[2];
+  TSHRTime deadline = TShrtime() + (TSHRTime)timeout_ms * 1000000;
+  int i, left;
+  ssize_t n;
+
+  while (*count > 0) {
+    left = (deadline - TShrtime()) / 1000000;
+    if (left <= 0)
+      return -1;
+    for (i = 0; i < *count; i++) {
+      pfds[i].fd      = conns[i].fd;
+      pfds[i].events  = POLLIN;
+      pfds[i].revents = 0;
+    }
+    if (!(conns[0].ssl && SSL_pending(conns[0].ssl)) && !(*count > 1 && conns[1].ssl && SSL_pending(conns[1].ssl)) &&
+        poll(pfds, *count, left) <= 0)
+      continue;
+
+    for (i = 0; i < *count; i++) {
+      if (!pfds[i].revents && !(conns[i].ssl && SSL_pending(conns[i].ssl)))
+        continue;
+      n = origin_read_some(&conns[i], buffer, size);
+      if (n > 0) {
+        *length = n;
+        return i;
+      }
+      if (n == ORIGIN_AGAIN)
+        continue;
+      TSError("[protocol] no response from origin %s: %s", conns[i].server->host, n < 0 ? strerror(errno) : "closed");
+      OriginFailed(conns[i].server);
+      OriginRelease(conns[i].server);
+      OriginClose(&conns[i]);
+      conns[0] = conns[i ^ 1];
+      --*count;
+      break;
+    }
+  }
+  return -1;
+}
+
+/* Connect, send request and wait for the first bytes of the response,
+   put into buffer, their number in length. The requests that fail
+   before that are tried again after a jittered delay, and each one
+   counts for the circuit breaker of its replica. With hedge set, a
+   request slower than usual is sent to a second replica as well, the
+   first to answer is kept and the other one cancelled. Returns 0 with
+   the connection to read the rest from in conn, or -1 if the origin is
+   given up, with errno ETIMEDOUT if the last try got no answer in time.
+   Nothing is tried past the deadline of the thread. */
+int
+OriginOpen(const char *server_name, int port, const char *request, int hedge, char *buffer, int size, int *length,
+           OriginConn *conn)
+{
+  OriginConn conns[2];
+  OriginServer *second;
+  TSHRTime started;
+  int attempt, count, hedge_ms, winner, i, delay_ms, timed_out = 0;
+
+  for (attempt = 0; attempt <= origin_timeouts.retries; attempt++) {
+    OriginServer *first;
+
+    if (attempt > 0) {
+      delay_ms = OriginRetryDelay(attempt);
+      if (origin_timeout(delay_ms) < delay_ms) {
+        timed_out = 1;
+        break;
+      }
+      usleep(delay_ms * 1000);
+    }
+    first = OriginPick(server_name, port, NULL);
+    if (first == NULL)
+      break;
+
+    if (origin_send_request(&conns[0], first, server_name, request) < 0) {
+      timed_out = errno == ETIMEDOUT;
+      OriginFailed(first);
+      OriginRelease(first);
+      continue;
+    }
+    count   = 1;
+    winner  = -1;
+    started = TShrtime();
+
+    hedge_ms = hedge ? OriginHedgeDelay() : 0;
+    if (hedge_ms > 0 && hedge_ms < origin_timeouts.first_byte_ms) {
+      winner = origin_first_answer(conns, &count, origin_timeout(hedge_ms), buffer, size, length);
+      if (winner < 0 && count == 1 && OriginHedgeTake() && (second = OriginPick(server_name, port, conns[0].server))) {
+        if (origin_send_request(&conns[1], second, server_name, request) == 0) {
+          TSDebug("HTTP_plugin", "no answer from %s after %d ms, asking %s too", conns[0].server->host, hedge_ms, second->host);
+          count = 2;
+        } else {
+          OriginFailed(second);
+          OriginRelease(second);
+        }
+      }
+    }
+    if (winner < 0 && count > 0)
+      winner = origin_first_answer(conns, &count, origin_timeout(origin_timeouts.first_byte_ms - (TShrtime() - started) / 1000000),
+                                   buffer, size, length);
+
+    /* The request that lost is cancelled, not failed. */
+    timed_out = winner < 0 && count > 0;
+    for (i = 0; i < count; i++) {
+      OriginRelease(conns[i].server);
+      if (i == winner)
+        continue;
+      if (winner < 0) {
+        TSError("[protocol] no response from origin %s: %s", conns[i].server->host, strerror(ETIMEDOUT));
+        OriginFailed(conns[i].server);
+      } else {
+        OriginCancelled(conns[i].server);
+      }
+      OriginClose(&conns[i]);
+    }
+    if (winner >= 0) {
+      OriginSucceeded(conns[winner].server, TShrtime() - started);
+      *conn = conns[winner];
+      return 0;
+    }
+  }
+  errno = timed_out ? ETIMEDOUT : ECONNREFUSED;
+  return -1;
+}
+
+/* Send the request and copy the response to the transaction chunk by
+   chunk. The thread blocks when the transaction doesn't keep up, so
+   the memory used doesn't depend on the size of the object. Closing
+   the pipe is the end of the response for the transaction. */
+static void *
+origin_fetch_thread(void *data)
+{
+  OriginFetchJob *job = (OriginFetchJob *)data;
+  char buffer[ORIGIN_FETCH_CHUNK_SIZE];
+  OriginConn conn;
+  ssize_t n;
+  int length;
+
+  if (OriginOpen(job->server_name, job->port, job->request, 1, buffer, sizeof(buffer), &length, &conn) < 0) {
+    /* Nothing came: the transaction answers the client itself. */
+    __atomic_store_n(&job->status, errno == ETIMEDOUT ? 504 : 502, __ATOMIC_RELAXED);
+  } else {
+    n = length;
+    while (n > 0) {
+      /* The transaction went away, stop reading the origin. */
+      if (origin_send_all(job->pipe_fd, buffer, n) < 0)
+        break;
+      n = origin_read(&conn, buffer, sizeof(buffer), origin_timeouts.idle_ms);
+      if (n < 0) {
+        TSError("[protocol] response of origin %s cut: %s", conn.server->host, strerror(errno));
+        OriginFailed(conn.server);
+      }
+    }
+    OriginClose(&conn);
+  }
+
+  close(job->pipe_fd);
+  OriginFetchRelease(job);
+  OverloadFetchesGive(1);
+  return NULL;
+}
+
+/* Start fetching the response of request from the origin server on a
+   thread of its own. The response is read from the returned vc; EOS
+   means the whole response has been delivered. The caller releases
+   job when done with it. Returns NULL if the fetch can't be started,
+   with errno EBUSY if no fetch slot is free. */
+TSVConn
+OriginFetchStart(const char *server_name, int port, const char *request, OriginFetchJob **job_out)
+{
+  OriginFetchJob *job;
+  pthread_attr_t attr;
+  pthread_t thread;
+  TSVConn vc;
+  int fds[2];
+  int size = ORIGIN_FETCH_PIPE_SIZE;
+  int ret;
+
+  if (OverloadFetchesTake(1) == 0) {
+    errno = EBUSY;
+    return NULL;
+  }
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    TSError("[protocol] socketpair failed: %s", strerror(errno));
+    OverloadFetchesGive(1);
+    return NULL;
+  }
+  setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+  job = (OriginFetchJob *)malloc(sizeof(OriginFetchJob));
+  vc  = job ? TSVConnFdCreate(fds[0]) : NULL;
+  if (!vc) {
+    close(fds[0]);
+    close(fds[1]);
+    free(job);
+    OverloadFetchesGive(1);
+    return NULL;
+  }
+
+  snprintf(job->server_name, sizeof(job->server_name), "%s", server_name);
+  snprintf(job->request, sizeof(job->request), "%s", request);
+  job->port    = port;
+  job->pipe_fd = fds[1];
+  job->status  = 0;
+  job->refs    = 2;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  ret = pthread_create(&thread, &attr, origin_fetch_thread, job);
+  pthread_attr_destroy(&attr);
+
+  if (ret != 0) {
+    TSError("[protocol] can't start origin fetch thread");
+    TSVConnClose(vc);
+    close(fds[1]);
+    free(job);
+    OverloadFetchesGive(1);
+    return NULL;
+  }
+  *job_out = job;
+  return vc;
+}
+
+/* Once the vc of job got EOS: 0 if the origin answered, else the
+   status to answer the client with. */
+int
+OriginFetchStatus(OriginFetchJob *job)
+{
+  return __atomic_load_n(&job->status, __ATOMIC_RELAXED);
+}
+
+void
+OriginFetchRelease(OriginFetchJob *job)
+{
+  if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(job);
+}
@@ -0,0 +1,326 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <ctype.h>
+#include <nghttp2/nghttp2.h>
+#include "ts/ink_defs.h"
+#ifndef ORIGIN_H2_H
+#define ORIGIN_H2_H
+
+/* HTTP/2 to the origin, with libnghttp2, for the prefetches of a page:
+   their requests are streams of one connection instead of a connection
+   or a pipeline each. A TLS replica is offered HTTP/2 by ALPN, and
+   remembered if it declines; a cleartext one is spoken to in HTTP/2
+   only if it was configured as h2c://. The streams are weighted, the
+   origin sends the bytes of the heavier ones first. The response of a
+   stream is made back into an HTTP/1.1 one with a Content-Length, as
+   the cache stores them. */
+#define ORIGIN_H2_STREAM_WINDOW (1 << 20)
+#define ORIGIN_H2_CONNECTION_WINDOW (16 << 20)
+
+/* Room for the header lines of a response. */
+#define ORIGIN_H2_HEADER_SIZE (8 * 1024)
+
+typedef struct {
+  const char *path;
+  int weight;     /* 1 to 256, NGHTTP2_DEFAULT_WEIGHT is 16 */
+  char *response; /* where the response goes */
+  int size;       /* of response */
+  int length;     /* of the response, 0 if it didn't come whole */
+} OriginH2Stream;
+
+int OriginH2Fetch(const char *server_name, int port, OriginH2Stream *streams, int count);
+
+#endif /* ORIGIN_H2_H */
+
+/* A stream being received. The body goes to the start of the response
+   buffer, the status line and headers are put before it at the end. */
+typedef struct {
+  OriginH2Stream *stream;
+  char header[ORIGIN_H2_HEADER_SIZE];
+  int header_length;
+  int body_length;
+  int status;
+  int failed;
+} OriginH2State;
+
+typedef struct {
+  int open;     /* streams not closed yet */
+  int answered; /* streams that came whole */
+} OriginH2Session;
+
+static const char *
+origin_h2_reason(int status)
+{
+  switch (status) {
+  case 200:
+    return "OK";
+  case 204:
+    return "No Content";
+  case 301:
+    return "Moved Permanently";
+  case 302:
+    return "Found";
+  case 304:
+    return "Not Modified";
+  case 404:
+    return "Not Found";
+  default:
+    return "";
+  }
+}
+
+/* Capitalize the name of a header line: the first letter, and each
+   one after a '-'. */
+static void
+origin_h2_canonical(char *name, size_t length)
+{
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    if (i == 0 || name[i - 1] == '-')
+      name[i] = toupper((unsigned char)name[i]);
+  }
+}
+
+static int
+origin_h2_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name, size_t name_length,
+                 const uint8_t *value, size_t value_length, uint8_t flags ATS_UNUSED, void *data ATS_UNUSED)
+{
+  OriginH2State *state = (OriginH2State *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  int n;
+
+  /* Trailers are dropped, the body is stored already. */
+  if (state == NULL || frame->hd.type != NGHTTP2_HEADERS || state->body_length > 0)
+    return 0;
+  if (name_length == 7 && memcmp(name, ":status", 7) == 0) {
+    /* A final response after a 1xx one starts over. */
+    state->status        = atoi((const char *)value);
+    state->header_length = 0;
+    return 0;
+  }
+  if (name[0] == ':' || (name_length == 14 && strncasecmp((const char *)name, "content-length", 14) == 0))
+    return 0;
+
+  n = snprintf(state->header + state->header_length, sizeof(state->header) - state->header_length, "%.*s: %.*s\r\n",
+               (int)name_length, name, (int)value_length, value);
+  if (n >= (int)sizeof(state->header) - state->header_length) {
+    state->failed = 1;
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE; /* resets the stream */
+  }
+  /* HTTP/2 names are lowercase, the cache and the parsers of the
+     response look for Content-Type and the like. */
+  origin_h2_canonical(state->header + state->header_length, name_length);
+  state->header_length += n;
+  return 0;
+}
+
+static int
+origin_h2_data(nghttp2_session *session, uint8_t flags ATS_UNUSED, int32_t stream_id, const uint8_t *data,
+               size_t length, void *user_data ATS_UNUSED)
+{
+  OriginH2State *state = (OriginH2State *)nghttp2_session_get_stream_user_data(session, stream_id);
+
+  if (state == NULL || state->failed)
+    return 0;
+  if (state->body_length + length > (size_t)state->stream->size) {
+    TSDebug("HTTP_plugin", "%s too large", state->stream->path);
+    state->failed = 1;
+    nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_CANCEL);
+    return 0;
+  }
+  memcpy(state->stream->response + state->body_length, data, length);
+  state->body_length += length;
+  return 0;
+}
+
+/* Put the status line and the headers before the body. */
+static void
+origin_h2_finish(OriginH2State *state)
+{
+  OriginH2Stream *stream = state->stream;
+  char status[64], length[64];
+  int status_length, length_length, total;
+
+  status_length = snprintf(status, sizeof(status), "HTTP/1.1 %d %s\r\n", state->status, origin_h2_reason(state->status));
+  length_length = snprintf(length, sizeof(length), "Content-Length: %d\r\n\r\n", state->body_length);
+  total         = status_length + state->header_length + length_length + state->body_length;
+  if (total > stream->size) {
+    TSDebug("HTTP_plugin", "%s too large", stream->path);
+    return;
+  }
+  memmove(stream->response + total - state->body_length, stream->response, state->body_length);
+  memcpy(stream->response, status, status_length);
+  memcpy(stream->response + status_length, state->header, state->header_length);
+  memcpy(stream->response + status_length + state->header_length, length, length_length);
+  stream->length = total;
+}
+
+static int
+origin_h2_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+  OriginH2State *state = (OriginH2State *)nghttp2_session_get_stream_user_data(session, stream_id);
+  OriginH2Session *h2  = (OriginH2Session *)user_data;
+
+  if (state == NULL)
+    return 0;
+  h2->open--;
+  if (error_code != NGHTTP2_NO_ERROR || state->failed || state->status < 200) {
+    TSDebug("HTTP_plugin", "stream of %s closed, error %u", state->stream->path, error_code);
+    return 0;
+  }
+  origin_h2_finish(state);
+  if (state->stream->length > 0)
+    h2->answered++;
+  return 0;
+}
+
+/* Write what session has to send. */
+static int
+origin_h2_send(nghttp2_session *session, OriginConn *conn)
+{
+  const uint8_t *data;
+  ssize_t n;
+
+  while ((n = nghttp2_session_mem_send(session, &data)) > 0) {
+    if (origin_write(conn, (const char *)data, n, origin_timeouts.idle_ms) < 0)
+      return -1;
+  }
+  return n < 0 ? -1 : 0;
+}
+
+/* Request the paths of streams from a replica of server_name over one
+   HTTP/2 connection. Returns -1 if the replica isn't spoken to in
+   HTTP/2, nothing was requested then; else 0, and the length of the
+   streams that came whole is set. */
+int
+OriginH2Fetch(const char *server_name, int port, OriginH2Stream *streams, int count)
+{
+  nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+                                       {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, ORIGIN_H2_STREAM_WINDOW}};
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_session *session;
+  nghttp2_priority_spec priority;
+  OriginH2Session h2 = {0, 0};
+  OriginH2State *states;
+  OriginServer *server;
+  OriginConn conn;
+  const unsigned char *protocol = NULL;
+  unsigned int protocol_length  = 0;
+  char buffer[ORIGIN_FETCH_CHUNK_SIZE];
+  TSHRTime started, latency = 0;
+  int timeout_ms, i;
+  ssize_t n;
+
+  server = OriginPick(server_name, port, NULL);
+  if (server == NULL)
+    return -1;
+  if (server->h2 < 0 || (!server->tls && server->h2 == 0)) {
+    OriginCancelled(server);
+    OriginRelease(server);
+    return -1;
+  }
+
+  started = TShrtime();
+  if (origin_open(&conn, server, server_name, 1) < 0) {
+    OriginFailed(server);
+    OriginRelease(server);
+    return -1;
+  }
+  if (conn.ssl) {
+    SSL_get0_alpn_selected(conn.ssl, &protocol, &protocol_length);
+    if (protocol_length != 2 || memcmp(protocol, "h2", 2) != 0) {
+      TSDebug("HTTP_plugin", "origin %s doesn't speak HTTP/2", server->host);
+      __atomic_store_n(&server->h2, -1, __ATOMIC_RELAXED);
+      OriginCancelled(server);
+      OriginRelease(server);
+      OriginClose(&conn);
+      return -1;
+    }
+    __atomic_store_n(&server->h2, 1, __ATOMIC_RELAXED);
+  }
+
+  states = calloc(count, sizeof(OriginH2State));
+  if (states == NULL || nghttp2_session_callbacks_new(&callbacks) != 0) {
+    free(states);
+    OriginCancelled(server);
+    OriginRelease(server);
+    OriginClose(&conn);
+    return 0;
+  }
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, origin_h2_header);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, origin_h2_data);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, origin_h2_close);
+  i = nghttp2_session_client_new(&session, callbacks, &h2);
+  nghttp2_session_callbacks_del(callbacks);
+  if (i != 0) {
+    free(states);
+    OriginCancelled(server);
+    OriginRelease(server);
+    OriginClose(&conn);
+    return 0;
+  }
+
+  nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings, sizeof(settings) / sizeof(settings[0]));
+  nghttp2_session_set_local_window_size(session, NGHTTP2_FLAG_NONE, 0, ORIGIN_H2_CONNECTION_WINDOW);
+  for (i = 0; i < count; i++) {
+    nghttp2_nv headers[] = {
+      {(uint8_t *)":method", (uint8_t *)"GET", 7, 3, NGHTTP2_NV_FLAG_NONE},
+      {(uint8_t *)":scheme", (uint8_t *)(conn.ssl ? "https" : "http"), 7, conn.ssl ? 5 : 4, NGHTTP2_NV_FLAG_NONE},
+      {(uint8_t *)":authority", (uint8_t *)server_name, 10, strlen(server_name), NGHTTP2_NV_FLAG_NONE},
+      {(uint8_t *)":path", (uint8_t *)streams[i].path, 5, strlen(streams[i].path), NGHTTP2_NV_FLAG_NONE},
+    };
+
+    streams[i].length = 0;
+    states[i].stream  = &streams[i];
+    nghttp2_priority_spec_init(&priority, 0, streams[i].weight, 0);
+    if (nghttp2_submit_request(session, &priority, headers, sizeof(headers) / sizeof(headers[0]), NULL, &states[i]) > 0)
+      h2.open++;
+  }
+
+  /* The origin may take more streams at a time than it allows, nghttp2
+     holds the rest until some close. */
+  timeout_ms = origin_timeouts.first_byte_ms;
+  while (h2.open > 0 && (nghttp2_session_want_read(session) || nghttp2_session_want_write(session))) {
+    if (origin_h2_send(session, &conn) < 0)
+      break;
+    n = origin_read(&conn, buffer, sizeof(buffer), timeout_ms);
+    if (n <= 0) {
+      TSError("[protocol] HTTP/2 from %s cut: %s", server->host, n == 0 ? "connection closed" : strerror(errno));
+      break;
+    }
+    if (latency == 0)
+      latency = TShrtime() - started;
+    timeout_ms = origin_timeouts.idle_ms;
+    if (nghttp2_session_mem_recv(session, (const uint8_t *)buffer, n) < 0)
+      break;
+  }
+  nghttp2_session_terminate_session(session, NGHTTP2_NO_ERROR);
+  origin_h2_send(session, &conn);
+  nghttp2_session_del(session);
+  OriginClose(&conn);
+
+  TSDebug("HTTP_plugin", "%d of %d objects of %s over HTTP/2 from %s", h2.answered, count, server_name, server->host);
+  if (h2.answered > 0)
+    OriginSucceeded(server, latency);
+  else
+    OriginFailed(server);
+  OriginRelease(server);
+  free(states);
+  return 0;
+}
@@ -0,0 +1,435 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <openssl/ssl.h>
+#ifndef ORIGIN_HEALTH_H
+#define ORIGIN_HEALTH_H
+
+/* Limits of a request to an origin server, in milliseconds: to connect,
+   from the request sent to the first byte of the response, and between
+   two reads of the response. A request that fails before any byte is
+   tried again up to retries times. The requests of a prefetch batch,
+   retries included, all end within batch_ms. */
+typedef struct {
+  int connect_ms;
+  int first_byte_ms;
+  int idle_ms;
+  int retries;
+  int batch_ms;
+} OriginTimeouts;
+
+/* Hedging: when the first byte of a response is later than percentile
+   percent of them usually are, the request is sent to another replica
+   too and the first to answer wins. At most budget percent of the
+   requests are sent twice. 0 doesn't hedge. */
+typedef struct {
+  int percentile;
+  int budget;
+} OriginHedging;
+
+/* Wait before the n-th retry: ORIGIN_RETRY_BASE_MS doubled each time,
+   minus a random part of up to half of it so the retries of many
+   transactions don't hit the origin together. */
+#define ORIGIN_RETRY_BASE_MS 100
+#define ORIGIN_RETRY_MAX_MS 2000
+
+/* Circuit breaker: after ORIGIN_BREAKER_FAILURES failures in a row a
+   replica isn't asked anything for ORIGIN_BREAKER_OPEN_SECONDS. Then a
+   single request is let through; the replica is back if it succeeds. */
+#define ORIGIN_MAX_SERVERS 16
+#define ORIGIN_BREAKER_FAILURES 5
+#define ORIGIN_BREAKER_OPEN_SECONDS 10
+
+/* The hedge delay is the percentile of the last ORIGIN_HEDGE_SAMPLES
+   first byte delays, worked out again every ORIGIN_HEDGE_REFRESH of
+   them. No hedging before ORIGIN_HEDGE_MIN_SAMPLES. */
+#define ORIGIN_HEDGE_SAMPLES 256
+#define ORIGIN_HEDGE_MIN_SAMPLES 32
+#define ORIGIN_HEDGE_REFRESH 16
+
+/* Each replica keeps moving averages of its first byte delay and of its
+   failures, a new request weighing ORIGIN_EWMA_WEIGHT. A replica
+   failing ORIGIN_EJECT_ERROR_RATE of its last requests or more is
+   ejected like by its breaker, as long as another one is left. */
+#define ORIGIN_EWMA_WEIGHT 0.1
+#define ORIGIN_EJECT_MIN_SAMPLES 10
+#define ORIGIN_EJECT_ERROR_RATE 0.5
+
+/* TLS sessions kept per replica, TLS 1.3 tickets may be used once
+   only. */
+#define ORIGIN_TLS_SESSIONS 4
+
+typedef enum {
+  ORIGIN_CLOSED,    /* healthy, every request goes */
+  ORIGIN_OPEN,      /* failing, no request goes */
+  ORIGIN_HALF_OPEN, /* one request is trying it */
+} OriginBreakerState;
+
+/* A replica of the origin server, where requests are sent. */
+typedef struct {
+  char host[MAX_SERVER_NAME_LENGTH + 1];
+  int port;
+  int configured; /* from an Origin: line, not the server name */
+  int tls;        /* https:// */
+  int h2;         /* speaks HTTP/2: 1, doesn't: -1, not known yet: 0 */
+  SSL_SESSION *tls_sessions[ORIGIN_TLS_SESSIONS]; /* oldest first */
+  int tls_session_count;
+  OriginBreakerState state;
+  int failures;
+  TSHRTime opened_at;
+  double latency_ms; /* moving average of the first byte delay */
+  double error_rate; /* moving average of the failures, 0 to 1 */
+  int samples;
+  int waiting; /* requests picked and not answered yet */
+} OriginServer;
+
+extern OriginTimeouts origin_timeouts;
+extern OriginHedging origin_hedging;
+
+int OriginInit(const char *path);
+OriginServer *OriginPick(const char *server_name, int port, OriginServer *except);
+OriginServer *OriginPickWarm(const char *server_name, int port);
+void OriginSucceeded(OriginServer *server, TSHRTime latency);
+void OriginFailed(OriginServer *server);
+void OriginCancelled(OriginServer *server);
+void OriginRelease(OriginServer *server);
+int OriginRetryDelay(int attempt);
+int OriginHedgeDelay(void);
+int OriginHedgeTake(void);
+
+#endif /* ORIGIN_HEALTH_H */
+
+OriginTimeouts origin_timeouts = {3000, 15000, 30000, 2, 20000};
+OriginHedging origin_hedging   = {0, 5};
+
+static OriginServer origin_servers[ORIGIN_MAX_SERVERS];
+static int origin_server_count;
+static int origin_configured_count;
+static pthread_mutex_t origin_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int origin_latency_ms[ORIGIN_HEDGE_SAMPLES];
+static int origin_latency_count;
+static int origin_hedge_ms;
+static int origin_requests;
+static int origin_hedges;
+
+/* Read the replicas from the "Origin: [https://|h2c://]host[:port]"
+   lines of the file path; h2c:// is HTTP/2 without TLS, for the
+   prefetches. Without any, requests go to the server name itself. */
+int
+OriginInit(const char *path)
+{
+  char line[MAX_SERVER_NAME_LENGTH + 16];
+  char *value, *colon;
+  FILE *file;
+
+  file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+
+  while (fgets(line, sizeof(line), file) && origin_server_count < ORIGIN_MAX_SERVERS) {
+    OriginServer *server = &origin_servers[origin_server_count];
+
+    if (strncasecmp(line, "Origin:", 7) != 0)
+      continue;
+    value = line + 7;
+    value += strspn(value, " \t");
+    value[strcspn(value, " \t\r\n#")] = '\0';
+    if (*value == '\0')
+      continue;
+
+    server->port = 80;
+    if (strncasecmp(value, "https://", 8) == 0) {
+      server->tls  = 1;
+      server->port = 443;
+      value += 8;
+    } else if (strncasecmp(value, "h2c://", 6) == 0) {
+      server->h2 = 1;
+      value += 6;
+    } else if (strncasecmp(value, "http://", 7) == 0) {
+      value += 7;
+    }
+    colon = strrchr(value, ':');
+    if (colon && isdigit((unsigned char)colon[1])) {
+      *colon       = '\0';
+      server->port = atoi(colon + 1);
+    }
+    snprintf(server->host, sizeof(server->host), "%s", value);
+    server->configured = 1;
+    TSDebug("HTTP_plugin", "origin replica %s:%d%s", server->host, server->port,
+            server->tls ? " over TLS" : server->h2 ? " over HTTP/2" : "");
+    origin_server_count++;
+    origin_configured_count++;
+  }
+  fclose(file);
+  return 0;
+}
+
+/* The entry of server_name:port, made if it is new. NULL when the
+   table is full. Called locked. */
+static OriginServer *
+origin_server(const char *server_name, int port)
+{
+  int i;
+
+  for (i = 0; i < origin_server_count; i++) {
+    if (!origin_servers[i].configured && origin_servers[i].port == port && strcmp(origin_servers[i].host, server_name) == 0)
+      return &origin_servers[i];
+  }
+  if (origin_server_count == ORIGIN_MAX_SERVERS)
+    return NULL;
+  snprintf(origin_servers[i].host, sizeof(origin_servers[i].host), "%s", server_name);
+  origin_servers[i].port = port;
+  origin_server_count++;
+  return &origin_servers[i];
+}
+
+/* 0 if requests to server are to fail right away. With probe, an open
+   breaker whose time is up lets the caller try it. Called locked. */
+static int
+origin_available(OriginServer *server, int probe)
+{
+  if (probe && server->state == ORIGIN_OPEN &&
+      TShrtime() - server->opened_at >= (TSHRTime)ORIGIN_BREAKER_OPEN_SECONDS * 1000000000) {
+    TSDebug("HTTP_plugin", "trying origin %s again", server->host);
+    server->state = ORIGIN_HALF_OPEN;
+    return 1;
+  }
+  return server->state == ORIGIN_CLOSED;
+}
+
+/* Expected time to get an answer from server: its usual delay, longer
+   the more requests wait for it and the more it fails. */
+static double
+origin_score(OriginServer *server)
+{
+  return (server->latency_ms + 1) * (server->waiting + 1) / (1.01 - server->error_rate);
+}
+
+static OriginServer *
+origin_pick(const char *server_name, int port, OriginServer *except, int probe)
+{
+  OriginServer *candidates[ORIGIN_MAX_SERVERS];
+  OriginServer *server = NULL;
+  int i, n = 0;
+
+  pthread_mutex_lock(&origin_mutex);
+  if (origin_configured_count == 0) {
+    server = origin_server(server_name, port);
+    if (server && (server == except || !origin_available(server, probe)))
+      server = NULL;
+  } else {
+    for (i = 0; i < origin_configured_count; i++) {
+      if (&origin_servers[i] != except && origin_available(&origin_servers[i], probe))
+        candidates[n++] = &origin_servers[i];
+    }
+    if (n == 1) {
+      server = candidates[0];
+    } else if (n > 1) {
+      OriginServer *a = candidates[random() % n];
+      OriginServer *b = candidates[random() % (n - 1)];
+
+      /* b is any other one than a */
+      if (b == a)
+        b = candidates[n - 1];
+      server = origin_score(a) <= origin_score(b) ? a : b;
+    }
+  }
+  if (server)
+    server->waiting++;
+  pthread_mutex_unlock(&origin_mutex);
+
+  if (server == NULL)
+    TSDebug("HTTP_plugin", "no origin of %s to ask", server_name);
+  return server;
+}
+
+/* The replica to send a request for server_name to, other than except,
+   for demand and prefetch alike: the better of two replicas taken at
+   random (power of two choices), leaving out the ones whose breaker is
+   open. NULL if there is none. */
+OriginServer *
+OriginPick(const char *server_name, int port, OriginServer *except)
+{
+  return origin_pick(server_name, port, except, 1);
+}
+
+/* Like OriginPick, for a connection opened before it is known to be
+   needed. It may never carry a request, so it doesn't take the single
+   one a breaker lets through. */
+OriginServer *
+OriginPickWarm(const char *server_name, int port)
+{
+  return origin_pick(server_name, port, NULL, 0);
+}
+
+static int
+origin_compare_int(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+/* Remember how long server took to the first byte. Called locked. */
+static void
+origin_latency_add(TSHRTime latency)
+{
+  int sorted[ORIGIN_HEDGE_SAMPLES];
+  int n;
+
+  origin_latency_ms[origin_latency_count++ % ORIGIN_HEDGE_SAMPLES] = latency / 1000000;
+  n = origin_latency_count < ORIGIN_HEDGE_SAMPLES ? origin_latency_count : ORIGIN_HEDGE_SAMPLES;
+  if (n < ORIGIN_HEDGE_MIN_SAMPLES || origin_latency_count % ORIGIN_HEDGE_REFRESH != 0)
+    return;
+
+  memcpy(sorted, origin_latency_ms, n * sizeof(int));
+  qsort(sorted, n, sizeof(int), origin_compare_int);
+  origin_hedge_ms = sorted[(n - 1) * origin_hedging.percentile / 100] + 1;
+}
+
+void
+OriginSucceeded(OriginServer *server, TSHRTime latency)
+{
+  pthread_mutex_lock(&origin_mutex);
+  if (server->state != ORIGIN_CLOSED)
+    TSDebug("HTTP_plugin", "origin %s is back", server->host);
+  if (server->state == ORIGIN_HALF_OPEN) {
+    server->error_rate = 0;
+    server->samples    = 0;
+  }
+  server->state      = ORIGIN_CLOSED;
+  server->failures   = 0;
+  server->latency_ms = server->samples ? server->latency_ms * (1 - ORIGIN_EWMA_WEIGHT) + ORIGIN_EWMA_WEIGHT * latency / 1000000.0
+                                       : latency / 1000000.0;
+  server->error_rate *= 1 - ORIGIN_EWMA_WEIGHT;
+  server->samples++;
+  if (origin_hedging.percentile > 0)
+    origin_latency_add(latency);
+  pthread_mutex_unlock(&origin_mutex);
+}
+
+/* 1 if another configured replica than server takes requests. Called
+   locked. */
+static int
+origin_other_available(OriginServer *server)
+{
+  int i;
+
+  for (i = 0; i < origin_configured_count; i++) {
+    if (&origin_servers[i] != server && origin_servers[i].state == ORIGIN_CLOSED)
+      return 1;
+  }
+  return 0;
+}
+
+void
+OriginFailed(OriginServer *server)
+{
+  int ejected;
+
+  pthread_mutex_lock(&origin_mutex);
+  server->error_rate = server->error_rate * (1 - ORIGIN_EWMA_WEIGHT) + ORIGIN_EWMA_WEIGHT;
+  server->samples++;
+  ejected = server->configured && server->samples >= ORIGIN_EJECT_MIN_SAMPLES &&
+            server->error_rate >= ORIGIN_EJECT_ERROR_RATE && origin_other_available(server);
+  if (server->state == ORIGIN_HALF_OPEN || ++server->failures >= ORIGIN_BREAKER_FAILURES || ejected) {
+    if (server->state != ORIGIN_OPEN)
+      TSError("[protocol] origin %s is failing, requests to it fail for %d s", server->host, ORIGIN_BREAKER_OPEN_SECONDS);
+    server->state     = ORIGIN_OPEN;
+    server->opened_at = TShrtime();
+  }
+  pthread_mutex_unlock(&origin_mutex);
+}
+
+/* The request server was picked for was cancelled before it was
+   answered, which tells nothing of server. If it was the request an
+   open breaker let through, the breaker opens again for a full period,
+   the next pick may try it then. */
+void
+OriginCancelled(OriginServer *server)
+{
+  pthread_mutex_lock(&origin_mutex);
+  if (server->state == ORIGIN_HALF_OPEN) {
+    TSDebug("HTTP_plugin", "trial of origin %s cancelled", server->host);
+    server->state     = ORIGIN_OPEN;
+    server->opened_at = TShrtime();
+  }
+  pthread_mutex_unlock(&origin_mutex);
+}
+
+/* The request server was picked for has been answered, failed or
+   been cancelled. */
+void
+OriginRelease(OriginServer *server)
+{
+  pthread_mutex_lock(&origin_mutex);
+  if (server->waiting > 0)
+    server->waiting--;
+  pthread_mutex_unlock(&origin_mutex);
+}
+
+/* Milliseconds to wait before retry number attempt, from 1. */
+int
+OriginRetryDelay(int attempt)
+{
+  int delay = ORIGIN_RETRY_BASE_MS << (attempt > 5 ? 5 : attempt - 1);
+
+  if (delay > ORIGIN_RETRY_MAX_MS)
+    delay = ORIGIN_RETRY_MAX_MS;
+  return delay - random() % (delay / 2 + 1);
+}
+
+/* Milliseconds to wait for the first byte before hedging a request, 0
+   not to hedge it. Counts the request for the hedge budget. */
+int
+OriginHedgeDelay(void)
+{
+  int delay = 0;
+
+  if (origin_hedging.percentile <= 0 || origin_configured_count < 2)
+    return 0;
+
+  pthread_mutex_lock(&origin_mutex);
+  /* Old requests count less, so the budget follows the traffic. */
+  if (++origin_requests >= 10000) {
+    origin_requests /= 2;
+    origin_hedges /= 2;
+  }
+  delay = origin_hedge_ms;
+  pthread_mutex_unlock(&origin_mutex);
+  return delay;
+}
+
+/* 1 if one more request may be hedged within the budget. */
+int
+OriginHedgeTake(void)
+{
+  int taken;
+
+  pthread_mutex_lock(&origin_mutex);
+  taken = (origin_hedges + 1) * 100 <= origin_requests * origin_hedging.budget;
+  if (taken)
+    origin_hedges++;
+  pthread_mutex_unlock(&origin_mutex);
+  return taken;
+}
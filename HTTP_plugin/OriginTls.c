@@ -0,0 +1,187 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#ifndef ORIGIN_TLS_H
+#define ORIGIN_TLS_H
+
+/* TLS to the replicas of an "Origin: https://..." line. The certificate
+   of the replica must be valid for the name of the site, signed by a CA
+   of the file given to OriginTlsInit or else by a system one. Each
+   replica keeps the last ORIGIN_TLS_SESSIONS sessions it was given, so
+   the next connections to it, demand or prefetch, resume one instead of
+   a full handshake. A TLS 1.3 session is taken by the connection that
+   resumes it, the server gives that one new tickets; older ones are
+   shared. */
+
+int OriginTlsInit(const char *ca_file);
+SSL *OriginTlsConnect(int fd, OriginServer *server, const char *server_name, int timeout_ms, int h2);
+
+#endif /* ORIGIN_TLS_H */
+
+static SSL_CTX *origin_tls_ctx;
+static pthread_mutex_t origin_tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int origin_tls_handshakes;
+static int origin_tls_resumed;
+
+/* A session or a ticket came with a connection to a replica: keep it
+   for the next ones, in place of the oldest one if there are enough.
+   Returning 1 keeps the reference. */
+static int
+origin_tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+  OriginServer *server = (OriginServer *)SSL_get_app_data(ssl);
+
+  if (server == NULL)
+    return 0;
+  pthread_mutex_lock(&origin_tls_mutex);
+  if (server->tls_session_count == ORIGIN_TLS_SESSIONS) {
+    SSL_SESSION_free(server->tls_sessions[0]);
+    memmove(server->tls_sessions, server->tls_sessions + 1, (ORIGIN_TLS_SESSIONS - 1) * sizeof(SSL_SESSION *));
+    server->tls_session_count--;
+  }
+  server->tls_sessions[server->tls_session_count++] = session;
+  pthread_mutex_unlock(&origin_tls_mutex);
+  return 1;
+}
+
+/* The newest session of server to resume, with a reference for the
+   caller, or NULL. A TLS 1.3 one isn't given to another connection. */
+static SSL_SESSION *
+origin_tls_take_session(OriginServer *server)
+{
+  SSL_SESSION *session = NULL;
+
+  pthread_mutex_lock(&origin_tls_mutex);
+  if (server->tls_session_count > 0) {
+    session = server->tls_sessions[server->tls_session_count - 1];
+    if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION)
+      server->tls_session_count--;
+    else
+      SSL_SESSION_up_ref(session);
+  }
+  pthread_mutex_unlock(&origin_tls_mutex);
+  return session;
+}
+
+int
+OriginTlsInit(const char *ca_file)
+{
+  origin_tls_ctx = SSL_CTX_new(TLS_client_method());
+  if (origin_tls_ctx == NULL)
+    return -1;
+
+  SSL_CTX_set_min_proto_version(origin_tls_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_verify(origin_tls_ctx, SSL_VERIFY_PEER, NULL);
+  if (ca_file ? SSL_CTX_load_verify_locations(origin_tls_ctx, ca_file, NULL) != 1
+              : SSL_CTX_set_default_verify_paths(origin_tls_ctx) != 1) {
+    TSError("[protocol] can't load the CAs of %s", ca_file ? ca_file : "the system");
+    SSL_CTX_free(origin_tls_ctx);
+    origin_tls_ctx = NULL;
+    return -1;
+  }
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  /* Origins often close after the response without a close_notify. */
+  SSL_CTX_set_options(origin_tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+  /* The sessions are kept per replica, not in the context. */
+  SSL_CTX_set_session_cache_mode(origin_tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(origin_tls_ctx, origin_tls_new_session);
+  return 0;
+}
+
+/* Forget the sessions of server, the handshake failed: it may have
+   changed its keys. */
+static void
+origin_tls_drop_sessions(OriginServer *server)
+{
+  pthread_mutex_lock(&origin_tls_mutex);
+  while (server->tls_session_count > 0)
+    SSL_SESSION_free(server->tls_sessions[--server->tls_session_count]);
+  pthread_mutex_unlock(&origin_tls_mutex);
+}
+
+/* Handshake on the non-blocking connected socket fd to server, for the
+   site server_name, within timeout_ms. With h2, HTTP/2 is offered
+   before HTTP/1.1 by ALPN. Returns NULL if it fails. */
+SSL *
+OriginTlsConnect(int fd, OriginServer *server, const char *server_name, int timeout_ms, int h2)
+{
+  static const unsigned char alpn[] = "\x02h2\x08http/1.1";
+  TSHRTime deadline = TShrtime() + (TSHRTime)timeout_ms * 1000000;
+  struct pollfd pfd;
+  SSL_SESSION *session;
+  SSL *ssl;
+  int ret, error, left, resumed, handshakes, resumptions;
+
+  if (origin_tls_ctx == NULL) {
+    TSError("[protocol] TLS to origin %s isn't set up", server->host);
+    return NULL;
+  }
+  ssl = SSL_new(origin_tls_ctx);
+  if (ssl == NULL)
+    return NULL;
+  SSL_set_fd(ssl, fd);
+  SSL_set_app_data(ssl, server);
+  SSL_set_tlsext_host_name(ssl, server_name);
+  SSL_set1_host(ssl, server_name);
+  if (h2)
+    SSL_set_alpn_protos(ssl, alpn, sizeof(alpn) - 1);
+
+  session = origin_tls_take_session(server);
+  if (session) {
+    SSL_set_session(ssl, session);
+    SSL_SESSION_free(session);
+  }
+
+  for (;;) {
+    ret = SSL_connect(ssl);
+    if (ret == 1)
+      break;
+    error = SSL_get_error(ssl, ret);
+    left  = (deadline - TShrtime()) / 1000000;
+    if ((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) || left <= 0) {
+      const char *reason = left <= 0 ? strerror(ETIMEDOUT) : ERR_reason_error_string(ERR_get_error());
+
+      TSError("[protocol] TLS handshake with origin %s failed: %s", server->host, reason ? reason : "connection closed");
+      ERR_clear_error();
+      origin_tls_drop_sessions(server);
+      SSL_free(ssl);
+      return NULL;
+    }
+    pfd.fd     = fd;
+    pfd.events = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+    poll(&pfd, 1, left);
+  }
+
+  resumed = SSL_session_reused(ssl);
+  pthread_mutex_lock(&origin_tls_mutex);
+  origin_tls_handshakes++;
+  origin_tls_resumed += resumed;
+  handshakes  = origin_tls_handshakes;
+  resumptions = origin_tls_resumed;
+  pthread_mutex_unlock(&origin_tls_mutex);
+  TSDebug("HTTP_plugin", "TLS to %s %s, %d of %d handshakes resumed", server->host, resumed ? "resumed" : "full", resumptions,
+          handshakes);
+  return ssl;
+}
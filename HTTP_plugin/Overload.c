@@ -0,0 +1,259 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <pthread.h>
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+/* Admission control. A transaction holds a slot from the accept of its
+   connection until the connection is closed, and there are
+   overload_limits.transactions of them. The connections accepted when
+   they are all taken wait in a queue, the first one gets the next slot
+   given back. What a transaction does after its client is gone, the
+   prefetches and the cache writes, is bounded by the fetch slots only:
+   an origin fetch, demand or prefetch, holds one of
+   overload_limits.fetches slots while it runs; one that gets none isn't
+   made. 0 doesn't limit.
+
+   As the load grows the plugin gives up work in stages:
+     OVERLOAD_NO_PREFETCH  OVERLOAD_PREFETCH_PERCENT of a limit is used
+                           or connections wait: nothing is prefetched or
+                           connected ahead
+     OVERLOAD_HITS_ONLY    the fetch slots are all taken, or the queue
+                           is OVERLOAD_QUEUE_PRESSURE_PERCENT full or its
+                           first connection waited OVERLOAD_QUEUE_PRESSURE_MS:
+                           misses are answered 503
+     OVERLOAD_REJECT       the queue is full: new connections are
+                           answered 503
+   A connection still waiting after OVERLOAD_QUEUE_WAIT_MS is answered
+   503 as well, its client has likely given up; OverloadExpired is
+   called every OVERLOAD_QUEUE_SWEEP_MS for them. */
+#define OVERLOAD_PREFETCH_PERCENT 75
+#define OVERLOAD_QUEUE_MAX 128
+#define OVERLOAD_QUEUE_WAIT_MS 2000
+#define OVERLOAD_QUEUE_PRESSURE_PERCENT 50
+#define OVERLOAD_QUEUE_PRESSURE_MS 500
+#define OVERLOAD_QUEUE_SWEEP_MS 100
+
+/* Connections being answered 503 at a time; the next ones are closed
+   without an answer. */
+#define OVERLOAD_ANSWER_MAX 256
+
+typedef struct {
+  int transactions;
+  int fetches;
+} OverloadLimits;
+
+typedef enum {
+  OVERLOAD_NONE,
+  OVERLOAD_NO_PREFETCH,
+  OVERLOAD_HITS_ONLY,
+  OVERLOAD_REJECT,
+} OverloadStage;
+
+/* What becomes of an accepted connection. */
+typedef enum {
+  OVERLOAD_START,  /* its transaction runs, holding a slot */
+  OVERLOAD_QUEUED, /* it waits for a slot */
+  OVERLOAD_ANSWER, /* it is answered 503 */
+  OVERLOAD_CLOSE,  /* it is closed */
+} OverloadVerdict;
+
+extern OverloadLimits overload_limits;
+
+OverloadVerdict OverloadAdmit(TSVConn vc);
+TSVConn OverloadNext(OverloadVerdict *verdict);
+TSVConn OverloadExpired(OverloadVerdict *verdict);
+void OverloadAnswered(void);
+OverloadStage OverloadStageGet(void);
+int OverloadFetchesTake(int n);
+void OverloadFetchesGive(int n);
+
+#endif /* OVERLOAD_H */
+
+typedef struct {
+  TSVConn vc;
+  TSHRTime queued_at;
+} OverloadWaiting;
+
+OverloadLimits overload_limits;
+
+static OverloadWaiting overload_queue[OVERLOAD_QUEUE_MAX];
+static int overload_queue_head;
+static int overload_queue_count;
+static int overload_transactions;
+static int overload_answering;
+static int overload_fetches;
+static OverloadStage overload_stage;
+static pthread_mutex_t overload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *overload_stage_names[] = {"normal", "no prefetch", "hits only", "reject"};
+
+/* Answer 503, unless too many are already. Called locked. */
+static OverloadVerdict
+overload_reject(void)
+{
+  if (overload_answering >= OVERLOAD_ANSWER_MAX)
+    return OVERLOAD_CLOSE;
+  overload_answering++;
+  return OVERLOAD_ANSWER;
+}
+
+/* The connection vc was accepted. */
+OverloadVerdict
+OverloadAdmit(TSVConn vc)
+{
+  OverloadVerdict verdict;
+  OverloadWaiting *waiting;
+
+  pthread_mutex_lock(&overload_mutex);
+  if (overload_limits.transactions <= 0 || overload_transactions < overload_limits.transactions) {
+    overload_transactions++;
+    verdict = OVERLOAD_START;
+  } else if (overload_queue_count < OVERLOAD_QUEUE_MAX) {
+    waiting            = &overload_queue[(overload_queue_head + overload_queue_count) % OVERLOAD_QUEUE_MAX];
+    waiting->vc        = vc;
+    waiting->queued_at = TShrtime();
+    overload_queue_count++;
+    verdict = OVERLOAD_QUEUED;
+  } else {
+    verdict = overload_reject();
+  }
+  pthread_mutex_unlock(&overload_mutex);
+  return verdict;
+}
+
+/* A transaction holding a slot ended. Returns the connection waiting
+   first, with OVERLOAD_START in verdict if it takes the slot, or what
+   to do with it if it waited too long; then call again. NULL when
+   none waits: the slot is free. */
+TSVConn
+OverloadNext(OverloadVerdict *verdict)
+{
+  OverloadWaiting *waiting;
+  TSVConn vc = NULL;
+
+  pthread_mutex_lock(&overload_mutex);
+  if (overload_queue_count == 0) {
+    overload_transactions--;
+  } else {
+    waiting             = &overload_queue[overload_queue_head];
+    overload_queue_head = (overload_queue_head + 1) % OVERLOAD_QUEUE_MAX;
+    overload_queue_count--;
+    vc = waiting->vc;
+    if (TShrtime() - waiting->queued_at < (TSHRTime)OVERLOAD_QUEUE_WAIT_MS * 1000000)
+      *verdict = OVERLOAD_START;
+    else
+      *verdict = overload_reject();
+  }
+  pthread_mutex_unlock(&overload_mutex);
+  return vc;
+}
+
+/* The first waiting connection if it waited more than
+   OVERLOAD_QUEUE_WAIT_MS, with what to do with it in verdict; then call
+   again. NULL when none did. */
+TSVConn
+OverloadExpired(OverloadVerdict *verdict)
+{
+  OverloadWaiting *waiting;
+  TSVConn vc = NULL;
+
+  pthread_mutex_lock(&overload_mutex);
+  waiting = &overload_queue[overload_queue_head];
+  if (overload_queue_count > 0 && TShrtime() - waiting->queued_at >= (TSHRTime)OVERLOAD_QUEUE_WAIT_MS * 1000000) {
+    overload_queue_head = (overload_queue_head + 1) % OVERLOAD_QUEUE_MAX;
+    overload_queue_count--;
+    vc       = waiting->vc;
+    *verdict = overload_reject();
+  }
+  pthread_mutex_unlock(&overload_mutex);
+  return vc;
+}
+
+/* A connection answered 503 is done. */
+void
+OverloadAnswered(void)
+{
+  pthread_mutex_lock(&overload_mutex);
+  overload_answering--;
+  pthread_mutex_unlock(&overload_mutex);
+}
+
+/* Take up to n fetch slots. Returns how many were taken; the fetches
+   past them are not to be made. */
+int
+OverloadFetchesTake(int n)
+{
+  int fetches = __atomic_load_n(&overload_fetches, __ATOMIC_RELAXED);
+  int taken;
+
+  do {
+    taken = n;
+    if (overload_limits.fetches > 0 && fetches + taken > overload_limits.fetches)
+      taken = fetches < overload_limits.fetches ? overload_limits.fetches - fetches : 0;
+    if (taken == 0)
+      return 0;
+  } while (!__atomic_compare_exchange_n(&overload_fetches, &fetches, fetches + taken, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return taken;
+}
+
+/* n fetch slots are given back. */
+void
+OverloadFetchesGive(int n)
+{
+  __atomic_sub_fetch(&overload_fetches, n, __ATOMIC_RELAXED);
+}
+
+/* 1 if count is at least percent of limit. */
+static int
+overload_above(int count, int limit, int percent)
+{
+  return limit > 0 && count * 100 >= limit * percent;
+}
+
+/* How much work is to be given up now. */
+OverloadStage
+OverloadStageGet(void)
+{
+  int fetches = __atomic_load_n(&overload_fetches, __ATOMIC_RELAXED);
+  OverloadStage stage;
+
+  pthread_mutex_lock(&overload_mutex);
+  if (overload_queue_count >= OVERLOAD_QUEUE_MAX)
+    stage = OVERLOAD_REJECT;
+  else if (overload_above(fetches, overload_limits.fetches, 100) ||
+           overload_above(overload_queue_count, OVERLOAD_QUEUE_MAX, OVERLOAD_QUEUE_PRESSURE_PERCENT) ||
+           (overload_queue_count > 0 && TShrtime() - overload_queue[overload_queue_head].queued_at >=
+                                          (TSHRTime)OVERLOAD_QUEUE_PRESSURE_MS * 1000000))
+    stage = OVERLOAD_HITS_ONLY;
+  else if (overload_queue_count > 0 ||
+           overload_above(overload_transactions, overload_limits.transactions, OVERLOAD_PREFETCH_PERCENT) ||
+           overload_above(fetches, overload_limits.fetches, OVERLOAD_PREFETCH_PERCENT))
+    stage = OVERLOAD_NO_PREFETCH;
+  else
+    stage = OVERLOAD_NONE;
+
+  if (stage != overload_stage) {
+    TSDebug("HTTP_plugin", "load %s, %d transactions, %d waiting, %d fetches", overload_stage_names[stage],
+            overload_transactions, overload_queue_count, fetches);
+    overload_stage = stage;
+  }
+  pthread_mutex_unlock(&overload_mutex);
+  return stage;
+}
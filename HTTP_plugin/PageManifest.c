@@ -0,0 +1,111 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifndef PAGE_MANIFEST_H
+#define PAGE_MANIFEST_H
+
+/* The manifest of a page is the list of its embedded objects, stored
+   as a cache object of its own next to the page. It is a first line
+   naming the format, then one path per line. */
+#define MANIFEST_MAGIC "HTTP_plugin-manifest 1\n"
+
+/* A manifest bigger than this isn't read back. */
+#define MAX_MANIFEST_LENGTH (64 * 1024)
+
+char *ManifestName(TxnArena *arena, const char *file_name);
+char *ManifestBuild(TxnArena *arena, char **paths, int count, int *length);
+char **ManifestParse(TxnArena *arena, char *manifest, int *count);
+
+#endif /* PAGE_MANIFEST_H */
+
+/* Name the cache key of the manifest of a page is made from. */
+char *
+ManifestName(TxnArena *arena, const char *file_name)
+{
+  size_t length = strlen(file_name) + sizeof(" manifest");
+  char *name    = (char *)TxnArenaAlloc(arena, length);
+
+  if (name)
+    snprintf(name, length, "%s manifest", file_name);
+  return name;
+}
+
+char *
+ManifestBuild(TxnArena *arena, char **paths, int count, int *length)
+{
+  size_t size = sizeof(MANIFEST_MAGIC);
+  char *manifest, *p;
+  int i;
+
+  for (i = 0; i < count; i++)
+    size += strlen(paths[i]) + 1;
+  if (size > MAX_MANIFEST_LENGTH)
+    return NULL;
+
+  manifest = (char *)TxnArenaAlloc(arena, size);
+  if (manifest == NULL)
+    return NULL;
+
+  p = manifest;
+  memcpy(p, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC) - 1);
+  p += sizeof(MANIFEST_MAGIC) - 1;
+  for (i = 0; i < count; i++) {
+    size_t n = strlen(paths[i]);
+
+    memcpy(p, paths[i], n);
+    p += n;
+    *p++ = '\n';
+  }
+  *p = '\0';
+
+  *length = p - manifest;
+  return manifest;
+}
+
+/* Split a NUL terminated manifest into its paths, in place. Returns
+   NULL if it isn't a manifest. */
+char **
+ManifestParse(TxnArena *arena, char *manifest, int *count)
+{
+  char **paths;
+  char *line, *end;
+  int lines = 0;
+
+  *count = 0;
+  if (strncmp(manifest, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC) - 1) != 0)
+    return NULL;
+  manifest += sizeof(MANIFEST_MAGIC) - 1;
+
+  for (line = manifest; *line; line++) {
+    if (*line == '\n')
+      lines++;
+  }
+
+  paths = (char **)TxnArenaAlloc(arena, sizeof(char *) * (lines + 1));
+  if (paths == NULL)
+    return NULL;
+
+  for (line = manifest; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+    *end = '\0';
+    if (*line == '/')
+      paths[(*count)++] = line;
+  }
+  return paths;
+}
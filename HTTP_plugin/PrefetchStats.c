@@ -0,0 +1,238 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef PREFETCH_STATS_H
+#define PREFETCH_STATS_H
+
+/* How many prefetched objects were asked for by a client afterwards,
+   per object and per page template. Both tables are direct mapped by
+   hash: a collision only replaces the older statistics. */
+#define PREFETCH_STATS_OBJECTS (1 << 16)
+#define PREFETCH_STATS_TEMPLATES 4096
+
+/* A prefetched object is used if a client asks for it within this
+   long. */
+#define PREFETCH_STATS_WINDOW_SECONDS 3600
+
+/* Nothing is decided before this many prefetches, and counters are
+   halved when they reach the maximum, so the statistics follow the
+   site as it changes. */
+#define PREFETCH_STATS_MIN_SAMPLES 8
+#define PREFETCH_STATS_MAX_SAMPLES 64
+
+/* An object used less than this percentage of the time isn't
+   prefetched any more, except once every PREFETCH_STATS_RETRY times
+   to see if that changed. */
+#define PREFETCH_STATS_USELESS 10
+#define PREFETCH_STATS_RETRY 16
+
+/* Objects fetched for one page: pages of a template whose objects are
+   used at least PREFETCH_STATS_USEFUL percent of the time get the
+   high budget, the ones under PREFETCH_STATS_WASTED the low one. */
+#define PREFETCH_BUDGET_LOW 8
+#define PREFETCH_BUDGET_DEFAULT 32
+#define PREFETCH_BUDGET_HIGH 200
+#define PREFETCH_STATS_USEFUL 80
+#define PREFETCH_STATS_WASTED 20
+
+int PrefetchStatsInit(void);
+uint64_t PrefetchTemplate(const char *page);
+int PrefetchStatsBudget(uint64_t page_template);
+int PrefetchStatsWanted(const char *name);
+void PrefetchStatsPrefetched(const char *name, uint64_t page_template);
+void PrefetchStatsUsed(const char *name);
+
+#endif /* PREFETCH_STATS_H */
+
+typedef struct {
+  uint64_t hash;
+  int prefetches;
+  int uses;
+} PrefetchCount;
+
+typedef struct {
+  PrefetchCount count;
+  uint64_t page_template;
+  int skipped;
+  TSHRTime pending_since; /* 0 when not waiting for a client */
+} PrefetchObjectStats;
+
+static PrefetchObjectStats *prefetch_objects;
+static PrefetchCount *prefetch_templates;
+static pthread_mutex_t prefetch_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int
+PrefetchStatsInit(void)
+{
+  prefetch_objects   = (PrefetchObjectStats *)calloc(PREFETCH_STATS_OBJECTS, sizeof(PrefetchObjectStats));
+  prefetch_templates = (PrefetchCount *)calloc(PREFETCH_STATS_TEMPLATES, sizeof(PrefetchCount));
+  if (!prefetch_objects || !prefetch_templates) {
+    free(prefetch_objects);
+    free(prefetch_templates);
+    prefetch_objects   = NULL;
+    prefetch_templates = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* Pages of the same template differ only by numbers, e.g. the news of
+   each day: /news/2016/1024.htm is /news/#/#.htm. The query is left
+   out. */
+uint64_t
+PrefetchTemplate(const char *page)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  const char *p;
+
+  for (p = page; *p && *p != '?'; p++) {
+    if (isdigit((unsigned char)*p)) {
+      while (isdigit((unsigned char)p[1]))
+        p++;
+      hash ^= '#';
+    } else {
+      hash ^= (unsigned char)*p;
+    }
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static PrefetchCount *
+prefetch_template_count(uint64_t page_template)
+{
+  PrefetchCount *count = &prefetch_templates[page_template % PREFETCH_STATS_TEMPLATES];
+
+  if (count->hash != page_template) {
+    memset(count, 0, sizeof(*count));
+    count->hash = page_template;
+  }
+  return count;
+}
+
+static PrefetchObjectStats *
+prefetch_object_stats(uint64_t hash)
+{
+  PrefetchObjectStats *stats = &prefetch_objects[hash % PREFETCH_STATS_OBJECTS];
+
+  if (stats->count.hash != hash) {
+    memset(stats, 0, sizeof(*stats));
+    stats->count.hash = hash;
+  }
+  return stats;
+}
+
+static void
+prefetch_count_add(PrefetchCount *count)
+{
+  if (++count->prefetches >= PREFETCH_STATS_MAX_SAMPLES) {
+    count->prefetches /= 2;
+    count->uses /= 2;
+  }
+}
+
+int
+PrefetchStatsBudget(uint64_t page_template)
+{
+  PrefetchCount *count;
+  int budget = PREFETCH_BUDGET_DEFAULT;
+
+  if (prefetch_templates == NULL)
+    return PREFETCH_BUDGET_HIGH;
+
+  pthread_mutex_lock(&prefetch_stats_mutex);
+  count = prefetch_template_count(page_template);
+  if (count->prefetches >= PREFETCH_STATS_MIN_SAMPLES) {
+    if (count->uses * 100 >= count->prefetches * PREFETCH_STATS_USEFUL)
+      budget = PREFETCH_BUDGET_HIGH;
+    else if (count->uses * 100 < count->prefetches * PREFETCH_STATS_WASTED)
+      budget = PREFETCH_BUDGET_LOW;
+  }
+  pthread_mutex_unlock(&prefetch_stats_mutex);
+  return budget;
+}
+
+/* 0 if name has been prefetched for nothing often enough. */
+int
+PrefetchStatsWanted(const char *name)
+{
+  PrefetchObjectStats *stats;
+  int wanted = 1;
+
+  if (prefetch_objects == NULL)
+    return 1;
+
+  pthread_mutex_lock(&prefetch_stats_mutex);
+  stats = prefetch_object_stats(CacheNameHash(name));
+  if (stats->count.prefetches >= PREFETCH_STATS_MIN_SAMPLES &&
+      stats->count.uses * 100 < stats->count.prefetches * PREFETCH_STATS_USELESS)
+    wanted = ++stats->skipped % PREFETCH_STATS_RETRY == 0;
+  pthread_mutex_unlock(&prefetch_stats_mutex);
+  return wanted;
+}
+
+/* name, one of the objects of a page of page_template, has just been
+   written into the cache. */
+void
+PrefetchStatsPrefetched(const char *name, uint64_t page_template)
+{
+  PrefetchObjectStats *stats;
+
+  if (prefetch_objects == NULL)
+    return;
+
+  pthread_mutex_lock(&prefetch_stats_mutex);
+  stats                = prefetch_object_stats(CacheNameHash(name));
+  stats->page_template = page_template;
+  stats->pending_since = TShrtime();
+  prefetch_count_add(&stats->count);
+  prefetch_count_add(prefetch_template_count(page_template));
+  pthread_mutex_unlock(&prefetch_stats_mutex);
+}
+
+/* A client asked for name and got it from the cache. */
+void
+PrefetchStatsUsed(const char *name)
+{
+  PrefetchObjectStats *stats;
+  PrefetchCount *count;
+  uint64_t hash;
+
+  if (prefetch_objects == NULL)
+    return;
+  hash = CacheNameHash(name);
+
+  pthread_mutex_lock(&prefetch_stats_mutex);
+  stats = &prefetch_objects[hash % PREFETCH_STATS_OBJECTS];
+  if (stats->count.hash == hash && stats->pending_since) {
+    /* Only the first request after the prefetch counts. */
+    if (TShrtime() - stats->pending_since <= (TSHRTime)PREFETCH_STATS_WINDOW_SECONDS * 1000000000) {
+      stats->count.uses++;
+      count = &prefetch_templates[stats->page_template % PREFETCH_STATS_TEMPLATES];
+      if (count->hash == stats->page_template)
+        count->uses++;
+    }
+    stats->pending_since = 0;
+  }
+  pthread_mutex_unlock(&prefetch_stats_mutex);
+}
@@ -0,0 +1,420 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ts/ts.h>
+#ifndef RANGE_REQUEST_H
+#define RANGE_REQUEST_H
+
+/* More ranges than this and the whole object is sent instead. */
+#define MAX_RANGES 16
+
+/* The stored response header must fit in this many bytes. */
+#define MAX_RANGE_HEADER_LENGTH 8192
+
+typedef enum {
+  RANGE_NONE = 0, /* not a range request */
+  RANGE_HEADER,   /* waiting for the header of the stored response */
+  RANGE_PASS,     /* can't be served as ranges, send the response as is */
+  RANGE_BODY,     /* sending the parts */
+  RANGE_DONE,     /* everything sent, the rest of the source is dropped */
+} TxnRangeStatus;
+
+typedef struct {
+  int64_t start; /* first and last byte of the body, inclusive */
+  int64_t end;
+  char *part_header; /* multipart only */
+} TxnRange;
+
+/* State of a range request. The source is the stored response, header
+   included, read from the cache or from the origin server. */
+typedef struct {
+  TxnRangeStatus status;
+  char *spec; /* value of the Range header */
+  TxnRange *ranges;
+  int count;
+  int current;
+  int64_t offset;          /* body bytes of the source consumed */
+  int64_t response_length; /* bytes written to the client in total */
+  char *trailer;           /* closing boundary of a multipart response */
+  char *header;            /* copy of the stored header */
+  int64_t object_size;     /* size of the stored response, -1 if unknown */
+} TxnRangeState;
+
+void RangeInit(TxnRangeState *range);
+void RangeSetRequest(TxnRangeState *range, TxnArena *arena, const char *request);
+void RangeTransform(TxnRangeState *range, TxnArena *arena, TSIOBufferReader src, TSIOBuffer dst);
+const char *find_request_header(const char *request, const char *name, int *length);
+
+#endif /* RANGE_REQUEST_H */
+
+void
+RangeInit(TxnRangeState *range)
+{
+  memset(range, 0, sizeof(TxnRangeState));
+  range->status      = RANGE_NONE;
+  range->object_size = -1;
+}
+
+/* Find the value of a header of a request or a response, the name is
+   matched without case. */
+const char *
+find_request_header(const char *request, const char *name, int *length)
+{
+  const char *line = strstr(request, "\r\n");
+  size_t name_length = strlen(name);
+
+  while (line && line[2] != '\r' && line[2] != '\0') {
+    line += 2;
+    if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+      line += name_length + 1;
+      while (*line == ' ' || *line == '\t')
+        line++;
+      *length = strcspn(line, "\r\n");
+      return line;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return NULL;
+}
+
+/* Remember the Range header of the client request, if it has one.
+   There is no validator to check an If-Range against, so such a
+   request gets the whole object. */
+void
+RangeSetRequest(TxnRangeState *range, TxnArena *arena, const char *request)
+{
+  const char *value;
+  int length;
+
+  RangeInit(range);
+  value = find_request_header(request, "Range", &length);
+  if (value == NULL || length == 0 || find_request_header(request, "If-Range", &length) != NULL)
+    return;
+
+  range->spec = TxnArenaStrndup(arena, value, length);
+  if (range->spec)
+    range->status = RANGE_HEADER;
+}
+
+static int
+range_compare(const void *a, const void *b)
+{
+  const TxnRange *ra = (const TxnRange *)a;
+  const TxnRange *rb = (const TxnRange *)b;
+
+  if (ra->start < rb->start)
+    return -1;
+  return ra->start > rb->start;
+}
+
+/* Parse "bytes=a-b, c-, -n" against a body of body_length bytes (RFC
+   7233). Unsatisfiable specs are dropped, the rest are sorted and
+   merged so the source can be read once from front to back. Returns
+   the number of ranges, 0 if none is satisfiable, -1 if the header is
+   invalid or asks for too many ranges. */
+static int
+range_parse(TxnRangeState *range, TxnArena *arena, int64_t body_length)
+{
+  TxnRange parsed[MAX_RANGES];
+  const char *p = range->spec;
+  char *end;
+  int64_t start, last;
+  int count = 0, i, merged;
+
+  while (isspace((unsigned char)*p))
+    p++;
+  if (strncasecmp(p, "bytes=", 6) != 0)
+    return -1;
+  p += 6;
+
+  for (;;) {
+    while (isspace((unsigned char)*p))
+      p++;
+
+    if (*p == '-') {
+      /* suffix range: the last n bytes */
+      last = strtoll(p + 1, &end, 10);
+      if (end == p + 1 || !isdigit((unsigned char)p[1]))
+        return -1;
+      start = last >= body_length ? 0 : body_length - last;
+      last  = body_length - 1;
+    } else if (isdigit((unsigned char)*p)) {
+      start = strtoll(p, &end, 10);
+      if (*end != '-')
+        return -1;
+      p = end + 1;
+      if (isdigit((unsigned char)*p)) {
+        last = strtoll(p, &end, 10);
+        if (last < start)
+          return -1;
+      } else {
+        end  = (char *)p;
+        last = body_length - 1;
+      }
+      if (last > body_length - 1)
+        last = body_length - 1;
+    } else {
+      return -1;
+    }
+
+    if (start <= last) {
+      if (count == MAX_RANGES)
+        return -1;
+      parsed[count].start       = start;
+      parsed[count].end         = last;
+      parsed[count].part_header = NULL;
+      count++;
+    }
+
+    p = end;
+    while (isspace((unsigned char)*p))
+      p++;
+    if (*p == '\0')
+      break;
+    if (*p != ',')
+      return -1;
+    p++;
+  }
+
+  if (count == 0)
+    return 0;
+
+  qsort(parsed, count, sizeof(TxnRange), range_compare);
+  merged = 0;
+  for (i = 1; i < count; i++) {
+    if (parsed[i].start <= parsed[merged].end + 1) {
+      if (parsed[i].end > parsed[merged].end)
+        parsed[merged].end = parsed[i].end;
+    } else {
+      parsed[++merged] = parsed[i];
+    }
+  }
+  count = merged + 1;
+
+  range->ranges = (TxnRange *)TxnArenaAlloc(arena, sizeof(TxnRange) * count);
+  if (range->ranges == NULL)
+    return -1;
+  memcpy(range->ranges, parsed, sizeof(TxnRange) * count);
+  range->count = count;
+  return count;
+}
+
+/* Copy the header of the stored response out of src without consuming
+   it. Returns its length, 0 if it isn't complete yet, -1 if it is too
+   long to be a header. */
+static int
+range_peek_header(TSIOBufferReader src, char *header)
+{
+  TSIOBufferBlock blk;
+  const char *start;
+  int64_t block_avail;
+  int length = 0;
+  char *header_end;
+
+  blk = TSIOBufferReaderStart(src);
+  while (blk && length < MAX_RANGE_HEADER_LENGTH) {
+    start = TSIOBufferBlockReadStart(blk, src, &block_avail);
+    if (block_avail > MAX_RANGE_HEADER_LENGTH - length)
+      block_avail = MAX_RANGE_HEADER_LENGTH - length;
+    memcpy(header + length, start, block_avail);
+    length += block_avail;
+    blk = TSIOBufferBlockNext(blk);
+  }
+  header[length] = '\0';
+
+  header_end = strstr(header, "\r\n\r\n");
+  if (header_end) {
+    header_end[2] = '\0';
+    return header_end - header + 4;
+  }
+  return length >= MAX_RANGE_HEADER_LENGTH ? -1 : 0;
+}
+
+/* Build the 206 (or 416) response header from the stored header, and
+   the part headers of a multipart response. Returns -1, with nothing
+   written, if the part headers can't be allocated. */
+static int
+range_start_response(TxnRangeState *range, TxnArena *arena, TSIOBuffer dst, char *header, int64_t body_length)
+{
+  char response[1024];
+  char boundary[40];
+  char content_type[100];
+  const char *value;
+  int64_t body = 0;
+  int i, n, length;
+
+  value = find_request_header(header, "Content-Type", &length);
+  snprintf(content_type, sizeof(content_type), "%.*s", value ? length : 0, value ? value : "");
+
+  if (range->count == 0) {
+    n = snprintf(response, sizeof(response),
+                 "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                 "Content-Range: bytes */%" PRId64 "\r\n"
+                 "Content-Length: 0\r\n"
+                 "Connection: close\r\n\r\n",
+                 body_length);
+    TSIOBufferWrite(dst, response, n);
+    range->response_length = n;
+    range->status          = RANGE_DONE;
+    return 0;
+  }
+
+  if (range->count == 1) {
+    n = snprintf(response, sizeof(response),
+                 "HTTP/1.1 206 Partial Content\r\n"
+                 "%s%s%s"
+                 "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n"
+                 "Content-Length: %" PRId64 "\r\n"
+                 "Accept-Ranges: bytes\r\n"
+                 "Connection: close\r\n\r\n",
+                 content_type[0] ? "Content-Type: " : "", content_type, content_type[0] ? "\r\n" : "", range->ranges[0].start,
+                 range->ranges[0].end, body_length, range->ranges[0].end - range->ranges[0].start + 1);
+    TSIOBufferWrite(dst, response, n);
+    range->response_length = n + range->ranges[0].end - range->ranges[0].start + 1;
+    range->status          = RANGE_BODY;
+    return 0;
+  }
+
+  /* multipart/byteranges: every part has its own small header. */
+  snprintf(boundary, sizeof(boundary), "HTTP_plugin_%016" PRIx64, (uint64_t)TShrtime());
+  for (i = 0; i < range->count; i++) {
+    char part[512];
+
+    n = snprintf(part, sizeof(part),
+                 "\r\n--%s\r\n"
+                 "%s%s%s"
+                 "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n\r\n",
+                 boundary, content_type[0] ? "Content-Type: " : "", content_type, content_type[0] ? "\r\n" : "",
+                 range->ranges[i].start, range->ranges[i].end, body_length);
+    range->ranges[i].part_header = TxnArenaStrndup(arena, part, n);
+    if (range->ranges[i].part_header == NULL)
+      return -1;
+    body += n + range->ranges[i].end - range->ranges[i].start + 1;
+  }
+  n              = snprintf(response, sizeof(response), "\r\n--%s--\r\n", boundary);
+  range->trailer = TxnArenaStrndup(arena, response, n);
+  if (range->trailer == NULL)
+    return -1;
+  body += n;
+
+  n = snprintf(response, sizeof(response),
+               "HTTP/1.1 206 Partial Content\r\n"
+               "Content-Type: multipart/byteranges; boundary=%s\r\n"
+               "Content-Length: %" PRId64 "\r\n"
+               "Accept-Ranges: bytes\r\n"
+               "Connection: close\r\n\r\n",
+               boundary, body);
+  TSIOBufferWrite(dst, response, n);
+  TSIOBufferWrite(dst, range->ranges[0].part_header, strlen(range->ranges[0].part_header));
+  range->response_length = n + body;
+  range->status          = RANGE_BODY;
+  return 0;
+}
+
+/* Move what src has to dst: wait for the stored header, answer with the
+   206 header, then skip the bytes outside the ranges and copy the rest.
+   When the size of the stored response isn't known the Content-Length
+   of the stored header is used.
+   The caller checks range->status afterwards: RANGE_PASS means src was
+   left untouched and must be sent as is. */
+void
+RangeTransform(TxnRangeState *range, TxnArena *arena, TSIOBufferReader src, TSIOBuffer dst)
+{
+  TxnRange *r;
+  int64_t avail, n, body_length;
+  int header_length;
+
+  if (range->status == RANGE_HEADER) {
+    const char *value;
+    int length;
+
+    if (range->header == NULL)
+      range->header = (char *)TxnArenaAlloc(arena, MAX_RANGE_HEADER_LENGTH + 1);
+    if (range->header == NULL) {
+      range->status = RANGE_PASS;
+      return;
+    }
+    header_length = range_peek_header(src, range->header);
+    if (header_length == 0)
+      return;
+
+    /* Only complete 200 responses of known length can be cut. */
+    if (header_length < 0 || strncmp(range->header, "HTTP/1.", 7) != 0 || strncmp(range->header + 9, "200", 3) != 0 ||
+        find_request_header(range->header, "Transfer-Encoding", &length) != NULL) {
+      range->status = RANGE_PASS;
+      return;
+    }
+    if (range->object_size >= 0) {
+      body_length = range->object_size - header_length;
+    } else {
+      value       = find_request_header(range->header, "Content-Length", &length);
+      body_length = value ? strtoll(value, NULL, 10) : -1;
+    }
+    if (body_length < 0 || range_parse(range, arena, body_length) < 0) {
+      range->status = RANGE_PASS;
+      return;
+    }
+
+    if (range_start_response(range, arena, dst, range->header, body_length) < 0) {
+      range->status = RANGE_PASS;
+      return;
+    }
+    TSIOBufferReaderConsume(src, header_length);
+    range->offset = 0;
+  }
+
+  while (range->status == RANGE_BODY && (avail = TSIOBufferReaderAvail(src)) > 0) {
+    r = &range->ranges[range->current];
+
+    if (range->offset < r->start) {
+      n = r->start - range->offset;
+      if (n > avail)
+        n = avail;
+      TSIOBufferReaderConsume(src, n);
+      range->offset += n;
+      continue;
+    }
+
+    n = r->end + 1 - range->offset;
+    if (n > avail)
+      n = avail;
+    TSIOBufferCopy(dst, src, n, 0);
+    TSIOBufferReaderConsume(src, n);
+    range->offset += n;
+
+    if (range->offset > r->end) {
+      range->current++;
+      if (range->current == range->count) {
+        if (range->trailer)
+          TSIOBufferWrite(dst, range->trailer, strlen(range->trailer));
+        range->status = RANGE_DONE;
+      } else if (range->ranges[range->current].part_header) {
+        TSIOBufferWrite(dst, range->ranges[range->current].part_header, strlen(range->ranges[range->current].part_header));
+      }
+    }
+  }
+
+  if (range->status == RANGE_DONE)
+    TSIOBufferReaderConsume(src, TSIOBufferReaderAvail(src));
+}
@@ -0,0 +1,168 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef TXN_ARENA_H
+#define TXN_ARENA_H
+
+/* Size of the chunk every TxnSM keeps across transactions. Requests,
+   file names and parsed URL lists of a normal page fit in it. */
+#define TXN_ARENA_CHUNK_SIZE 16384
+#define TXN_ARENA_ALIGN 16
+
+typedef struct _TxnArenaChunk {
+  struct _TxnArenaChunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+} TxnArenaChunk;
+
+/* Bump allocator owned by one transaction. Memory is never freed
+   piece by piece, the whole arena is released by TxnArenaReset when
+   the transaction is done. */
+typedef struct _TxnArena {
+  TxnArenaChunk *head;  /* chunk currently allocated from */
+  TxnArenaChunk *first; /* chunk kept by TxnArenaReset */
+} TxnArena;
+
+void TxnArenaInit(TxnArena *arena);
+void *TxnArenaAlloc(TxnArena *arena, size_t size);
+void *TxnArenaCalloc(TxnArena *arena, size_t size);
+char *TxnArenaStrndup(TxnArena *arena, const char *str, size_t len);
+void TxnArenaReset(TxnArena *arena);
+void TxnArenaDestroy(TxnArena *arena);
+
+#endif /* TXN_ARENA_H */
+
+static TxnArenaChunk *
+arena_chunk_create(size_t size)
+{
+  TxnArenaChunk *chunk;
+
+  chunk = (TxnArenaChunk *)malloc(sizeof(TxnArenaChunk) + size);
+  if (chunk == NULL)
+    return NULL;
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+void
+TxnArenaInit(TxnArena *arena)
+{
+  arena->first = arena_chunk_create(TXN_ARENA_CHUNK_SIZE);
+  arena->head  = arena->first;
+}
+
+/* Allocations bigger than the chunk size get a chunk of their own,
+   so a large scratch area never wastes the rest of the base chunk. */
+void *
+TxnArenaAlloc(TxnArena *arena, size_t size)
+{
+  TxnArenaChunk *chunk;
+  size_t offset;
+
+  if (arena->head == NULL) {
+    TxnArenaInit(arena);
+    if (arena->head == NULL)
+      return NULL;
+  }
+
+  chunk  = arena->head;
+  offset = (chunk->used + TXN_ARENA_ALIGN - 1) & ~(size_t)(TXN_ARENA_ALIGN - 1);
+
+  if (offset + size > chunk->size) {
+    if (size > TXN_ARENA_CHUNK_SIZE) {
+      /* Keep allocating small pieces from the current chunk. */
+      chunk = arena_chunk_create(size);
+      if (chunk == NULL)
+        return NULL;
+      chunk->used       = size;
+      chunk->next       = arena->head->next;
+      arena->head->next = chunk;
+      return chunk->data;
+    }
+
+    chunk = arena_chunk_create(TXN_ARENA_CHUNK_SIZE);
+    if (chunk == NULL)
+      return NULL;
+    chunk->next = arena->head;
+    arena->head = chunk;
+    offset      = 0;
+  }
+
+  chunk->used = offset + size;
+  return chunk->data + offset;
+}
+
+void *
+TxnArenaCalloc(TxnArena *arena, size_t size)
+{
+  void *ptr = TxnArenaAlloc(arena, size);
+
+  if (ptr)
+    memset(ptr, 0, size);
+  return ptr;
+}
+
+/* Copy len bytes of str and terminate the copy. */
+char *
+TxnArenaStrndup(TxnArena *arena, const char *str, size_t len)
+{
+  char *copy = (char *)TxnArenaAlloc(arena, len + 1);
+
+  if (copy == NULL)
+    return NULL;
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+/* Release everything allocated by the transaction in one shot. The
+   base chunk is kept so the next transaction doesn't malloc at all. */
+void
+TxnArenaReset(TxnArena *arena)
+{
+  TxnArenaChunk *chunk = arena->head;
+  TxnArenaChunk *next;
+
+  while (chunk) {
+    next = chunk->next;
+    if (chunk != arena->first)
+      free(chunk);
+    chunk = next;
+  }
+
+  arena->head = arena->first;
+  if (arena->first) {
+    arena->first->next = NULL;
+    arena->first->used = 0;
+  }
+}
+
+void
+TxnArenaDestroy(TxnArena *arena)
+{
+  TxnArenaReset(arena);
+  free(arena->first);
+  arena->first = NULL;
+  arena->head  = NULL;
+}
@@ -20,19 +20,62 @@
 #include <netinet/in.h>
 #include "ts/ink_defs.h"
 #include <pthread.h>
+#include "TxnArena.c"
+#include "IOBufferPool.c"
+#include "Overload.c"
+#include "OriginHealth.c"
+#include "OriginTls.c"
+#include "OriginFetch.c"
+#include "OriginH2.c"
+#include "RangeRequest.c"
+#include "PageManifest.c"
+#include "EarlyHints.c"
+#include "UrlExtract.c"
+#include "UrlResolve.c"
+#include "CacheFilter.c"
+#include "ContentEncoding.c"
+#include "HotCache.c"
+#include "AdmissionSketch.c"
+#include "PrefetchStats.c"
+#include "NextPage.c"
+#include "LinkCrawl.c"
 #ifndef TXN_SM_H
 #define TXN_SM_H
 
 typedef int (*TxnSMHandler)(TSCont contp, TSEvent event, void *data);
+struct _TxnSM;
+typedef int (*TxnSMWork)(struct _TxnSM *txn_sm);
 
 TSCont TxnSMCreate(TSMutex pmutex, TSVConn client_vc, int server_port);
+void TxnSMStart(TSVConn client_vc, int server_port, OverloadVerdict verdict);
 
 #define MAX_FILE_PATH_LENGTH 1024
 
+/* Largest part of an html page kept for finding its embedded objects. */
+#define MAX_PAGE_PARSE_LENGTH (1024 * 1024)
+#define PAGE_PARSE_CHUNK_SIZE (64 * 1024)
+
+/* Embedded objects taken from one page, and the longest path kept. */
+#define MAX_PARSED_URL_NUM 100
+#define MAX_PARSED_URL_LENGTH 200
+
+/* Objects prefetched for one page, stylesheet references included. */
+#define MAX_PREFETCH_OBJECTS 200
+/* Pages predicted to be visited next warmed after a page. */
+#define MAX_NEXT_PAGES 2
+
+/* Largest prefetched response, and the number of idle buffers of that
+   size kept for the next fetches. */
+#define PREFETCH_RESPONSE_SIZE 1000000
+#define PREFETCH_RESPONSE_POOL_MAX 16
+
 #define TXN_SM_ALIVE 0xAAAA0123
 #define TXN_SM_DEAD 0xFEE1DEAD
 #define TXN_SM_ZERO 0x00001111
 
+/* Number of finished TxnSM objects kept for reuse. */
+#define TXN_SM_POOL_MAX 256
+
 
 
 
@@ -44,7 +87,9 @@ typedef struct _TxnSM {
 	char **server_response;				//存server response用
 	int *response_byte_read;			//存server response size
 	int number;							//儲存總共幾個response
+	int capacity;	//filename、server_response、response_byte_read配置了幾格
 	int count;		//紀錄寫入cache次數
+	int prefetch_budget;	//這個網頁還可以向origin抓幾個物件
 	TSCacheKey apple_key;	
 	//custom end	
 	
@@ -69,8 +114,9 @@ typedef struct _TxnSM {
   TSVIO q_client_read_vio;
   TSVIO q_client_write_vio;
   TSIOBuffer q_client_request_buffer;
-  TSIOBuffer q_client_response_buffer;
   TSIOBufferReader q_client_request_buffer_reader;
+  /* On a miss, the reader of the server response buffer the client
+     write drains. */
   TSIOBufferReader q_client_response_buffer_reader;
 
   TSVIO q_server_read_vio;
@@ -78,9 +124,16 @@ typedef struct _TxnSM {
   TSIOBuffer q_server_request_buffer;
   TSIOBuffer q_server_response_buffer;
   TSIOBufferReader q_server_request_buffer_reader;
-  int q_server_response_length;
-  int q_block_bytes_read;
-  int q_cache_response_length;
+  TxnBufferClass q_server_response_class;
+  int64_t q_server_response_length;
+
+  /* Copy of the html page being fetched, parsed for embedded objects
+     when the transfer is done. */
+  TSIOBufferReader q_page_reader;
+  char *q_page;
+  int q_page_length;
+  int q_page_size;
+  int q_page_checked;
 
   /* Cache related */
   TSVConn q_cache_vc;
@@ -90,15 +143,62 @@ typedef struct _TxnSM {
   TSIOBuffer q_cache_read_buffer;
   TSIOBufferReader q_cache_read_buffer_reader;
 
+  /* Range request: the parts cut out of the cached doc or of the
+     server response are written here for the client. */
+  TxnRangeState q_range;
+  TSIOBuffer q_range_buffer;
+  TSIOBufferReader q_range_buffer_reader;
+
+  /* Variant looked up first, from the Accept-Encoding of the request. */
+  TxnEncoding q_encoding;
+
+  /* Name of the pending cache lookup, NULL when the cache filter
+     answered it. */
+  const char *q_lookup_name;
+
+  /* A small doc read from the cache is kept in RAM once the client has
+     it: a clone of the cache read buffer holds it until then. */
+  TSIOBufferReader q_hot_reader;
+  const char *q_hot_name;
+  int64_t q_hot_length;
+
+  /* Only a hit on a page has its manifest checked once sent: a clone
+     of the cache read buffer holds the start of the doc until its
+     Content-Type is known. */
+  TSIOBufferReader q_head_reader;
+  int q_page_hit;
+
+  /* Everything the transaction allocates lives here and is released
+     at once in state_done. */
+  TxnArena q_arena;
+  struct _TxnSM *q_pool_next;
+
+  /* Holds a transaction slot, see Overload.c. A rejected transaction
+     only answers 503 to the request. */
+  int q_admitted;
+  int q_rejected;
+
+  /* The demand fetch of a miss, to learn why the origin gave nothing. */
+  OriginFetchJob *q_fetch;
+
+  /* Runs on a plugin thread, see run_on_plugin_thread. */
+  TxnSMWork q_work;
+
 } TxnSM;
 
 #endif /* Txn_SM_H */
 
 extern TSTextLogObject protocol_plugin_log;
+extern int early_hints_enabled;
+extern int speculative_connect_enabled;
+extern int prefetch_css_depth;
+extern int prefetch_admit_min;
+extern int crawl_depth;
+extern int prefetch_connections;
 
-/* Fix me: currently, tunnelling server_response from OS to both cache and
-   client doesn't work for client_vc. So write data first to cache and then
-   write cached data to client. */
+/* On a miss the server response is tunnelled to both the cache and the
+   client as it arrives; the embedded objects of the page are prefetched
+   into the cache once the client has been served. */
 
 /* static functions */
 int main_handler(TSCont contp, TSEvent event, void *data);
@@ -111,7 +211,8 @@ int state_send_response_to_client(TSCont contp, TSEvent event, TSVIO vio);
 
 /* functions for cache operation */
 int state_handle_cache_lookup(TSCont contp, TSEvent event, TSVConn vc);
-int state_handle_cache_read_response(TSCont contp, TSEvent event, TSVIO vio);
+int state_stream_cache_to_client(TSCont contp, TSEvent event, TSVIO vio);
+int state_serve_range_from_cache(TSCont contp, TSEvent event, TSVIO vio);
 int state_handle_cache_prepare_for_write(TSCont contp, TSEvent event, TSVConn vc);
 int state_write_to_cache(TSCont contp, TSEvent event, TSVIO vio);
 
@@ -121,20 +222,24 @@ int state_connect_to_server(TSCont contp, TSEvent event, TSVConn vc);
 int state_interface_with_server(TSCont contp, TSEvent event, TSVIO vio);
 int state_send_request_to_server(TSCont contp, TSEvent event, TSVIO vio);
 int state_read_response_from_server(TSCont contp, TSEvent event, TSVIO vio);
+int state_stream_response_to_client(TSCont contp, TSEvent event, TSVIO vio);
+int state_handle_response_done(TSCont contp);
+int state_background_done(TSCont contp, TSEvent event, void *data);
 
 /* misc functions */
 int state_done(TSCont contp, TSEvent event, TSVIO vio);
 
-int send_response_to_client(TSCont contp);
+int send_response_to_client(TSCont contp, TSIOBufferReader reader, int64_t response_len);
 int prepare_to_die(TSCont contp);
+static void release_server_response_buffer(TxnSM *txn_sm);
 
-char *get_info_from_buffer(TSIOBufferReader the_reader);
+char *get_info_from_buffer(TxnArena *arena, TSIOBufferReader the_reader);
 int is_request_end(char *buf);
 int parse_request(char *request, char *server_name, char *file_name);
 TSCacheKey CacheKeyCreate(char *file_name);
 
 char* get_http_header_field_value(char* http_header,char* header_field_name);
-char** get_http_request_info(char* cilent_request);
+char** get_http_request_info(TxnArena *arena, char* cilent_request);
 int get_header_length(char http_response[]);
 
 //............................................................
@@ -142,14 +247,46 @@ int get_header_length(char http_response[]);
 int jesse_test_write_complete(TSCont contp, TSEvent event, TSVIO vio);
 int jeese_test(TSCont contp, TSEvent event, TSVConn vc);
 int begin_transmission_with_server(TSCont contp, TSEvent event, void *data);
-int parse_url_and_send_request_use_pthread(TSCont contp, TSEvent event, void *data);
-
-void parsing_request_all_URL(char *server_respone,char *result_parsing_url , int response_size,int array_size, int *num);
+static int parse_page(TxnSM *txn_sm);
+static int parse_url_and_send_request_use_pthread(TxnSM *txn_sm);
+static int start_prefetch_write(TSCont contp);
+static void add_encoded_variants(TxnSM *txn_sm);
+static void add_page_manifest(TxnSM *txn_sm);
+static void add_preload_page(TxnSM *txn_sm, int count);
+static int prefetch_grow(TxnSM *txn_sm, int needed);
+static int queue_prefetch_write(TxnSM *txn_sm, char *name, char *response, int length);
+static int fetch_prefetch_objects(TxnSM *txn_sm, int first, int filtered);
+static void add_referenced_objects(TxnSM *txn_sm, int index, const char *type);
+static void add_next_pages(TxnSM *txn_sm);
+static void add_crawl_pages(TxnSM *txn_sm);
+static void record_navigation(TxnSM *txn_sm, const char *request);
+static int start_manifest_lookup(TSCont contp);
+static int warm_next_pages(TSCont contp);
+static int cache_read(TSCont contp, const char *name);
+static int serve_hot_object(TSCont contp, const char *name);
+static void keep_hot_object(TxnSM *txn_sm);
+int state_handle_manifest_lookup(TSCont contp, TSEvent event, TSVConn vc);
+int state_read_manifest(TSCont contp, TSEvent event, TSVIO vio);
+int state_check_manifest_object(TSCont contp, TSEvent event, TSVConn vc);
+static int start_early_hints(TSCont contp);
+static int continue_page_miss(TSCont contp);
+static char **take_manifest(TxnSM *txn_sm, int *count);
+int state_handle_hints_manifest_lookup(TSCont contp, TSEvent event, TSVConn vc);
+int state_read_hints_manifest(TSCont contp, TSEvent event, TSVIO vio);
+int state_send_early_hints(TSCont contp, TSEvent event, TSVIO vio);
+static int send_overloaded(TSCont contp);
+static int send_origin_error(TSCont contp, int status);
+int state_send_canned_response(TSCont contp, TSEvent event, TSVIO vio);
+static void start_waiting_transaction(int server_port);
+static void release_transaction_slot(TxnSM *txn_sm);
+
+void parsing_request_all_URL(char *server_respone,const char *host,const char *base,char *result_parsing_url , int response_size,int array_size, int max_num, int *num);
 	/* 用途： 解析網頁裡頭所有相對路徑檔案網址,並計算有幾個 
 		server_respone	: 要被解析出網址的陣列 ,資料型態:一維陣列 
 		result_parsing_url:   把解析出來的網址存放在該位址 ,資料型態:傳入二維陣列的第一個地址 
 		response_size: server_respone的大小
 		array_size: 二維陣列中array[i][k]的k的size值
+		max_num : 二維陣列最多可存幾個網址
 		num : 把解析出來的網址的數量存放在該位址
 	*/
 
@@ -157,136 +294,268 @@ struct thread_data {
     long thread_id;		//thread編號
     char thread_filename[200];		//欲請求的檔案
     long thread_portno;				//port
-	char thread_server_response[1000000];	//存server response用
+	char *thread_server_response;	//存server response用,PREFETCH_RESPONSE_SIZE大小,從pool拿
 	long thread_response_byte_read;			//存server response size
-	char server_IP[20];						//要發送request的serverIP
+	TSHRTime deadline;	//整批prefetch要在這之前抓完
+	char server_name[MAX_SERVER_NAME_LENGTH + 1];	//網站名稱,實際連到哪個replica由OriginOpen決定
 };
 
+//抓prefetch物件用的response buffer:用完放回來,下一次不用再malloc 1MB
+static char *prefetch_response_pool[PREFETCH_RESPONSE_POOL_MAX];
+static int prefetch_response_pool_count;
+static pthread_mutex_t prefetch_response_pool_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static char *prefetch_response_get(void)
+{
+		char *buffer = NULL;
+
+		pthread_mutex_lock(&prefetch_response_pool_lock);
+		if (prefetch_response_pool_count > 0)
+			buffer = prefetch_response_pool[--prefetch_response_pool_count];
+		pthread_mutex_unlock(&prefetch_response_pool_lock);
+		return buffer ? buffer : malloc(PREFETCH_RESPONSE_SIZE);
+}
+
+static void prefetch_response_put(char *buffer)
+{
+		if (buffer == NULL)
+			return;
+		pthread_mutex_lock(&prefetch_response_pool_lock);
+		if (prefetch_response_pool_count < PREFETCH_RESPONSE_POOL_MAX) {
+			prefetch_response_pool[prefetch_response_pool_count++] = buffer;
+			buffer = NULL;
+		}
+		pthread_mutex_unlock(&prefetch_response_pool_lock);
+		free(buffer);	//pool滿了
+}
 
 void* connectSocket(void* information) {
-   long ID = ((struct thread_data*) information) -> thread_id;			//thread編號
-   char *filename=((struct thread_data*) information) ->thread_filename;	//準備要請求的路徑和檔名
-   char *server_name=((struct thread_data*) information) ->server_IP;
-   
-   int n,sockfd,bytes_read;
-   char buffer[1024];				//暫存部分response
-	struct sockaddr_in serv_addr;   //用來保存socket資訊的資料結構
-	struct hostent *server; 	    // server :存server用
-	
+	struct thread_data *data = (struct thread_data*) information;
+	char *response = data->thread_server_response;
+	int size = PREFETCH_RESPONSE_SIZE - 1;	//留一個位置給結尾的'\0'
+	int n, bytes_read = 0;
+	char *content_length;
+	OriginConn conn;
+
 	//宣告request 資料
-	char *request = (char *)malloc(sizeof(char) * (MAX_REQUEST_LENGTH + 1));  
-	memset(request, '\0', (sizeof(char) * (MAX_REQUEST_LENGTH + 1)));
+	char request[MAX_REQUEST_LENGTH + 1];
+
+	data->thread_response_byte_read = 0;
+	OriginDeadlineSet(data->deadline);	//連線、重試、讀取都不超過這一批的時限
 	
 	//製造request
-	strncat(request ,"GET ",4);
-	strncat(request ,filename,strlen(filename));
-	strncat(request," HTTP/1.1\r\nHost: ",17);
-	strncat(request,server_name,strlen(server_name));
-	strncat(request,"\r\nConnection: close\r\n\r\n",25);
-	
-		
+	snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", data->thread_filename, data->server_name);
 	
-	//create socket
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		TSDebug("HTTP_plugin", "thread id is  %ld",ID);
-		TSError("ERROR opening socket");
+	//建立連線、送出request、等到response的第一個byte:逾時會重試,origin掛掉時直接放棄
+	if (OriginOpen(data->server_name, data->thread_portno, request, 0, response, size, &bytes_read, &conn) < 0) {
+		TSDebug("HTTP_plugin", "thread id is %ld, %s not fetched", data->thread_id, data->thread_filename);
+		return 0;
 	}
-	//serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(80); 
 
-	
-	//建立server資訊
-	server = gethostbyname(server_name);
-	if (server == NULL) {
-		printf("thread id is %ld",ID);
-        fprintf(stderr,"ERROR, no such host\n");
-        exit(0);
-    }
-	
-	bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-	//建立連線
-	if(connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0)
-			TSError("connect failed. Error");
-	
-	//送出request
-	n= write(sockfd,request,strlen(request));
-	if(n<0)
-		TSError("ERROR writing to socket");
-   
+	//接收response,兩次read之間最多等idle timeout
+	while (bytes_read < size) {
+		n = origin_read(&conn, response + bytes_read, size - bytes_read, origin_timeouts.idle_ms);
+		if (n < 0) {
+			TSError("[protocol] response of %s from %s cut: %s", data->thread_filename, conn.server->host, strerror(errno));
+			OriginFailed(conn.server);
+			bytes_read = 0;
+			break;
+		}
+		if (n == 0)
+			break;
+		bytes_read += n;
+	}
+	//關閉連線
+	OriginClose(&conn);
+	response[bytes_read] = '\0';
+
+	//不完整或太大的response不存
+	if (bytes_read == size || !strstr(response, "\r\n\r\n"))
+		return 0;
+	content_length = get_http_header_field_value(response, "Content-Length");
+	if (content_length != NULL) {
+		int all_response_size = atoi(content_length) + get_header_length(response);
+
+		if (bytes_read < all_response_size) {
+			TSDebug("HTTP_plugin", "%s: %d of %d bytes", data->thread_filename, bytes_read, all_response_size);
+			return 0;
+		}
+		bytes_read = all_response_size;
+	}
+	TSDebug("HTTP_plugin","thread id is %ld is finsih %s",data->thread_id,data->thread_filename);
+	data->thread_response_byte_read = bytes_read;
+    return 0;
+}
 
-    char *http_header_end_ptr=NULL;
-	char *content_length_ptr=NULL;
-	bytes_read=0;
+//一串prefetch共用一條keep-alive連線:request一次全部送出,response依序回來
+struct pipeline_data {
+	struct thread_data **objects;	//這條連線要抓的物件,依送出順序
+	int count;
+	char server_name[MAX_SERVER_NAME_LENGTH + 1];
+	long portno;
+	TSHRTime deadline;	//整批prefetch要在這之前抓完
+};
 
-	//接收response
-	
-	while(n>0 && !http_header_end_ptr){
-    	bzero(buffer,1024);
-    	n = read(sockfd,buffer,1024);
-		memcpy(((struct thread_data*) information)->thread_server_response+bytes_read,buffer,n);
-		bytes_read = bytes_read + n;    	
-    	http_header_end_ptr = strstr(buffer,"\r\n\r\n");
-		
-    }
-		
-    if(http_header_end_ptr != NULL)
-	{	
-		int header_length = get_header_length(((struct thread_data*) information)->thread_server_response);
-		
-        content_length_ptr = strstr(((struct thread_data*) information)->thread_server_response,"Content-Length");
-		if( content_length_ptr!= NULL)
-		{
-			char *content_length_temp = malloc(sizeof(char)*11);
-			memcpy(content_length_temp,content_length_ptr+16,strcspn(content_length_ptr,"\r")-16);
-			int content_length = atoi(content_length_temp);
-			free(content_length_temp);
-			
-			int all_response_size = content_length + header_length;
-			do{
-				bzero(buffer,1024);
-				n = read(sockfd,buffer,1024);
-				memcpy(((struct thread_data*) information)->thread_server_response+bytes_read,buffer,n);
-				bytes_read = bytes_read + n;
-				}while(n > 0);
-			
-			close(sockfd);
-			
-			
-			((struct thread_data*) information) ->thread_response_byte_read = all_response_size;
+//在p到end之間找下一個"\r\n",沒有回傳NULL
+static char *pipeline_line_end(char *p, char *end)
+{
+		while ((p = memchr(p, '\r', end - p)) != NULL) {
+			if (p + 1 < end && p[1] == '\n')
+				return p;
+			p++;
 		}
-		else{
-			do{
-				bzero(buffer,1024);
-				n = read(sockfd,buffer,1024);
-				memcpy(((struct thread_data*) information)->thread_server_response+bytes_read,buffer,n);
-				bytes_read = bytes_read + n;
-				
-				}while(n > 0);
-			close(sockfd);
-			((struct thread_data*) information) ->thread_response_byte_read = bytes_read;
-			
-			
+		return NULL;
+}
+
+//response已收到length個byte,回傳它的總長度(header加body);還沒收完回傳0,
+//沒有Content-Length也不是chunked、只能等連線關閉才知道結尾的回傳-1
+static int pipeline_response_length(char *response, int length)
+{
+		char *end = response + length;
+		char *header_end = response, *line, *p;
+		int header_length, status, body = -1, chunked = 0;
+		long chunk;
+
+		//header的結尾是空行
+		for (line = response; (p = pipeline_line_end(line, end)) != NULL; line = p + 2) {
+			if (p == line && line != response) {
+				header_end = p + 2;
+				break;
+			}
+		}
+		if (header_end == response)
+			return 0;
+		header_length = header_end - response;
+		if (sscanf(response, "HTTP/%*d.%*d %d", &status) != 1)
+			return -1;
+		if (status >= 100 && status < 200) {
+			//103之類的暫時回應後面還跟著真正的response
+			int rest = pipeline_response_length(header_end, length - header_length);
+
+			return rest > 0 ? header_length + rest : rest;
+		}
+		if (status == 204 || status == 304)	//沒有body
+			return header_length;
+
+		for (line = pipeline_line_end(response, end) + 2; line < header_end - 2; line = p + 2) {
+			p = pipeline_line_end(line, end);
+			if (strncasecmp(line, "Content-Length:", 15) == 0)
+				body = atoi(line + 15);
+			else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && p - line >= 25 && strncasecmp(p - 7, "chunked", 7) == 0)
+				chunked = 1;
 		}
-		TSDebug("HTTP_plugin","thread id is %ld is finsih %s",ID,filename);
 
+		if (chunked) {
+			//一個個chunk跳過去,直到大小為0的那個,再跳過trailer到空行
+			for (p = header_end;;) {
+				char *size_end;
+
+				if ((line = pipeline_line_end(p, end)) == NULL)
+					return 0;
+				chunk = strtol(p, &size_end, 16);
+				if (size_end == p || chunk < 0)
+					return -1;
+				p = line + 2;
+				if (chunk == 0)
+					break;
+				if (end - p < chunk + 2)
+					return 0;
+				p += chunk + 2;
+			}
+			for (;;) {
+				if ((line = pipeline_line_end(p, end)) == NULL)
+					return 0;
+				if (line == p)
+					return line + 2 - response;
+				p = line + 2;
+			}
+		}
+		if (body < 0)
+			return -1;
+		if (length - header_length < body)
+			return 0;
+		return header_length + body;
+}
+
+void* pipelineSocket(void* information) {
+	struct pipeline_data *data = (struct pipeline_data*) information;
+	size_t request_size = data->count * (sizeof(data->objects[0]->thread_filename) + MAX_SERVER_NAME_LENGTH + 64);
+	char *request = malloc(request_size);
+	int next = 0, limit = data->count;	//objects[next]到objects[limit-1]在同一條連線上送
+
+	if (request == NULL)
+		return 0;
+	OriginDeadlineSet(data->deadline);	//連線、重試、讀取都不超過這一批的時限
+	while (next < data->count) {
+		OriginConn conn;
+		int first = next, have = 0, length = 0, reopen = 0, n, i;
+
+		if (next >= limit)
+			limit = data->count;
+		//還沒收到的request一次送出,最後一個請server回完就關
+		for (i = next; i < limit; i++)
+			length += snprintf(request + length, request_size - length, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+			                   data->objects[i]->thread_filename, data->server_name, i == limit - 1 ? "close" : "keep-alive");
+		if (OriginOpen(data->server_name, data->portno, request, 0, data->objects[next]->thread_server_response,
+		               PREFETCH_RESPONSE_SIZE - 1, &have, &conn) < 0) {
+			TSDebug("HTTP_plugin", "%d objects of %s not fetched", data->count - next, data->server_name);
+			break;
+		}
+
+		while (next < limit) {
+			struct thread_data *object = data->objects[next];
+			char *response = object->thread_server_response;
+			int size = PREFETCH_RESPONSE_SIZE - 1;	//留一個位置給結尾的'\0'
+			int total;
+
+			response[have] = '\0';
+			total = pipeline_response_length(response, have);
+			if (total > 0) {
+				//收完一個,多收到的是下一個response的開頭
+				TSDebug("HTTP_plugin","pipeline to %s finished %s",conn.server->host,object->thread_filename);
+				object->thread_response_byte_read = total;
+				have -= total;
+				if (++next < limit)
+					memcpy(data->objects[next]->thread_server_response, response + total, have);
+				continue;
+			}
+			if (have == size) {
+				//太大的response不存,後面的已經對不上了,換一條連線
+				TSDebug("HTTP_plugin", "%s too large", object->thread_filename);
+				next++;
+				reopen = 1;
+				break;
+			}
+			if (total < 0 && next < limit - 1) {
+				//不知道這個response在哪裡結束,改成自己一條連線、收到關閉為止
+				limit  = next + 1;
+				reopen = 1;
+				break;
+			}
+			n = origin_read(&conn, response + have, size - have, origin_timeouts.idle_ms);
+			if (n < 0) {
+				TSError("[protocol] response of %s from %s cut: %s", object->thread_filename, conn.server->host, strerror(errno));
+				OriginFailed(conn.server);
+				break;
+			}
+			if (n == 0) {
+				//最後一個沒有長度的response到連線關閉為止
+				if (total < 0) {
+					object->thread_response_byte_read = have;
+					next++;
+				}
+				//server可能限制一條連線的request數,有進展就用新連線送剩下的
+				reopen = next > first;
+				break;
+			}
+			have += n;
+		}
+		OriginClose(&conn);
+		if (next < data->count && !reopen && next < limit)
+			break;
 	}
-	else
-	{
-	
-		close(sockfd);
-		((struct thread_data*) information) ->thread_response_byte_read = bytes_read;
-	}
-	//關閉socket
-	//	close(sockfd);
-	//((struct thread_data*) information) ->thread_response_byte_read = bytes_read;
 	free(request);
-   
-   
-  
-    return 0;
+	return 0;
 }
 
 
@@ -318,6 +587,55 @@ main_handler(TSCont contp, TSEvent event, void *data)
   return (*q_current_handler)(contp, event, data);
 }
 
+/* Finished TxnSM objects, reused by TxnSMCreate. Accept and
+   state_done run on different threads, so the list is locked. */
+static TxnSM *txn_sm_pool;
+static int txn_sm_pool_size;
+static pthread_mutex_t txn_sm_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static TxnSM *
+TxnSMPoolGet(void)
+{
+  TxnSM *txn_sm;
+
+  pthread_mutex_lock(&txn_sm_pool_lock);
+  txn_sm = txn_sm_pool;
+  if (txn_sm) {
+    txn_sm_pool = txn_sm->q_pool_next;
+    txn_sm_pool_size--;
+  }
+  pthread_mutex_unlock(&txn_sm_pool_lock);
+
+  if (txn_sm == NULL) {
+    txn_sm = (TxnSM *)malloc(sizeof(TxnSM));
+    if (txn_sm == NULL)
+      return NULL;
+    TxnArenaInit(&txn_sm->q_arena);
+  }
+  txn_sm->q_pool_next = NULL;
+  return txn_sm;
+}
+
+/* Give the TxnSM back to the pool. The arena must already be reset;
+   if the pool is full the object is freed for good. */
+static void
+TxnSMPoolPut(TxnSM *txn_sm)
+{
+  pthread_mutex_lock(&txn_sm_pool_lock);
+  if (txn_sm_pool_size < TXN_SM_POOL_MAX) {
+    txn_sm->q_pool_next = txn_sm_pool;
+    txn_sm_pool         = txn_sm;
+    txn_sm_pool_size++;
+    txn_sm = NULL;
+  }
+  pthread_mutex_unlock(&txn_sm_pool_lock);
+
+  if (txn_sm) {
+    TxnArenaDestroy(&txn_sm->q_arena);
+    free(txn_sm);
+  }
+}
+
 /* Create the Txn data structure and the continuation for the Txn. */
 TSCont
 TxnSMCreate(TSMutex pmutex, TSVConn client_vc, int server_port)
@@ -325,7 +643,9 @@ TxnSMCreate(TSMutex pmutex, TSVConn client_vc, int server_port)
   TSCont contp;
   TxnSM *txn_sm;
 
-  txn_sm = (TxnSM *)malloc(sizeof(TxnSM));
+  txn_sm = TxnSMPoolGet();
+  if (txn_sm == NULL)
+    return NULL;
 
   txn_sm->q_mutex          = pmutex;
   txn_sm->q_pending_action = NULL;
@@ -340,7 +660,6 @@ TxnSMCreate(TSMutex pmutex, TSVConn client_vc, int server_port)
   txn_sm->q_client_read_vio               = NULL;
   txn_sm->q_client_write_vio              = NULL;
   txn_sm->q_client_request_buffer         = NULL;
-  txn_sm->q_client_response_buffer        = NULL;
   txn_sm->q_client_request_buffer_reader  = NULL;
   txn_sm->q_client_response_buffer_reader = NULL;
 
@@ -349,25 +668,54 @@ TxnSMCreate(TSMutex pmutex, TSVConn client_vc, int server_port)
   txn_sm->q_server_request_buffer        = NULL;
   txn_sm->q_server_response_buffer       = NULL;
   txn_sm->q_server_request_buffer_reader = NULL;
+  txn_sm->q_server_response_class        = TXN_BUFFER_LARGE;
 
   /* Char buffers to store client request and server response. */
-  txn_sm->q_client_request = (char *)malloc(sizeof(char) * (MAX_REQUEST_LENGTH + 1));
-  memset(txn_sm->q_client_request, '\0', (sizeof(char) * (MAX_REQUEST_LENGTH + 1)));
+  txn_sm->q_client_request = (char *)TxnArenaCalloc(&txn_sm->q_arena, sizeof(char) * (MAX_REQUEST_LENGTH + 1));
   txn_sm->q_server_response          = NULL;
   txn_sm->q_server_response_length   = 0;
-  txn_sm->q_block_bytes_read         = 0;
   txn_sm->q_cache_vc                 = NULL;
-  txn_sm->q_cache_response_length    = 0;
+  txn_sm->q_page_reader              = NULL;
+  txn_sm->q_page                     = NULL;
+  txn_sm->q_page_length              = 0;
+  txn_sm->q_page_size                = 0;
+  txn_sm->q_page_checked             = 0;
   txn_sm->q_cache_read_buffer        = NULL;
   txn_sm->q_cache_read_buffer_reader = NULL;
 
-  txn_sm->q_server_name = (char *)malloc(sizeof(char) * (MAX_SERVER_NAME_LENGTH + 1));
-  txn_sm->q_file_name   = (char *)malloc(sizeof(char) * (MAX_FILE_NAME_LENGTH + 1));
+  txn_sm->q_cache_read_vio           = NULL;
+  txn_sm->q_cache_write_vio          = NULL;
+  txn_sm->q_cache_response_buffer_reader = NULL;
+
+  txn_sm->q_server_name = (char *)TxnArenaCalloc(&txn_sm->q_arena, sizeof(char) * (MAX_SERVER_NAME_LENGTH + 1));
+  txn_sm->q_file_name   = (char *)TxnArenaCalloc(&txn_sm->q_arena, sizeof(char) * (MAX_FILE_NAME_LENGTH + 1));
+
+  if (!txn_sm->q_client_request || !txn_sm->q_server_name || !txn_sm->q_file_name) {
+    TxnArenaReset(&txn_sm->q_arena);
+    TxnSMPoolPut(txn_sm);
+    return NULL;
+  }
 
   txn_sm->q_key   = NULL;
+  txn_sm->q_lookup_name = NULL;
+  txn_sm->q_hot_reader  = NULL;
+  txn_sm->q_head_reader = NULL;
+  txn_sm->q_page_hit    = 0;
   txn_sm->q_magic = TXN_SM_ALIVE;
   txn_sm->count=0;
   txn_sm->number=0;
+  txn_sm->capacity=0;
+  txn_sm->filename           = NULL;
+  txn_sm->server_response    = NULL;
+  txn_sm->response_byte_read = NULL;
+  txn_sm->q_range_buffer        = NULL;
+  txn_sm->q_range_buffer_reader = NULL;
+  RangeInit(&txn_sm->q_range);
+  txn_sm->q_encoding = TXN_ENCODING_IDENTITY;
+  txn_sm->q_admitted = 0;
+  txn_sm->q_rejected = 0;
+  txn_sm->q_work     = NULL;
+  txn_sm->q_fetch    = NULL;
   /* Set the current handler to be state_start. */
   set_handler(txn_sm->q_current_handler, &state_start);
 
@@ -376,6 +724,69 @@ TxnSMCreate(TSMutex pmutex, TSVConn client_vc, int server_port)
   return contp;
 }
 
+/* Run the transaction of client_vc, or only answer it 503 if verdict
+   is OVERLOAD_ANSWER. */
+void
+TxnSMStart(TSVConn client_vc, int server_port, OverloadVerdict verdict)
+{
+  TSCont contp;
+  TSMutex pmutex;
+  TxnSM *txn_sm;
+
+  /* Create a new mutex for the TxnSM, which is going
+     to handle the incoming request. */
+  pmutex = (TSMutex)TSMutexCreate();
+  contp  = (TSCont)TxnSMCreate(pmutex, client_vc, server_port);
+  if (contp == NULL) {
+    TSError("[protocol] Failed to create TxnSM, closing client");
+    TSVConnClose(client_vc);
+    if (verdict == OVERLOAD_START)
+      start_waiting_transaction(server_port);
+    else
+      OverloadAnswered();
+    return;
+  }
+  txn_sm             = (TxnSM *)TSContDataGet(contp);
+  txn_sm->q_admitted = verdict == OVERLOAD_START;
+  txn_sm->q_rejected = verdict == OVERLOAD_ANSWER;
+
+  /* This is no reason for not grabbing the lock.
+     So skip the routine which handle LockTry failure case. */
+  TSMutexLockTry(pmutex); // TODO: why should it not check if we got the lock??
+  TSContCall(contp, 0, NULL);
+  TSMutexUnlock(pmutex);
+}
+
+/* A transaction slot is free: it goes to the connection waiting first.
+   The ones that waited too long are answered 503 on the way. */
+static void
+start_waiting_transaction(int server_port)
+{
+  OverloadVerdict verdict;
+  TSVConn vc;
+
+  while ((vc = OverloadNext(&verdict)) != NULL) {
+    if (verdict == OVERLOAD_CLOSE) {
+      TSVConnClose(vc);
+      continue;
+    }
+    TxnSMStart(vc, server_port, verdict);
+    if (verdict == OVERLOAD_START)
+      return;
+  }
+}
+
+/* The client is closed: its slot goes to the next connection waiting,
+   the prefetches and writes left run on fetch slots only. */
+static void
+release_transaction_slot(TxnSM *txn_sm)
+{
+  if (!txn_sm->q_admitted)
+    return;
+  txn_sm->q_admitted = 0;
+  start_waiting_transaction(txn_sm->q_server_port);
+}
+
 /* This function starts to read incoming client request data from client_vc */
 int
 state_start(TSCont contp, TSEvent event ATS_UNUSED, void *data ATS_UNUSED)
@@ -386,8 +797,7 @@ state_start(TSCont contp, TSEvent event ATS_UNUSED, void *data ATS_UNUSED)
     return prepare_to_die(contp);
   }
 
-  txn_sm->q_client_request_buffer        = TSIOBufferCreate();
-  txn_sm->q_client_request_buffer_reader = TSIOBufferReaderAlloc(txn_sm->q_client_request_buffer);
+  txn_sm->q_client_request_buffer = IOBufferPoolGet(TXN_BUFFER_REQUEST, &txn_sm->q_client_request_buffer_reader);
 
   if (!txn_sm->q_client_request_buffer || !txn_sm->q_client_request_buffer_reader) {
     return prepare_to_die(contp);
@@ -435,6 +845,7 @@ state_read_request_from_client(TSCont contp, TSEvent event, TSVIO vio ATS_UNUSED
 	int bytes_read ;
 	char *temp_buf;
 	char **parsed_http_request;
+	const char *lookup_name;
 	
   TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);	//從contp讀取transaction state machine的狀態
 
@@ -448,15 +859,17 @@ state_read_request_from_client(TSCont contp, TSEvent event, TSVIO vio ATS_UNUSED
 
 	if (ret_val != TS_SUCCESS)
 	  TSError("[protocol] Fail to write into log");
+    if (bytes_read > 0 && txn_sm->q_rejected)	//太忙了,收到request就回503
+		return send_overloaded(contp);
     if (bytes_read > 0) {	//bytes_read大於0,表示buffer有效,有資料存在
 		FILE *fPtr;
 		char *buffer ;
-		buffer=(char*)malloc(sizeof(char)*1024);
+		buffer=(char*)TxnArenaCalloc(&txn_sm->q_arena,sizeof(char)*1024);
 	
-		fPtr = fopen("/srv/datavol/cdn/host.conf", "r");
+		fPtr = fopen(HOST_CONF_PATH, "r");
 		if (fPtr) {
 			TSDebug("HTTP_plugin", "open servername file successfully");
-			fread(buffer, 1, 1024, fPtr);
+			fread(buffer, 1, 1023, fPtr);
 			
 			fclose(fPtr);
 		}
@@ -464,51 +877,76 @@ state_read_request_from_client(TSCont contp, TSEvent event, TSVIO vio ATS_UNUSED
 			TSDebug("HTTP_plugin", "open file failed");
 		}
 		strncpy(txn_sm->q_server_name,buffer,strcspn(buffer,"\n"));
-		free(buffer);
-		txn_sm->q_server_name="www.cwb.gov.tw";
+		snprintf(txn_sm->q_server_name,MAX_SERVER_NAME_LENGTH + 1,"%s","www.cwb.gov.tw");
 		TSDebug("HTTP_plugin","server name is= %s",txn_sm->q_server_name);
 		
 		//↓取得client request buffer的資料，並存成可讀取的char格式。
-		temp_buf = (char *)get_info_from_buffer(txn_sm->q_client_request_buffer_reader); 
+		temp_buf = (char *)get_info_from_buffer(&txn_sm->q_arena, txn_sm->q_client_request_buffer_reader); 
+		if (temp_buf == NULL)
+			return prepare_to_die(contp);
       	
-		parsed_http_request = get_http_request_info(temp_buf);
+		parsed_http_request = get_http_request_info(&txn_sm->q_arena, temp_buf);
+		if (parsed_http_request == NULL)
+			return prepare_to_die(contp);
 		//txn_sm->q_file_name = parsed_http_request[1];
-		memcpy(txn_sm->q_file_name,parsed_http_request[1],100);
+		snprintf(txn_sm->q_file_name,MAX_FILE_NAME_LENGTH + 1,"%s",parsed_http_request[1]);
 		parsed_http_request= NULL;
+		//cache key用正規化後的路徑,和網頁裡解析出的網址對得上
+		UrlNormalizePath(txn_sm->q_server_name, txn_sm->q_file_name, MAX_FILE_NAME_LENGTH + 1);
+		//從哪一頁點過來的:記下網頁之間的轉移,用來預測下一頁
+		record_navigation(txn_sm, temp_buf);
+		//Range請求:記下要的範圍,整個物件仍以同一個cache key存取
+		RangeSetRequest(&txn_sm->q_range, &txn_sm->q_arena, temp_buf);
+		//依Accept-Encoding先找壓縮過的版本,只有已經存了壓縮版本的才找
+		txn_sm->q_encoding = EncodingSelect(temp_buf, txn_sm->q_file_name);
 		
-		int http_request_length = strcspn(temp_buf,"\r");		
-		memcpy(txn_sm->q_client_request ,temp_buf, http_request_length+2);
-		strncat(txn_sm->q_client_request,"Host: ",6);
+		int http_request_length = strcspn(temp_buf,"\r");
+		//沒有\r的request line不完整
+		if (temp_buf[http_request_length] != '\r')
+			return prepare_to_die(contp);
+		if (http_request_length + 2 + strlen(txn_sm->q_server_name) + 31 > MAX_REQUEST_LENGTH)
+			return prepare_to_die(contp);
+		memcpy(txn_sm->q_client_request ,temp_buf, http_request_length);	//只有request line,\r\n自己補
+		txn_sm->q_client_request[http_request_length] = '\0';
+		strncat(txn_sm->q_client_request,"\r\nHost: ",8);
 		
 		strncat(txn_sm->q_client_request,txn_sm->q_server_name,strlen(txn_sm->q_server_name));
 		strncat(txn_sm->q_client_request,"\r\nConnection: close\r\n\r\n",25);
 		
 		TSDebug("HTTP_plugin", "client request file name is %s", txn_sm->q_file_name);
 		TSDebug("HTTP_plugin", "client request is %s", txn_sm->q_client_request);
-		//TSfree(temp_buf);	//釋放temp_buf的記憶體空間
+		//temp_buf在state_done時隨arena一起釋放
         temp_buf= NULL;
 		//txn_sm->q_server_name = "dns.ntutee.ml"; 
 		
 		/* Start to do cache lookup */
         TSDebug("HTTP_plugin", "Key material: file name is %s*****", txn_sm->q_file_name);
 		TSDebug("HTTP_plugin", "Key material: server name is %s*****", txn_sm->q_server_name);
-        txn_sm->q_key = (TSCacheKey)CacheKeyCreate(txn_sm->q_file_name);	//利用q_file_name建立cache key
+		lookup_name = txn_sm->q_file_name;	//利用q_file_name建立cache key
+        if (txn_sm->q_encoding != TXN_ENCODING_IDENTITY) {
+			char *variant_name = EncodingVariantName(&txn_sm->q_arena, txn_sm->q_file_name, txn_sm->q_encoding);
+			if (variant_name == NULL)
+				txn_sm->q_encoding = TXN_ENCODING_IDENTITY;
+			else
+				lookup_name = variant_name;	//壓縮版本的cache key
+		}
 		
-		char *temp=malloc(10240);
-		*(temp+0)='\0';
-		strcat(temp,"http://");
-		strcat(temp,txn_sm->q_server_name);
-		strcat(temp,txn_sm->q_file_name);
-		ret_val = TSTextLogObjectWrite(protocol_plugin_log, "Request URL is %s",temp);
-		free(temp);
+		ret_val = TSTextLogObjectWrite(protocol_plugin_log, "Request URL is http://%s%s",txn_sm->q_server_name,txn_sm->q_file_name);
 		if (ret_val != TS_SUCCESS)
 			TSError("[protocol] Fail to write into log");
 		
 		//↓將txn_sm->q_current_handler改為state_handle_cache_lookup的程式,準備執行state_handle_cache_lookup
-        set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_lookup);	
-        txn_sm->q_pending_action = TSCacheRead(contp, txn_sm->q_key);
+		//小檔案先找RAM裡的熱門物件,找到就不用讀cache
+		if (serve_hot_object(contp, lookup_name))
+			return TS_SUCCESS;
 
-        return TS_SUCCESS;
+		//多半會miss的話,找cache的同時先連好origin,miss時就不用再等連線
+		if (speculative_connect_enabled && CacheFilterMayContain(lookup_name) && CacheMissLikely(txn_sm->q_file_name) &&
+		    OverloadStageGet() < OVERLOAD_NO_PREFETCH)
+			OriginWarm(txn_sm->q_server_name, txn_sm->q_server_port);
+
+        set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_lookup);	
+        return cache_read(contp, lookup_name);
     }
 
     /* The request is not fully read, reenable the read_vio. */
@@ -521,6 +959,171 @@ state_read_request_from_client(TSCont contp, TSEvent event, TSVIO vio ATS_UNUSED
   return TS_SUCCESS;
 }
 
+/* Look up name in the cache. When the cache filter knows it isn't
+   there, the current handler gets the miss at once, without a round
+   trip to the cache. */
+static int
+cache_read(TSCont contp, const char *name)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  if (txn_sm->q_key)
+    TSCacheKeyDestroy(txn_sm->q_key);
+  txn_sm->q_key = (TSCacheKey)CacheKeyCreate((char *)name);
+
+  if (!CacheFilterMayContain(name)) {
+    TSDebug("HTTP_plugin", "%s isn't in the cache filter", name);
+    txn_sm->q_lookup_name = NULL;
+    return (*txn_sm->q_current_handler)(contp, TS_EVENT_CACHE_OPEN_READ_FAILED, NULL);
+  }
+
+  txn_sm->q_lookup_name    = name;
+  txn_sm->q_pending_action = TSCacheRead(contp, txn_sm->q_key);
+  return TS_SUCCESS;
+}
+
+/* Teach the cache filter what the lookup found: hits made during the
+   warm up, evictions it wasn't told about. */
+static void
+cache_lookup_done(TxnSM *txn_sm, TSEvent event)
+{
+  if (txn_sm->q_lookup_name == NULL)
+    return;
+  if (event == TS_EVENT_CACHE_OPEN_READ)
+    CacheFilterAdd(txn_sm->q_lookup_name);
+  else if (event == TS_EVENT_CACHE_OPEN_READ_FAILED)
+    CacheFilterRemove(txn_sm->q_lookup_name);
+  txn_sm->q_lookup_name = NULL;
+}
+
+/* A browser navigating from a page of this site to another asks for
+   text/html with the first page as Referer. Its host is the one the
+   client talks to, given in the Host header, not the origin server. */
+static void
+record_navigation(TxnSM *txn_sm, const char *request)
+{
+  const char *accept, *referer, *host, *path;
+  int accept_length, referer_length, host_length, i;
+  char from[NEXT_PAGE_MAX_LENGTH];
+
+  accept = find_request_header(request, "Accept", &accept_length);
+  if (accept == NULL)
+    return;
+  for (i = 0; i + 9 <= accept_length && strncasecmp(accept + i, "text/html", 9) != 0; i++)
+    ;
+  if (i + 9 > accept_length)
+    return;
+
+  referer = find_request_header(request, "Referer", &referer_length);
+  host    = find_request_header(request, "Host", &host_length);
+  if (!referer || !host)
+    return;
+  for (i = 0; i + 3 <= referer_length && strncmp(referer + i, "://", 3) != 0; i++)
+    ;
+  if (i + 3 > referer_length)
+    return;
+  path = referer + i + 3;
+  if (referer + referer_length - path < host_length || strncasecmp(path, host, host_length) != 0)
+    return;
+  path += host_length;
+  if (path < referer + referer_length && *path != '/')
+    return;
+
+  if (UrlResolve(NULL, "/", path, referer + referer_length - path, from, sizeof(from)) < 0)
+    return;
+  NextPageRecord(from, txn_sm->q_file_name);
+}
+
+/* The buffer of a hit goes back to the pool with its reader, when
+   the transaction ends or the doc has to come from the origin server
+   after all. */
+static void
+release_cache_read_buffer(TxnSM *txn_sm)
+{
+  if (txn_sm->q_hot_reader) {
+    TSIOBufferReaderFree(txn_sm->q_hot_reader);
+    txn_sm->q_hot_reader = NULL;
+  }
+  if (txn_sm->q_head_reader) {
+    TSIOBufferReaderFree(txn_sm->q_head_reader);
+    txn_sm->q_head_reader = NULL;
+  }
+  IOBufferPoolPut(TXN_BUFFER_LARGE, txn_sm->q_cache_read_buffer, txn_sm->q_cache_read_buffer_reader);
+  txn_sm->q_cache_read_buffer        = NULL;
+  txn_sm->q_cache_read_buffer_reader = NULL;
+}
+
+/* Tell from the header of a hit whether it is a page, as soon as the
+   header is in. reader is consumed by nothing else meanwhile. */
+static void
+check_page_hit(TxnSM *txn_sm, TSIOBufferReader reader)
+{
+  char header[MAX_RANGE_HEADER_LENGTH + 1];
+  const char *type;
+  int header_length, type_length;
+
+  header_length = range_peek_header(reader, header);
+  if (header_length == 0)
+    return;
+  if (header_length > 0) {
+    type               = find_request_header(header, "Content-Type", &type_length);
+    txn_sm->q_page_hit = type && type_length >= 9 && strncasecmp(type, "text/html", 9) == 0;
+  }
+  if (txn_sm->q_head_reader) {
+    TSIOBufferReaderFree(txn_sm->q_head_reader);
+    txn_sm->q_head_reader = NULL;
+  }
+}
+
+/* Serve a small object kept in RAM straight into the client write
+   buffer. Returns 0 if it has to be read from the cache. */
+static int
+serve_hot_object(TSCont contp, const char *name)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  int64_t length;
+
+  if (txn_sm->q_range.status != RANGE_NONE)
+    return 0;
+
+  if (!txn_sm->q_cache_read_buffer)
+    txn_sm->q_cache_read_buffer = IOBufferPoolGet(TXN_BUFFER_LARGE, &txn_sm->q_cache_read_buffer_reader);
+  if (!txn_sm->q_cache_read_buffer)
+    return 0;
+  length = HotCacheWrite(name, txn_sm->q_cache_read_buffer);
+  if (length < 0) {
+    release_cache_read_buffer(txn_sm);
+    return 0;
+  }
+
+  check_page_hit(txn_sm, txn_sm->q_cache_read_buffer_reader);
+  TSDebug("HTTP_plugin", "%s served from RAM", name);
+  PrefetchStatsUsed(txn_sm->q_file_name);
+  if (TSTextLogObjectWrite(protocol_plugin_log, "RAM hit!!!") != TS_SUCCESS)
+    TSError("[protocol] Fail to write into log");
+
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_stream_cache_to_client);
+  send_response_to_client(contp, txn_sm->q_cache_read_buffer_reader, length);
+  return 1;
+}
+
+/* The client got the whole doc read from the cache, copy it to RAM. */
+static void
+keep_hot_object(TxnSM *txn_sm)
+{
+  char *data;
+
+  if (!txn_sm->q_hot_reader)
+    return;
+  if (TSIOBufferReaderAvail(txn_sm->q_hot_reader) == txn_sm->q_hot_length) {
+    data = get_info_from_buffer(&txn_sm->q_arena, txn_sm->q_hot_reader);
+    if (data)
+      HotCacheInsert(txn_sm->q_hot_name, data, txn_sm->q_hot_length);
+  }
+  TSIOBufferReaderFree(txn_sm->q_hot_reader);
+  txn_sm->q_hot_reader = NULL;
+}
+
 /* This function handle the cache lookup result. If MISS, try to
    open cache write_vc for writing. Otherwise, use the vc returned
    by the cache to read the data from the cache. */
@@ -533,6 +1136,10 @@ state_handle_cache_lookup(TSCont contp, TSEvent event, TSVConn vc)
 
   TSDebug("HTTP_plugin", "enter state_handle_cache_lookup");
 
+  txn_sm->q_hot_name = txn_sm->q_lookup_name;
+  if (txn_sm->q_lookup_name)
+    CacheMissRecord(txn_sm->q_lookup_name, event != TS_EVENT_CACHE_OPEN_READ);
+  cache_lookup_done(txn_sm, event);
   switch (event) {
   case TS_EVENT_CACHE_OPEN_READ:	//When cache hit
     TSDebug("HTTP_plugin", "cache hit!!!");
@@ -545,28 +1152,57 @@ state_handle_cache_lookup(TSCont contp, TSEvent event, TSVConn vc)
 
     txn_sm->q_cache_vc       = vc;
     txn_sm->q_pending_action = NULL;
+    PrefetchStatsUsed(txn_sm->q_file_name);
 
     /* Get the size of the cached doc. */
     response_size = TSVConnCacheObjectSizeGet(txn_sm->q_cache_vc);
 
-    /* Allocate IOBuffer to store data from the cache. */
-    txn_sm->q_client_response_buffer        = TSIOBufferCreate();
-    txn_sm->q_client_response_buffer_reader = TSIOBufferReaderAlloc(txn_sm->q_client_response_buffer);
-    txn_sm->q_cache_read_buffer             = TSIOBufferCreate();
-    txn_sm->q_cache_read_buffer_reader      = TSIOBufferReaderAlloc(txn_sm->q_cache_read_buffer);
+    /* Allocate IOBuffer to store data from the cache. The client
+       write reads the same buffer. */
+    if (!txn_sm->q_cache_read_buffer)
+      txn_sm->q_cache_read_buffer = IOBufferPoolGet(TXN_BUFFER_LARGE, &txn_sm->q_cache_read_buffer_reader);
 
-    if (!txn_sm->q_client_response_buffer || !txn_sm->q_client_response_buffer_reader || !txn_sm->q_cache_read_buffer ||
-        !txn_sm->q_cache_read_buffer_reader) {
+    if (!txn_sm->q_cache_read_buffer || !txn_sm->q_cache_read_buffer_reader) {
       return prepare_to_die(contp);
     }
 
-    /* Read doc from the cache. */
-    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_read_response);
+    /* Range request: the client write starts once the parts are known. */
+    if (txn_sm->q_range.status != RANGE_NONE) {
+      if (!txn_sm->q_range_buffer)
+        txn_sm->q_range_buffer = IOBufferPoolGet(TXN_BUFFER_LARGE, &txn_sm->q_range_buffer_reader);
+      if (!txn_sm->q_range_buffer)
+        return prepare_to_die(contp);
+
+      txn_sm->q_range.object_size = response_size;
+      set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_serve_range_from_cache);
+      txn_sm->q_cache_read_vio = TSVConnRead(txn_sm->q_cache_vc, contp, txn_sm->q_cache_read_buffer, response_size);
+      return TS_SUCCESS;
+    }
+
+    txn_sm->q_head_reader = TSIOBufferReaderClone(txn_sm->q_cache_read_buffer_reader);
+
+    /* A small doc is kept in RAM once sent, to skip the cache next time. */
+    if (txn_sm->q_hot_name && response_size <= HOT_CACHE_MAX_OBJECT_SIZE) {
+      txn_sm->q_hot_reader = TSIOBufferReaderClone(txn_sm->q_cache_read_buffer_reader);
+      txn_sm->q_hot_length = response_size;
+    }
+
+    /* Read doc from the cache and send it to the client as it comes. */
+    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_stream_cache_to_client);
     txn_sm->q_cache_read_vio = TSVConnRead(txn_sm->q_cache_vc, contp, txn_sm->q_cache_read_buffer, response_size);
+    return send_response_to_client(contp, txn_sm->q_cache_read_buffer_reader, response_size);
 
     break;
 
   case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    /* No compressed variant, look for the doc itself. */
+    if (txn_sm->q_encoding != TXN_ENCODING_IDENTITY) {
+      TSDebug("HTTP_plugin", "no compressed variant of %s", txn_sm->q_file_name);
+      EncodingForget(txn_sm->q_file_name);
+      txn_sm->q_encoding = TXN_ENCODING_IDENTITY;
+      return cache_read(contp, txn_sm->q_file_name);
+    }
+
     /* Cache miss or error, open cache write_vc. */
     TSDebug("HTTP_plugin", "cache miss or error!!!");
     /* Write log */
@@ -575,6 +1211,14 @@ state_handle_cache_lookup(TSCont contp, TSEvent event, TSVConn vc)
     if (ret_val != TS_SUCCESS)
       TSError("[protocol] Fail to write into log");
 
+    /* Too busy to go to the origin server, only hits are served. */
+    if (OverloadStageGet() >= OVERLOAD_HITS_ONLY)
+      return send_overloaded(contp);
+
+    /* Tell the client what the page needs while it is being fetched. */
+    if (early_hints_enabled)
+      return start_early_hints(contp);
+
     set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_prepare_for_write);
     txn_sm->q_pending_action = TSCacheWrite(contp, txn_sm->q_key);
     break;
@@ -587,64 +1231,48 @@ state_handle_cache_lookup(TSCont contp, TSEvent event, TSVConn vc)
   return TS_SUCCESS;
 }
 
-static void
-load_buffer_cache_data(TxnSM *txn_sm)
-{
-  /* transfer the data from the cache buffer (which must
-     fully be consumed on a VCONN_READY event, to the
-     server response buffer */
-  int rdr_avail = TSIOBufferReaderAvail(txn_sm->q_cache_read_buffer_reader);
-
-  TSDebug("HTTP_plugin", "entering buffer_cache_data");
-  TSDebug("HTTP_plugin", "loading %d bytes to buffer reader", rdr_avail);
-
-  TSAssert(rdr_avail > 0);
-
-  TSIOBufferCopy(txn_sm->q_client_response_buffer,   /* (cache response buffer) */
-                 txn_sm->q_cache_read_buffer_reader, /* (transient buffer)      */
-                 rdr_avail, 0);
-
-  TSIOBufferReaderConsume(txn_sm->q_cache_read_buffer_reader, rdr_avail);
-}
-
-/* If the document is fully read out of the cache, close the
-   cache read_vc, send the document to the client. Otherwise,
-   reenable the read_vio to read more data out. If some error
-   occurs, close the read_vc, open write_vc for writing the doc
-   into the cache.*/
+/* The cache read VIO and the client write VIO share one buffer: the
+   cache fills it, the client write drains it. Whichever side makes
+   progress reenables the other, so blocks are sent to the client as
+   soon as they come out of the cache, with no copy. The buffer water
+   mark bounds how far the cache read can run ahead. If the cache read
+   fails before anything was sent, fetch the doc from the origin
+   server instead. */
 int
-state_handle_cache_read_response(TSCont contp, TSEvent event, TSVIO vio ATS_UNUSED)
+state_stream_cache_to_client(TSCont contp, TSEvent event, TSVIO vio)
 {
-	int ret_val;
+  int ret_val;
   TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
 
-  TSDebug("HTTP_plugin", "enter state_handle_cache_read_response");
+  TSDebug("HTTP_plugin", "enter state_stream_cache_to_client");
 
   txn_sm->q_pending_action = NULL;
 
+  /* Nothing to do with the client request any more. */
+  if (vio == txn_sm->q_client_read_vio)
+    return TS_SUCCESS;
+
+  if (vio == txn_sm->q_client_write_vio)
+    return state_send_response_to_client(contp, event, vio);
+
+  if (txn_sm->q_head_reader && (event == TS_EVENT_VCONN_READ_READY || event == TS_EVENT_VCONN_READ_COMPLETE))
+    check_page_hit(txn_sm, txn_sm->q_head_reader);
+
   switch (event) {
   case TS_EVENT_VCONN_READ_COMPLETE:
-  
-	
-	ret_val = TSTextLogObjectWrite(protocol_plugin_log, "Read file from cache");
+    ret_val = TSTextLogObjectWrite(protocol_plugin_log, "Read file from cache");
     if (ret_val != TS_SUCCESS)
       TSError("[protocol] Fail to write into log");
-  
-    load_buffer_cache_data(txn_sm);
+
     TSVConnClose(txn_sm->q_cache_vc);
     txn_sm->q_cache_vc        = NULL;
     txn_sm->q_cache_read_vio  = NULL;
     txn_sm->q_cache_write_vio = NULL;
-    TSIOBufferReaderFree(txn_sm->q_cache_read_buffer_reader);
-    TSIOBufferDestroy(txn_sm->q_cache_read_buffer);
-    txn_sm->q_cache_read_buffer_reader = NULL;
-    txn_sm->q_cache_read_buffer        = NULL;
-    return send_response_to_client(contp);
+    TSVIOReenable(txn_sm->q_client_write_vio);
+    break;
 
   case TS_EVENT_VCONN_READ_READY:
-    load_buffer_cache_data(txn_sm);
-
-    TSVIOReenable(txn_sm->q_cache_read_vio);
+    TSVIOReenable(txn_sm->q_client_write_vio);
     break;
 
   default:
@@ -656,6 +1284,17 @@ state_handle_cache_read_response(TSCont contp, TSEvent event, TSVIO vio ATS_UNUS
       txn_sm->q_cache_write_vio = NULL;
     }
 
+    /* The client already got part of the doc, nothing can be saved. */
+    if (TSVIONDoneGet(txn_sm->q_client_write_vio) > 0)
+      return prepare_to_die(contp);
+
+    /* Stop the client write: with nothing left to do it is left idle,
+       until the write of the response from the origin server takes
+       its place. Its reader isn't looked at anymore. */
+    TSVIONBytesSet(txn_sm->q_client_write_vio, 0);
+    txn_sm->q_client_write_vio = NULL;
+    release_cache_read_buffer(txn_sm);
+
     /* Open the write_vc, after getting doc from the origin server,
        write the doc into the cache. */
     set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_prepare_for_write);
@@ -666,33 +1305,132 @@ state_handle_cache_read_response(TSCont contp, TSEvent event, TSVIO vio ATS_UNUS
   return TS_SUCCESS;
 }
 
-/* The cache processor call us back with the vc to use for writing
-   data into the cache.
-   In case of error, abort txn. */
+/* The parts of a range request are being cut out of src. */
+static int
+range_active(TxnSM *txn_sm)
+{
+  return txn_sm->q_range.status == RANGE_HEADER || txn_sm->q_range.status == RANGE_BODY ||
+         txn_sm->q_range.status == RANGE_DONE;
+}
+
+/* Move what src has to the range buffer, as long as the client keeps
+   up with it, and start the client write once the response header is
+   built. */
+static void
+serve_range(TSCont contp, TSIOBufferReader src)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  int64_t water_mark;
+
+  TSIOBufferWaterMarkGet(txn_sm->q_range_buffer, &water_mark);
+  if (TSIOBufferReaderAvail(txn_sm->q_range_buffer_reader) >= water_mark)
+    return;
+
+  RangeTransform(&txn_sm->q_range, &txn_sm->q_arena, src, txn_sm->q_range_buffer);
+  if (txn_sm->q_range.status != RANGE_BODY && txn_sm->q_range.status != RANGE_DONE)
+    return;
+
+  if (!txn_sm->q_client_write_vio)
+    send_response_to_client(contp, txn_sm->q_range_buffer_reader, txn_sm->q_range.response_length);
+  else
+    TSVIOReenable(txn_sm->q_client_write_vio);
+}
+
+/* Range request on a hit. The cache vc can only be read from the
+   start, so the bytes before a part are read and dropped, and the
+   cache read stops as soon as the last part has been cut. If the doc
+   can't be served as ranges, it is sent as a whole. */
 int
-state_handle_cache_prepare_for_write(TSCont contp, TSEvent event, TSVConn vc)
+state_serve_range_from_cache(TSCont contp, TSEvent event, TSVIO vio)
 {
   TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
 
-  TSDebug("HTTP_plugin", "enter state_handle_cache_prepare_for_write");
+  TSDebug("HTTP_plugin", "enter state_serve_range_from_cache");
 
   txn_sm->q_pending_action = NULL;
 
+  if (vio == txn_sm->q_client_read_vio)
+    return TS_SUCCESS;
+
+  if (vio == txn_sm->q_client_write_vio) {
+    if (event == TS_EVENT_VCONN_WRITE_READY)
+      serve_range(contp, txn_sm->q_cache_read_buffer_reader);
+    return state_send_response_to_client(contp, event, vio);
+  }
+
   switch (event) {
-  case TS_EVENT_CACHE_OPEN_WRITE:
-    txn_sm->q_cache_vc = vc;
+  case TS_EVENT_VCONN_READ_READY:
+  case TS_EVENT_VCONN_READ_COMPLETE:
+    serve_range(contp, txn_sm->q_cache_read_buffer_reader);
+
+    if (txn_sm->q_range.status == RANGE_PASS) {
+      TSDebug("HTTP_plugin", "doc can't be served as ranges, send all of it");
+      set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_stream_cache_to_client);
+      send_response_to_client(contp, txn_sm->q_cache_read_buffer_reader, txn_sm->q_range.object_size);
+      if (event == TS_EVENT_VCONN_READ_COMPLETE)
+        return state_stream_cache_to_client(contp, event, vio);
+      return TS_SUCCESS;
+    }
+
+    /* Nothing more is needed from the cache. */
+    if (event == TS_EVENT_VCONN_READ_COMPLETE || txn_sm->q_range.status == RANGE_DONE) {
+      if (txn_sm->q_cache_vc) {
+        TSVConnClose(txn_sm->q_cache_vc);
+        txn_sm->q_cache_vc       = NULL;
+        txn_sm->q_cache_read_vio = NULL;
+      }
+    }
     break;
+
   default:
-    TSDebug("HTTP_plugin", "Can't open cache write_vc, aborting txn");
-    txn_sm->q_cache_vc = NULL;
-    return prepare_to_die(contp);
+    /* Error */
+    if (txn_sm->q_cache_vc) {
+      TSVConnClose(txn_sm->q_cache_vc);
+      txn_sm->q_cache_vc       = NULL;
+      txn_sm->q_cache_read_vio = NULL;
+    }
+    if (txn_sm->q_client_write_vio)
+      return prepare_to_die(contp);
+
+    /* Nothing was sent yet, get the doc from the origin server. */
+    release_cache_read_buffer(txn_sm);
+    txn_sm->q_range.object_size = -1;
+    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_prepare_for_write);
+    TSAssert(txn_sm->q_pending_action == NULL);
+    txn_sm->q_pending_action = TSCacheWrite(contp, txn_sm->q_key);
     break;
   }
-  return state_build_and_send_request(contp, 0, NULL);
+  return TS_SUCCESS;
+}
+
+/* The cache processor call us back with the vc to use for writing
+   data into the cache.
+   In case of error, the doc is still fetched and sent to the client,
+   it just isn't cached. */
+int
+state_handle_cache_prepare_for_write(TSCont contp, TSEvent event, TSVConn vc)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  TSDebug("HTTP_plugin", "enter state_handle_cache_prepare_for_write");
+
+  txn_sm->q_pending_action = NULL;
+
+  switch (event) {
+  case TS_EVENT_CACHE_OPEN_WRITE:
+    txn_sm->q_cache_vc = vc;
+    break;
+  default:
+    TSDebug("HTTP_plugin", "Can't open cache write_vc, the response won't be cached");
+    txn_sm->q_cache_vc = NULL;
+    break;
+  }
+  return state_build_and_send_request(contp, 0, NULL);
 }
 
 /* Cache miss or error case. Start the process to send the request
-   the origin server. */
+   the origin server. The response buffer has one reader for each
+   consumer: the cache write, the client write, and the page parser. */
 int
 state_build_and_send_request(TSCont contp, TSEvent event ATS_UNUSED, void *data ATS_UNUSED)
 {
@@ -702,228 +1440,1308 @@ state_build_and_send_request(TSCont contp, TSEvent event ATS_UNUSED, void *data
 
   txn_sm->q_pending_action = NULL;
 
-  txn_sm->q_server_request_buffer        = TSIOBufferCreate();
-  txn_sm->q_server_request_buffer_reader = TSIOBufferReaderAlloc(txn_sm->q_server_request_buffer);
-
-  txn_sm->q_server_response_buffer       = TSIOBufferCreate();
-  txn_sm->q_cache_response_buffer_reader = TSIOBufferReaderAlloc(txn_sm->q_server_response_buffer);
-
-  if (!txn_sm->q_server_request_buffer || !txn_sm->q_server_request_buffer_reader || !txn_sm->q_server_response_buffer ||
-      !txn_sm->q_cache_response_buffer_reader) {
-    return prepare_to_die(contp);
+  txn_sm->q_server_response_class  = TXN_BUFFER_LARGE;
+  txn_sm->q_server_response_buffer = IOBufferPoolGet(txn_sm->q_server_response_class, &txn_sm->q_cache_response_buffer_reader);
+  if (!txn_sm->q_server_response_buffer) {
+    return prepare_to_die(contp);
+  }
+
+  txn_sm->q_client_response_buffer_reader = TSIOBufferReaderClone(txn_sm->q_cache_response_buffer_reader);
+  txn_sm->q_page_reader                   = TSIOBufferReaderClone(txn_sm->q_cache_response_buffer_reader);
+  if (!txn_sm->q_client_response_buffer_reader || !txn_sm->q_page_reader) {
+    return prepare_to_die(contp);
+  }
+
+  TSDebug("HTTP_plugin","server name is %s",txn_sm->q_server_name);
+  return begin_transmission_with_server(contp, 0, NULL);
+}
+
+/* The origin server is read by a fetch thread which hands the response
+   over through a vc, so the response is streamed to the cache and to
+   the client block by block whatever its size. Both writes start
+   right away with an unknown size, which is set when the server vc
+   reports EOS. */
+int 
+begin_transmission_with_server(TSCont contp, TSEvent event ATS_UNUSED, void *data ATS_UNUSED)
+{//以下為用HTTP請求和server要資料
+	TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+	TSDebug("HTTP_plugin","enter begin_transmission_with_server");
+
+  txn_sm->q_server_vc = OriginFetchStart(txn_sm->q_server_name, txn_sm->q_server_port, txn_sm->q_client_request, &txn_sm->q_fetch);
+  if (!txn_sm->q_server_vc) {
+    /* Every fetch slot was taken since the stage was checked. */
+    if (errno == EBUSY) {
+      if (txn_sm->q_cache_vc) {
+        TSVConnAbort(txn_sm->q_cache_vc, 1);
+        txn_sm->q_cache_vc = NULL;
+      }
+      return send_overloaded(contp);
+    }
+    TSError("[protocol] Can't start fetching %s from %s", txn_sm->q_file_name, txn_sm->q_server_name);
+    return prepare_to_die(contp);
+  }
+
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_interface_with_server);
+  txn_sm->q_server_read_vio = TSVConnRead(txn_sm->q_server_vc, contp, txn_sm->q_server_response_buffer, INT64_MAX);
+
+  if (txn_sm->q_cache_vc) {
+    txn_sm->q_cache_write_vio = TSVConnWrite(txn_sm->q_cache_vc, contp, txn_sm->q_cache_response_buffer_reader, INT64_MAX);
+  }
+
+  /* Range request: the whole doc is fetched and cached once, the
+     client gets the parts as they stream by. */
+  if (range_active(txn_sm)) {
+    if (!txn_sm->q_range_buffer)
+      txn_sm->q_range_buffer = IOBufferPoolGet(TXN_BUFFER_LARGE, &txn_sm->q_range_buffer_reader);
+    if (txn_sm->q_range_buffer)
+      return TS_SUCCESS;
+    txn_sm->q_range.status = RANGE_PASS;
+  }
+  return send_response_to_client(contp, txn_sm->q_client_response_buffer_reader, INT64_MAX);
+}
+
+/* Copy the page out of the response as it streams by, so its embedded
+   objects can be found and its compressed variants made once it is
+   complete. Only compressible text is kept, and at most
+   MAX_PAGE_PARSE_LENGTH bytes of it. */
+static void
+collect_page_data(TxnSM *txn_sm)
+{
+  TSIOBufferBlock blk;
+  const char *start;
+  char *page;
+  int64_t avail, block_avail, n;
+  int size;
+
+  if (!txn_sm->q_page_reader)
+    return;
+
+  avail = TSIOBufferReaderAvail(txn_sm->q_page_reader);
+  blk   = TSIOBufferReaderStart(txn_sm->q_page_reader);
+
+  while (blk && avail > 0 && txn_sm->q_page_length < MAX_PAGE_PARSE_LENGTH) {
+    start = TSIOBufferBlockReadStart(blk, txn_sm->q_page_reader, &block_avail);
+    n     = block_avail;
+    if (n > MAX_PAGE_PARSE_LENGTH - txn_sm->q_page_length)
+      n = MAX_PAGE_PARSE_LENGTH - txn_sm->q_page_length;
+
+    /* Grow the page buffer, the old one goes with the arena. */
+    if (txn_sm->q_page_length + n + 1 > txn_sm->q_page_size) {
+      size = txn_sm->q_page_size ? txn_sm->q_page_size : PAGE_PARSE_CHUNK_SIZE;
+      while (size < txn_sm->q_page_length + n + 1)
+        size *= 2;
+      page = (char *)TxnArenaAlloc(&txn_sm->q_arena, size);
+      if (page == NULL)
+        break;
+      if (txn_sm->q_page_length > 0)
+        memcpy(page, txn_sm->q_page, txn_sm->q_page_length);
+      txn_sm->q_page      = page;
+      txn_sm->q_page_size = size;
+    }
+
+    memcpy(txn_sm->q_page + txn_sm->q_page_length, start, n);
+    txn_sm->q_page_length += n;
+    txn_sm->q_page[txn_sm->q_page_length] = '\0';
+    blk = TSIOBufferBlockNext(blk);
+  }
+  TSIOBufferReaderConsume(txn_sm->q_page_reader, avail);
+
+  /* Once the header is in, decide if the response is worth parsing. */
+  if (!txn_sm->q_page_checked && txn_sm->q_page && strstr(txn_sm->q_page, "\r\n\r\n")) {
+    txn_sm->q_page_checked = 1;
+    if (!EncodingCompressible(txn_sm->q_page)) {
+      txn_sm->q_page_length = 0;
+      TSIOBufferReaderFree(txn_sm->q_page_reader);
+      txn_sm->q_page_reader = NULL;
+      return;
+    }
+  }
+
+  if (txn_sm->q_page_length >= MAX_PAGE_PARSE_LENGTH || (txn_sm->q_page_length > 0 && txn_sm->q_page == NULL)) {
+    TSIOBufferReaderFree(txn_sm->q_page_reader);
+    txn_sm->q_page_reader = NULL;
+  }
+}
+
+/* Account for what the server vc delivered since the last call, and
+   return the number of new bytes. */
+static int64_t
+take_response_data(TxnSM *txn_sm)
+{
+  int64_t total      = TSVIONDoneGet(txn_sm->q_server_read_vio);
+  int64_t bytes_read = total - txn_sm->q_server_response_length;
+
+  txn_sm->q_server_response_length = total;
+
+  /* Without a cache write nobody consumes the cache reader. */
+  if (!txn_sm->q_cache_write_vio)
+    TSIOBufferReaderConsume(txn_sm->q_cache_response_buffer_reader,
+                            TSIOBufferReaderAvail(txn_sm->q_cache_response_buffer_reader));
+
+  collect_page_data(txn_sm);
+  return bytes_read;
+}
+
+/* Back-pressure: don't read more from the server while the slowest of
+   the cache and the client still has a full water mark of data. */
+static int
+response_buffer_full(TxnSM *txn_sm)
+{
+  int64_t water_mark;
+
+  TSIOBufferWaterMarkGet(txn_sm->q_server_response_buffer, &water_mark);
+
+  if (txn_sm->q_cache_write_vio && TSIOBufferReaderAvail(txn_sm->q_cache_response_buffer_reader) >= water_mark)
+    return 1;
+  if ((txn_sm->q_client_write_vio || range_active(txn_sm)) &&
+      TSIOBufferReaderAvail(txn_sm->q_client_response_buffer_reader) >= water_mark)
+    return 1;
+  return 0;
+}
+
+/* One of the consumers made room in the response buffer. */
+static void
+reenable_server_read(TxnSM *txn_sm)
+{
+  if (txn_sm->q_server_read_vio && !response_buffer_full(txn_sm))
+    TSVIOReenable(txn_sm->q_server_read_vio);
+}
+
+/* Hand new response data to the client. For a range request the
+   parts are cut out of it first; if the response can't be cut, or the
+   server closed before the header was complete, the client gets all
+   of it. A range response cut short by the server is aborted. */
+static void
+feed_client_from_server(TSCont contp)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  if (!range_active(txn_sm)) {
+    if (txn_sm->q_client_write_vio)
+      TSVIOReenable(txn_sm->q_client_write_vio);
+    return;
+  }
+
+  serve_range(contp, txn_sm->q_client_response_buffer_reader);
+
+  if (txn_sm->q_server_read_vio == NULL && txn_sm->q_range.status == RANGE_HEADER)
+    txn_sm->q_range.status = RANGE_PASS;
+
+  if (txn_sm->q_range.status == RANGE_PASS) {
+    send_response_to_client(contp, txn_sm->q_client_response_buffer_reader,
+                            txn_sm->q_server_read_vio ? INT64_MAX : txn_sm->q_server_response_length);
+    return;
+  }
+
+  if (txn_sm->q_server_read_vio == NULL && txn_sm->q_range.status == RANGE_BODY &&
+      TSIOBufferReaderAvail(txn_sm->q_client_response_buffer_reader) == 0) {
+    TSError("[protocol] Response of %s ended before the requested range", txn_sm->q_file_name);
+    if (txn_sm->q_client_vc) {
+      TSVConnAbort(txn_sm->q_client_vc, 1);
+      txn_sm->q_client_vc = NULL;
+    }
+    txn_sm->q_client_read_vio  = NULL;
+    txn_sm->q_client_write_vio = NULL;
+  }
+}
+
+static void *
+plugin_thread(void *data)
+{
+  TSCont contp  = (TSCont)data;
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  /* Back on the mutex of the transaction to write what was fetched. */
+  if (txn_sm->q_work(txn_sm) == 0) {
+    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_background_done);
+  } else {
+    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_done);
+  }
+  TSContSchedule(contp, 0, TS_THREAD_POOL_DEFAULT);
+  return NULL;
+}
+
+/* The prefetch of a page blocks on the origin server and its variants
+   take a while to compress: work runs on a thread of the plugin, not
+   to hold up an ATS thread, then the cache writes start from
+   state_background_done. work only touches the TxnSM, no vc or cache
+   API. Only called with no vc open, no vio event can come in
+   meanwhile, and nothing is pending to be cancelled. */
+static int
+run_on_plugin_thread(TSCont contp, TxnSMWork work)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  pthread_attr_t attr;
+  pthread_t thread;
+  int error;
+
+  txn_sm->q_work = work;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  error = pthread_create(&thread, &attr, plugin_thread, contp);
+  pthread_attr_destroy(&attr);
+  if (error != 0) {
+    TSError("[protocol] Can't start the prefetch of %s: %s", txn_sm->q_file_name, strerror(error));
+    return state_done(contp, 0, NULL);
+  }
+  return TS_SUCCESS;
+}
+
+int
+state_background_done(TSCont contp, TSEvent event ATS_UNUSED, void *data ATS_UNUSED)
+{
+  TSDebug("HTTP_plugin", "enter state_background_done");
+  return start_prefetch_write(contp);
+}
+
+/* Called each time the server, cache or client vc of a miss is done.
+   When all of them are, the page is parsed and its embedded objects
+   prefetched into the cache on a thread of the plugin. */
+int
+state_handle_response_done(TSCont contp)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  if (!txn_sm->q_client_vc)
+    release_transaction_slot(txn_sm);
+  if (txn_sm->q_server_vc || txn_sm->q_cache_vc || txn_sm->q_client_vc)
+    return TS_SUCCESS;
+
+  TSDebug("HTTP_plugin", "enter state_handle_response_done");
+  return run_on_plugin_thread(contp, &parse_page);
+}
+
+/* Find the embedded objects of the page and prefetch them. 0 if the
+   cache writes are to start, -1 to end the transaction. */
+static int
+parse_page(TxnSM *txn_sm)
+{
+  char url_parsed[MAX_PARSED_URL_NUM][MAX_PARSED_URL_LENGTH];
+  int i;
+
+  TSDebug("HTTP_plugin", "enter parse_page");
+
+  //解析response,只有html才找內嵌物件
+  txn_sm->count  = 0;
+  txn_sm->number = 0;
+  //太忙時不prefetch,只寫入頁面本身的壓縮版本
+  if (txn_sm->q_page_length > 0 && OverloadStageGet() < OVERLOAD_NO_PREFETCH) {
+    char *content_type = get_http_header_field_value(txn_sm->q_page, "Content-Type");
+
+    TSDebug("HTTP_plugin","page length = %d",txn_sm->q_page_length);
+    if (content_type && strncmp(content_type, "text/html", 9) == 0)
+      parsing_request_all_URL(txn_sm->q_page,txn_sm->q_server_name,txn_sm->q_file_name,&url_parsed[0][0],txn_sm->q_page_length,MAX_PARSED_URL_LENGTH,MAX_PARSED_URL_NUM,&txn_sm->number);
+  }
+  TSDebug("HTTP_plugin","txn_sm->number = %d",txn_sm->number);
+
+  //沒有內嵌物件,只寫入頁面本身的壓縮版本
+  if (txn_sm->number == 0) {
+    add_encoded_variants(txn_sm);
+    return 0;
+  }
+
+	//宣告要存放filename資料的記憶體,並存filename
+		txn_sm->filename =(char **) TxnArenaAlloc (&txn_sm->q_arena,sizeof(char *)*txn_sm->number);
+		for(i=0;i<txn_sm->number;i++)
+		{
+			txn_sm->filename[i]=TxnArenaStrndup(&txn_sm->q_arena,url_parsed[i],strnlen(url_parsed[i],MAX_PARSED_URL_LENGTH));
+		}
+
+	return parse_url_and_send_request_use_pthread(txn_sm);
+}
+
+//用pthread抓filename[first]到filename[number-1],結果存到server_response和response_byte_read
+//路徑是.css結尾
+static int prefetch_is_stylesheet(const char *path)
+{
+	size_t length = strcspn(path, "?");
+
+	return length > 4 && strncasecmp(path + length - 4, ".css", 4) == 0;
+}
+
+//origin講HTTP/2的話objects全部是同一條連線上的stream,css的權重大先回來;
+//不講回傳-1
+static int fetch_h2(struct thread_data **objects, int count, const char *server_name)
+{
+		OriginH2Stream *streams = malloc(count * sizeof(OriginH2Stream));
+		int i, result;
+
+		//一條連線佔一個fetch名額
+		if (streams == NULL || OverloadFetchesTake(1) == 0) {
+			free(streams);
+			return -1;
+		}
+		for (i = 0; i < count; i++) {
+			streams[i].path = objects[i]->thread_filename;
+			streams[i].weight = prefetch_is_stylesheet(objects[i]->thread_filename) ? NGHTTP2_MAX_WEIGHT : NGHTTP2_DEFAULT_WEIGHT;
+			streams[i].response = objects[i]->thread_server_response;
+			streams[i].size = PREFETCH_RESPONSE_SIZE - 1;	//留一個位置給結尾的'\0'
+		}
+		OriginDeadlineSet(objects[0]->deadline);	//這裡是plugin的thread,用完要清掉
+		result = OriginH2Fetch(server_name, objects[0]->thread_portno, streams, count);
+		OriginDeadlineSet(0);
+		OverloadFetchesGive(1);
+		for (i = 0; result == 0 && i < count; i++)
+			objects[i]->thread_response_byte_read = streams[i].length;
+		free(streams);
+		return result;
+}
+
+//objects分到最多prefetch_connections條keep-alive連線上pipeline著抓;
+//css排前面,每條連線都先抓css,才能早點找到下一層的物件
+static int fetch_pipelined(struct thread_data **objects, int count, const char *server_name)
+{
+		int pipelines = count < prefetch_connections ? count : prefetch_connections;
+		struct thread_data **ordered = malloc(count * sizeof(struct thread_data *));
+		struct pipeline_data *pipeline_array;
+		pthread_t *pipeline_handles;
+		int i, k = 0, result = 0;
+
+		if (!ordered)
+			return -1;
+		for (i = 0; i < count; i++)
+			if (prefetch_is_stylesheet(objects[i]->thread_filename))
+				ordered[k++] = objects[i];
+		for (i = 0; i < count; i++)
+			if (!prefetch_is_stylesheet(objects[i]->thread_filename))
+				ordered[k++] = objects[i];
+		if (fetch_h2(ordered, count, server_name) == 0) {
+			free(ordered);
+			return 0;
+		}
+
+		//一條連線佔一個fetch名額,拿不到名額的連線不開,物件分給拿到的;都拿不到就不抓
+		pipelines = OverloadFetchesTake(pipelines);
+		if (pipelines == 0) {
+			TSDebug("HTTP_plugin", "%d objects of %s not fetched, too many fetches", count, server_name);
+			free(ordered);
+			return 0;
+		}
+		pipeline_array = calloc(pipelines, sizeof(struct pipeline_data));
+		pipeline_handles = malloc(pipelines * sizeof(pthread_t));
+		if (!pipeline_array || !pipeline_handles) {
+			OverloadFetchesGive(pipelines);
+			free(ordered);
+			free(pipeline_array);
+			free(pipeline_handles);
+			return -1;
+		}
+
+		//輪流分給各條連線,ordered[i]是第i%pipelines條的第i/pipelines個
+		for (i = 0; i < pipelines; i++) {
+			pipeline_array[i].objects = malloc(((count - i + pipelines - 1) / pipelines) * sizeof(struct thread_data *));
+			if (pipeline_array[i].objects == NULL)
+				result = -1;
+			pipeline_array[i].portno = objects[0]->thread_portno;
+			pipeline_array[i].deadline = objects[0]->deadline;
+			snprintf(pipeline_array[i].server_name, sizeof(pipeline_array[i].server_name), "%s", server_name);
+		}
+		if (result == 0) {
+			for (i = 0; i < count; i++) {
+				struct pipeline_data *pipeline = &pipeline_array[i % pipelines];
+
+				pipeline->objects[pipeline->count++] = ordered[i];
+			}
+			for (i = 0; i < pipelines; i++) {
+				int error = pthread_create(&pipeline_handles[i], NULL, pipelineSocket, (void*) &pipeline_array[i]);
+
+				if (error == 0)
+					continue;
+				//開不了thread的連線,它的物件當作沒抓到;count為0的不join
+				TSError("[protocol] Can't start a pipeline to %s: %s", server_name, strerror(error));
+				for (k = 0; k < pipeline_array[i].count; k++)
+					pipeline_array[i].objects[k]->thread_response_byte_read = 0;
+				pipeline_array[i].count = 0;
+			}
+			for (i = 0; i < pipelines; i++)
+				if (pipeline_array[i].count > 0 && pthread_join(pipeline_handles[i], NULL) != 0)
+					result = -1;
+			TSDebug("HTTP_plugin", "%d objects of %s on %d connections", count, server_name, pipelines);
+		}
+		OverloadFetchesGive(pipelines);
+
+		for (i = 0; i < pipelines; i++)
+			free(pipeline_array[i].objects);
+		free(ordered);
+		free(pipeline_array);
+		free(pipeline_handles);
+		return result;
+}
+
+static int fetch_prefetch_objects(TxnSM *txn_sm, int first, int filtered)
+{
+		int thread, i, pipelined = 0, started = 0;
+		int n = txn_sm->number - first;
+		TSHRTime deadline = TShrtime() + (TSHRTime)origin_timeouts.batch_ms * 1000000;	//這一批最多抓多久
+
+		//結構從arena配置,隨transaction一起釋放;1MB的response buffer從pool拿
+		struct thread_data* thread_array = TxnArenaAlloc(&txn_sm->q_arena, n * sizeof(struct thread_data));  //建立n個thread_data 結構
+		pthread_t* thread_handles = TxnArenaAlloc(&txn_sm->q_arena, n * sizeof(pthread_t));  //建立n個thread
+		struct thread_data** pipelined_array = TxnArenaAlloc(&txn_sm->q_arena, n * sizeof(struct thread_data *));	//要pipeline的物件
+		if (!thread_array || !thread_handles || !pipelined_array)
+			return -1;
+
+		for (thread=0; thread<n ; thread++) //存資料到結構並啟動thread
+		{		
+			const char *path = txn_sm->filename[first + thread];
+			int references = AdmissionRecord(path);	//又被一個網頁參考到
+
+			//被參考的次數還不夠、cache filter說已經在cache裡、這個網頁的額度用完了、
+			//或抓了也常常沒人要的就不抓了;css要抓回來才找得到下一層的物件;預測的下一頁一定抓
+			if (filtered && !prefetch_is_stylesheet(path) && (references < prefetch_admit_min || (CacheFilterTrusted() && CacheFilterMayContain(path)) ||
+			                                      txn_sm->prefetch_budget <= 0 || !PrefetchStatsWanted(path))) {
+				TSDebug("HTTP_plugin","%s not fetched, %d references",path,references);
+				thread_array[thread].thread_id = -1;
+				thread_array[thread].thread_server_response = NULL;
+				thread_array[thread].thread_response_byte_read = 0;
+				continue;
+			}
+			//一個thread佔一個fetch名額,用完了就不抓;pipeline的名額在fetch_pipelined一條連線拿一個
+			if (prefetch_connections == 0 && OverloadFetchesTake(1) == 0) {
+				TSDebug("HTTP_plugin","%s not fetched, too many fetches",path);
+				thread_array[thread].thread_id = -1;
+				thread_array[thread].thread_server_response = NULL;
+				thread_array[thread].thread_response_byte_read = 0;
+				continue;
+			}
+			thread_array[thread].thread_server_response = prefetch_response_get();
+			if (thread_array[thread].thread_server_response == NULL) {
+				if (prefetch_connections == 0)
+					OverloadFetchesGive(1);
+				thread_array[thread].thread_id = -1;
+				thread_array[thread].thread_response_byte_read = 0;
+				continue;
+			}
+			TSDebug("HTTP_plugin","enter %s create",txn_sm->filename[first + thread]);
+			txn_sm->prefetch_budget--;
+			thread_array[thread].thread_id = thread;							//定義thread編號
+			thread_array[thread]. thread_portno= 80;							//設port
+			thread_array[thread].deadline = deadline;
+			thread_array[thread].thread_response_byte_read = 0;
+			
+			snprintf(thread_array[thread].thread_filename, sizeof(thread_array[thread].thread_filename), "%s", txn_sm->filename[first + thread]);	//儲存要請求檔案和路徑
+			snprintf(thread_array[thread].server_name, sizeof(thread_array[thread].server_name), "%s", txn_sm->q_server_name);	//replica依延遲和錯誤率挑	
+			
+			if (prefetch_connections > 0) {
+				pipelined_array[pipelined++] = &thread_array[thread];	//等一下一起送
+				continue;
+			}
+			pthread_create(&thread_handles[thread], NULL, connectSocket, (void*) &thread_array[thread]);   //啟動thread
+			started++;
+		}
+		//合流，跑完thread才能繼續往下執行
+		for(thread = 0; prefetch_connections == 0 && thread < n; thread++){
+			if (thread_array[thread].thread_id < 0)
+				continue;
+			if (pthread_join(thread_handles[thread], NULL) != 0)
+			{
+				//thread可能還在用它的buffer,不能放回pool
+				OverloadFetchesGive(started);
+				return -1;
+			}
+		}
+		OverloadFetchesGive(started);	//放回fetch名額
+		if (pipelined > 0 && fetch_pipelined(pipelined_array, pipelined, txn_sm->q_server_name) != 0) {
+			for (i = 0; i < n; i++)
+				prefetch_response_put(thread_array[i].thread_server_response);
+			return -1;
+		}
+		
+		TSDebug("HTTP_plugin", "All socket finish" );
+		
+		//把response相關資料存到txn_sm,記憶體大小依實際response而定
+		for(i=0;i<n;i++)
+		{
+			txn_sm->response_byte_read[first + i]=thread_array[i].thread_response_byte_read;
+			txn_sm->server_response[first + i]=(char*)TxnArenaAlloc(&txn_sm->q_arena,txn_sm->response_byte_read[first + i]+1);
+			if (txn_sm->server_response[first + i] == NULL) {
+				txn_sm->response_byte_read[first + i] = 0;
+			} else if (thread_array[i].thread_server_response == NULL) {
+				txn_sm->server_response[first + i][0] = '\0';	//沒抓
+			} else {
+				memcpy(txn_sm->server_response[first + i],thread_array[i].thread_server_response,txn_sm->response_byte_read[first + i]);
+				txn_sm->server_response[first + i][txn_sm->response_byte_read[first + i]] = '\0';
+			}
+			prefetch_response_put(thread_array[i].thread_server_response);
+		}
+		return 0;
+}
+
+//掃描css或網頁時記住是哪一個檔案,相對路徑要以它為基準
+typedef struct {
+	TxnSM *txn_sm;
+	const char *base;
+} stylesheet_scan;
+
+//css裡找到的網址:解析成絕對路徑,沒抓過的排進下一層
+static void stylesheet_url_add(const char *url, int length, void *data)
+{
+	stylesheet_scan *scan = (stylesheet_scan *)data;
+	TxnSM *txn_sm = scan->txn_sm;
+	char path[MAX_PARSED_URL_LENGTH];
+	int i;
+
+	if (txn_sm->number >= MAX_PREFETCH_OBJECTS)
+		return;
+	if (UrlResolve(txn_sm->q_server_name, scan->base, url, length, path, sizeof(path)) < 0)
+		return;
+	for (i = 0; i < txn_sm->number; i++) {
+		if (strcmp(txn_sm->filename[i], path) == 0)
+			return;
+	}
+	queue_prefetch_write(txn_sm, TxnArenaStrndup(&txn_sm->q_arena, path, strlen(path)), NULL, 0);
+}
+
+//抓到的物件是type(css或網頁)的話,把它引用的字型、圖片、@import等加進清單
+static void add_referenced_objects(TxnSM *txn_sm, int index, const char *type)
+{
+	stylesheet_scan scan;
+	char *content_type;
+	char *body;
+
+	if (txn_sm->response_byte_read[index] <= 0 || !txn_sm->server_response[index])
+		return;
+	body = strstr(txn_sm->server_response[index], "\r\n\r\n");
+	if (body == NULL)
+		return;
+	content_type = get_http_header_field_value(txn_sm->server_response[index], "Content-Type");
+	if (!content_type || strncmp(content_type, type, strlen(type)) != 0)
+		return;
+
+	body += 4;
+	scan.txn_sm = txn_sm;
+	scan.base   = txn_sm->filename[index];
+	UrlExtract(body, txn_sm->response_byte_read[index] - (body - txn_sm->server_response[index]), stylesheet_url_add, &scan);
+}
+
+//從這一頁最常去的下一頁,還沒抓過的先抓回來,再抓它的內嵌物件
+static void add_next_pages(TxnSM *txn_sm)
+{
+	char next[MAX_NEXT_PAGES][NEXT_PAGE_MAX_LENGTH];
+	int i, k, n, first, last;
+
+	n = NextPagePredict(txn_sm->q_file_name, next, MAX_NEXT_PAGES);
+	first = txn_sm->number;
+	for (i = 0; i < n; i++) {
+		if (CacheFilterTrusted() && CacheFilterMayContain(next[i]))
+			continue;
+		for (k = 0; k < txn_sm->number && strcmp(txn_sm->filename[k], next[i]) != 0; k++)
+			;
+		if (k < txn_sm->number)
+			continue;
+		TSDebug("HTTP_plugin","%s is likely next after %s",next[i],txn_sm->q_file_name);
+		queue_prefetch_write(txn_sm, TxnArenaStrndup(&txn_sm->q_arena, next[i], strlen(next[i])), NULL, 0);
+	}
+	if (first == txn_sm->number)
+		return;
+
+	last = txn_sm->number;
+	if (fetch_prefetch_objects(txn_sm, first, 0) != 0)
+		return;
+	for (i = first; i < last; i++)
+		add_referenced_objects(txn_sm, i, "text/html");
+	if (last < txn_sm->number)
+		fetch_prefetch_objects(txn_sm, last, 1);
+}
+
+//選定網頁裡<a href>連到的同站網頁:規則允許、還沒在cache、速率限制內才排進清單
+static void crawl_link_add(const char *url, int length, void *data)
+{
+	stylesheet_scan *scan = (stylesheet_scan *)data;
+	TxnSM *txn_sm = scan->txn_sm;
+	char path[MAX_PARSED_URL_LENGTH];
+	int i;
+
+	if (txn_sm->number >= MAX_PREFETCH_OBJECTS)
+		return;
+	if (UrlResolve(txn_sm->q_server_name, scan->base, url, length, path, sizeof(path)) < 0 || !CrawlAllowed(path))
+		return;
+	if (CacheFilterTrusted() && CacheFilterMayContain(path))
+		return;
+	for (i = 0; i < txn_sm->number; i++) {
+		if (strcmp(txn_sm->filename[i], path) == 0)
+			return;
+	}
+	if (!CrawlTake(txn_sm->q_server_name))
+		return;
+	TSDebug("HTTP_plugin","crawl %s from %s",path,scan->base);
+	queue_prefetch_write(txn_sm, TxnArenaStrndup(&txn_sm->q_arena, path, strlen(path)), NULL, 0);
+}
+
+//把一個網頁(含header)的連結加進清單
+static void add_crawl_links(TxnSM *txn_sm, const char *response, int length, const char *base)
+{
+	stylesheet_scan scan;
+	const char *body = strstr(response, "\r\n\r\n");
+
+	if (body == NULL)
+		return;
+	body += 4;
+	scan.txn_sm = txn_sm;
+	scan.base   = base;
+	UrlExtractAnchors(body, length - (body - response), crawl_link_add, &scan);
+}
+
+//選定的網頁沿著連結往下抓crawl_depth層,最後一起抓這些網頁的內嵌物件
+static void add_crawl_pages(TxnSM *txn_sm)
+{
+	int i, depth, first, last, pages;
+
+	if (crawl_depth <= 0 || txn_sm->q_page_length <= 0 || !CrawlSelected(txn_sm->q_file_name))
+		return;
+
+	pages = first = txn_sm->number;
+	add_crawl_links(txn_sm, txn_sm->q_page, txn_sm->q_page_length, txn_sm->q_file_name);
+	for (depth = 1; first < txn_sm->number; depth++) {
+		last = txn_sm->number;
+		if (fetch_prefetch_objects(txn_sm, first, 0) != 0)
+			return;
+		TSDebug("HTTP_plugin", "crawl depth %d: %d pages", depth, last - first);
+		if (depth >= crawl_depth)
+			break;
+
+		//只有也被選定的網頁才再往下一層
+		for (i = first; i < last; i++) {
+			const char *content_type;
+
+			if (txn_sm->response_byte_read[i] <= 0 || !txn_sm->server_response[i] || !CrawlSelected(txn_sm->filename[i]))
+				continue;
+			content_type = get_http_header_field_value(txn_sm->server_response[i], "Content-Type");
+			if (content_type && strncmp(content_type, "text/html", 9) == 0)
+				add_crawl_links(txn_sm, txn_sm->server_response[i], txn_sm->response_byte_read[i], txn_sm->filename[i]);
+		}
+		first = last;
+	}
+
+	last = txn_sm->number;
+	for (i = pages; i < last; i++)
+		add_referenced_objects(txn_sm, i, "text/html");
+	if (last < txn_sm->number)
+		fetch_prefetch_objects(txn_sm, last, 1);
+}
+
+//在plugin的thread上跑,回傳0就開始寫入cache,-1就結束transaction
+static int
+parse_url_and_send_request_use_pthread(TxnSM *txn_sm)
+{
+		TSDebug("HTTP_plugin","enter parse_url_and_send_request_use_pthread");
+
+		int i, first = 0, level = 1;
+
+		//同一類網頁的物件常被用到就多抓一些,很少被用到就少抓
+		txn_sm->prefetch_budget = PrefetchStatsBudget(PrefetchTemplate(txn_sm->q_file_name));
+		TSDebug("HTTP_plugin","prefetch budget of %s is %d",txn_sm->q_file_name,txn_sm->prefetch_budget);
+
+		//宣告要存response資料的指標陣列,和filename一起配置,之後加進來的物件放在多出來的格子
+		txn_sm->server_response = NULL;
+		txn_sm->response_byte_read = NULL;
+		txn_sm->capacity = 0;
+		if (!prefetch_grow(txn_sm, txn_sm->number))
+			return -1;
+
+		//一層一層抓:第1層是頁面的物件,下一層是上一層css裡url()、@import到的物件
+		while (first < txn_sm->number) {
+			int last = txn_sm->number;
+
+			if (fetch_prefetch_objects(txn_sm, first, 1) != 0)
+				return -1;
+			if (level >= prefetch_css_depth)
+				break;
+
+			for (i = first; i < last; i++)
+				add_referenced_objects(txn_sm, i, "text/css");
+			TSDebug("HTTP_plugin", "level %d: %d objects from stylesheets", level + 1, txn_sm->number - last);
+
+			first = last;
+			level++;
+		}
+
+		//參考次數不夠的css只用來找下一層的物件,不寫入cache
+		for (i = 0; i < txn_sm->number; i++) {
+			if (txn_sm->response_byte_read[i] > 0 && AdmissionEstimate(txn_sm->filename[i]) < prefetch_admit_min)
+				txn_sm->response_byte_read[i] = 0;
+		}
+
+		//初始化
+		txn_sm->count=0;
+	TSDebug("HTTP_plugin", "end receive");	
+
+	//頁面的內嵌物件清單存成manifest,cache hit時用來補抓物件
+	if (txn_sm->q_page_length > 0)
+		add_page_manifest(txn_sm);
+
+	//預測接下來會看的網頁,連同它的內嵌物件一起先抓;不列進這一頁的manifest
+	add_next_pages(txn_sm);
+
+	//有開crawl的話,選定網頁的連結也先抓;一樣不列進manifest
+	add_crawl_pages(txn_sm);
+
+	//壓縮版本接在prefetch物件後面一起寫入cache
+	add_encoded_variants(txn_sm);
+
+	//回到transaction的mutex上,把prefetch的response一個一個寫入cache
+	return 0;
+	}
+
+/* Make room for needed objects in the lists of the prefetch, doubling
+   them so appending one at a time stays linear. The arena keeps the
+   old lists until the transaction ends. */
+static int
+prefetch_grow(TxnSM *txn_sm, int needed)
+{
+  char **filename, **server_response;
+  int *response_byte_read;
+  int i, capacity;
+
+  if (needed <= txn_sm->capacity)
+    return 1;
+  for (capacity = txn_sm->capacity > 0 ? txn_sm->capacity : 16; capacity < needed; capacity *= 2)
+    ;
+
+  filename           = (char **)TxnArenaCalloc(&txn_sm->q_arena, sizeof(char *) * capacity);
+  server_response    = (char **)TxnArenaCalloc(&txn_sm->q_arena, sizeof(char *) * capacity);
+  response_byte_read = (int *)TxnArenaCalloc(&txn_sm->q_arena, sizeof(int) * capacity);
+  if (!filename || !server_response || !response_byte_read)
+    return 0;
+
+  for (i = 0; i < txn_sm->number; i++) {
+    filename[i] = txn_sm->filename[i];
+    if (txn_sm->server_response) {
+      server_response[i]    = txn_sm->server_response[i];
+      response_byte_read[i] = txn_sm->response_byte_read[i];
+    }
+  }
+
+  txn_sm->filename           = filename;
+  txn_sm->server_response    = server_response;
+  txn_sm->response_byte_read = response_byte_read;
+  txn_sm->capacity           = capacity;
+  return 1;
+}
+
+/* Append an object to the ones the prefetch writes store. */
+static int
+queue_prefetch_write(TxnSM *txn_sm, char *name, char *response, int length)
+{
+  if (!prefetch_grow(txn_sm, txn_sm->number + 1))
+    return 0;
+
+  txn_sm->filename[txn_sm->number]           = name;
+  txn_sm->server_response[txn_sm->number]    = response;
+  txn_sm->response_byte_read[txn_sm->number] = length;
+  txn_sm->number++;
+  return 1;
+}
+
+/* Queue the manifest of the page, the list of its embedded objects,
+   after the prefetched objects. */
+static void
+add_page_manifest(TxnSM *txn_sm)
+{
+  char *manifest, *name;
+  int count = txn_sm->number;
+  int length;
+
+  manifest = ManifestBuild(&txn_sm->q_arena, txn_sm->filename, count, &length);
+  name     = ManifestName(&txn_sm->q_arena, txn_sm->q_file_name);
+  if (!manifest || !name || !queue_prefetch_write(txn_sm, name, manifest, length))
+    return;
+
+  add_preload_page(txn_sm, count);
+}
+
+/* The page missed. If its manifest is still cached, send a 103 Early
+   Hints with its objects to an HTTP/1.1 client before going to the
+   origin server, so the browser fetches them while the page is on its
+   way. Whatever happens, the miss goes on in
+   state_handle_cache_prepare_for_write. */
+static int
+start_early_hints(TSCont contp)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  char *name;
+  int version = strcspn(txn_sm->q_client_request, "\r");
+
+  name = ManifestName(&txn_sm->q_arena, txn_sm->q_file_name);
+  if (!name || version < 8 || strncmp(txn_sm->q_client_request + version - 8, "HTTP/1.1", 8) != 0)
+    return continue_page_miss(contp);
+
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_hints_manifest_lookup);
+  return cache_read(contp, name);
+}
+
+/* Open the cache write_vc for the page, as a miss does. */
+static int
+continue_page_miss(TSCont contp)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  if (txn_sm->q_key)
+    TSCacheKeyDestroy(txn_sm->q_key);
+  txn_sm->q_key = (TSCacheKey)CacheKeyCreate(txn_sm->q_file_name);
+
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_prepare_for_write);
+  txn_sm->q_pending_action = TSCacheWrite(contp, txn_sm->q_key);
+  return TS_SUCCESS;
+}
+
+int
+state_handle_hints_manifest_lookup(TSCont contp, TSEvent event, TSVConn vc)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  int64_t size;
+
+  TSDebug("HTTP_plugin", "enter state_handle_hints_manifest_lookup");
+
+  txn_sm->q_pending_action = NULL;
+  cache_lookup_done(txn_sm, event);
+
+  if (event != TS_EVENT_CACHE_OPEN_READ)
+    return continue_page_miss(contp);
+
+  txn_sm->q_cache_vc = vc;
+  size               = TSVConnCacheObjectSizeGet(vc);
+  if (!txn_sm->q_cache_read_buffer)
+    txn_sm->q_cache_read_buffer = IOBufferPoolGet(TXN_BUFFER_LARGE, &txn_sm->q_cache_read_buffer_reader);
+  if (size <= 0 || size > MAX_MANIFEST_LENGTH || !txn_sm->q_cache_read_buffer) {
+    TSVConnClose(txn_sm->q_cache_vc);
+    txn_sm->q_cache_vc = NULL;
+    return continue_page_miss(contp);
+  }
+
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_read_hints_manifest);
+  txn_sm->q_cache_read_vio = TSVConnRead(txn_sm->q_cache_vc, contp, txn_sm->q_cache_read_buffer, size);
+  return TS_SUCCESS;
+}
+
+int
+state_read_hints_manifest(TSCont contp, TSEvent event, TSVIO vio)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  char **paths = NULL;
+  char *links, *hints;
+  int n, links_length, hints_length;
+
+  TSDebug("HTTP_plugin", "enter state_read_hints_manifest");
+
+  if (vio == txn_sm->q_client_read_vio)
+    return TS_SUCCESS;
+
+  switch (event) {
+  case TS_EVENT_VCONN_READ_READY:
+    TSVIOReenable(vio);
+    return TS_SUCCESS;
+
+  case TS_EVENT_VCONN_READ_COMPLETE:
+    paths = take_manifest(txn_sm, &n);
+    break;
+
+  default:
+    break;
+  }
+
+  TSVConnClose(txn_sm->q_cache_vc);
+  txn_sm->q_cache_vc       = NULL;
+  txn_sm->q_cache_read_vio = NULL;
+
+  if (!paths || n == 0)
+    return continue_page_miss(contp);
+  links = PreloadLinks(&txn_sm->q_arena, paths, n, &links_length);
+  hints = links ? EarlyHintsBuild(&txn_sm->q_arena, links, links_length, &hints_length) : NULL;
+  if (!hints)
+    return continue_page_miss(contp);
+
+  TSDebug("HTTP_plugin", "send early hints for %s", txn_sm->q_file_name);
+  TSIOBufferWrite(txn_sm->q_cache_read_buffer, hints, hints_length);
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_send_early_hints);
+  return send_response_to_client(contp, txn_sm->q_cache_read_buffer_reader, hints_length);
+}
+
+/* The 103 is out, the client write is started again for the page. */
+int
+state_send_early_hints(TSCont contp, TSEvent event, TSVIO vio)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  TSDebug("HTTP_plugin", "enter state_send_early_hints");
+
+  if (vio == txn_sm->q_client_read_vio)
+    return TS_SUCCESS;
+
+  switch (event) {
+  case TS_EVENT_VCONN_WRITE_READY:
+    TSVIOReenable(vio);
+    return TS_SUCCESS;
+
+  case TS_EVENT_VCONN_WRITE_COMPLETE:
+    txn_sm->q_client_write_vio = NULL;
+    return continue_page_miss(contp);
+
+  default:
+    return prepare_to_die(contp);
+  }
+}
+
+/* Answer the client with a response of our own, then the transaction
+   is done. */
+static int
+send_canned_response(TSCont contp, const char *response, int length)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  TSVIO vio     = txn_sm->q_client_write_vio;
+
+  /* The write of an origin response that came empty sends this in
+     its place, from the same buffer. */
+  if (vio && TSVIOReaderGet(vio) == txn_sm->q_client_response_buffer_reader) {
+    TSIOBufferWrite(txn_sm->q_server_response_buffer, response, length);
+    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_send_canned_response);
+    TSVIONBytesSet(vio, TSVIONDoneGet(vio) + length);
+    TSVIOReenable(vio);
+    return TS_SUCCESS;
+  }
+
+  if (!txn_sm->q_cache_read_buffer)
+    txn_sm->q_cache_read_buffer = IOBufferPoolGet(TXN_BUFFER_LARGE, &txn_sm->q_cache_read_buffer_reader);
+  if (!txn_sm->q_cache_read_buffer)
+    return prepare_to_die(contp);
+
+  TSIOBufferWrite(txn_sm->q_cache_read_buffer, response, length);
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_send_canned_response);
+  return send_response_to_client(contp, txn_sm->q_cache_read_buffer_reader, length);
+}
+
+/* Too busy to serve the request: 503, the client may try again in a
+   second. */
+static int
+send_overloaded(TSCont contp)
+{
+  static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n"
+                                 "Connection: close\r\n\r\n";
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  TSDebug("HTTP_plugin", "overloaded, 503 for %s", txn_sm->q_file_name);
+  return send_canned_response(contp, response, sizeof(response) - 1);
+}
+
+/* The origin server gave nothing for a miss: 504 if it didn't answer
+   in time, 502 otherwise. */
+static int
+send_origin_error(TSCont contp, int status)
+{
+  static const char bad_gateway[]     = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  static const char gateway_timeout[] = "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  TSError("[protocol] no response for %s from %s, answering %d", txn_sm->q_file_name, txn_sm->q_server_name,
+          status == 504 ? 504 : 502);
+  if (status == 504)
+    return send_canned_response(contp, gateway_timeout, sizeof(gateway_timeout) - 1);
+  return send_canned_response(contp, bad_gateway, sizeof(bad_gateway) - 1);
+}
+
+/* The 503 is out, close the client. */
+int
+state_send_canned_response(TSCont contp, TSEvent event, TSVIO vio)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  TSDebug("HTTP_plugin", "enter state_send_canned_response");
+
+  if (vio == txn_sm->q_client_read_vio)
+    return TS_SUCCESS;
+
+  switch (event) {
+  case TS_EVENT_VCONN_WRITE_READY:
+    TSVIOReenable(vio);
+    return TS_SUCCESS;
+
+  case TS_EVENT_VCONN_WRITE_COMPLETE:
+    TSVConnClose(txn_sm->q_client_vc);
+    txn_sm->q_client_vc        = NULL;
+    txn_sm->q_client_read_vio  = NULL;
+    txn_sm->q_client_write_vio = NULL;
+    return state_done(contp, 0, NULL);
+
+  default:
+    return prepare_to_die(contp);
+  }
+}
+
+/* Store the page again with a Link: rel=preload header per embedded
+   object, so every hit tells the browser what to fetch next without
+   any work per request. The variants are made from this copy. Only a
+   page kept whole can be rewritten. */
+static void
+add_preload_page(TxnSM *txn_sm, int count)
+{
+  char *links, *linked;
+  int links_length, linked_length;
+
+  if (txn_sm->q_page_length == 0 || txn_sm->q_page_length != txn_sm->q_server_response_length)
+    return;
+
+  links = PreloadLinks(&txn_sm->q_arena, txn_sm->filename, count, &links_length);
+  if (links == NULL)
+    return;
+  linked = PreloadAddLinks(&txn_sm->q_arena, txn_sm->q_page, txn_sm->q_page_length, links, links_length, &linked_length);
+  if (linked == NULL)
+    return;
+
+  if (!queue_prefetch_write(txn_sm, txn_sm->q_file_name, linked, linked_length))
+    return;
+
+  txn_sm->q_page                   = linked;
+  txn_sm->q_page_length            = linked_length;
+  txn_sm->q_server_response_length = linked_length;
+}
+
+/* No object of the cached page is missing. The prefetch still runs,
+   with an empty list, for the pages likely to be visited next: on a
+   thread of the plugin, the client already has its response. Only page hits
+   get here, see start_manifest_lookup. */
+static int
+warm_next_pages(TSCont contp)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  txn_sm->filename = NULL;
+  txn_sm->number   = 0;
+  txn_sm->count    = 0;
+  return run_on_plugin_thread(contp, &parse_url_and_send_request_use_pthread);
+}
+
+/* The client got a cached doc. If it is a page with a manifest, check
+   that the objects it lists are still in the cache and prefetch the
+   ones that aren't, without reading the page again. The prefetch runs
+   on a thread of the plugin. */
+static int
+start_manifest_lookup(TSCont contp)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  char *name;
+
+  /* The write can complete before the cache read reports the data. */
+  if (txn_sm->q_head_reader)
+    check_page_hit(txn_sm, txn_sm->q_head_reader);
+
+  /* Not a page, or too busy to prefetch. */
+  if (!txn_sm->q_page_hit || OverloadStageGet() >= OVERLOAD_NO_PREFETCH)
+    return state_done(contp, 0, NULL);
+
+  name = ManifestName(&txn_sm->q_arena, txn_sm->q_file_name);
+  if (!name)
+    return state_done(contp, 0, NULL);
+
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_manifest_lookup);
+  return cache_read(contp, name);
+}
+
+int
+state_handle_manifest_lookup(TSCont contp, TSEvent event, TSVConn vc)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  int64_t size;
+
+  TSDebug("HTTP_plugin", "enter state_handle_manifest_lookup");
+
+  txn_sm->q_pending_action = NULL;
+  cache_lookup_done(txn_sm, event);
+
+  switch (event) {
+  case TS_EVENT_CACHE_OPEN_READ:
+    txn_sm->q_cache_vc = vc;
+    size               = TSVConnCacheObjectSizeGet(vc);
+    if (size <= 0 || size > MAX_MANIFEST_LENGTH || !txn_sm->q_cache_read_buffer) {
+      TSVConnClose(txn_sm->q_cache_vc);
+      txn_sm->q_cache_vc = NULL;
+      return warm_next_pages(contp);
+    }
+
+    TSIOBufferReaderConsume(txn_sm->q_cache_read_buffer_reader, TSIOBufferReaderAvail(txn_sm->q_cache_read_buffer_reader));
+    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_read_manifest);
+    txn_sm->q_cache_read_vio = TSVConnRead(txn_sm->q_cache_vc, contp, txn_sm->q_cache_read_buffer, size);
+    return TS_SUCCESS;
+
+  default:
+    /* Not a page, or one without embedded objects. */
+    return warm_next_pages(contp);
+  }
+}
+
+/* Look up the next object of the manifest. Objects found are dropped
+   from the list; when all have been checked, the missing ones are
+   fetched and written like the objects of a page miss. */
+static int
+check_next_manifest_object(TSCont contp)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  int i, n;
+
+  if (txn_sm->count < txn_sm->number) {
+    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_check_manifest_object);
+    return cache_read(contp, txn_sm->filename[txn_sm->count]);
+  }
+
+  for (i = 0, n = 0; i < txn_sm->number; i++) {
+    if (txn_sm->filename[i])
+      txn_sm->filename[n++] = txn_sm->filename[i];
+  }
+  TSDebug("HTTP_plugin", "%d of %d objects of %s missing", n, txn_sm->number, txn_sm->q_file_name);
+  txn_sm->number = n;
+  txn_sm->count  = 0;
+
+  return run_on_plugin_thread(contp, &parse_url_and_send_request_use_pthread);
+}
+
+/* Paths of the manifest read into the cache read buffer. */
+static char **
+take_manifest(TxnSM *txn_sm, int *count)
+{
+  char *manifest = get_info_from_buffer(&txn_sm->q_arena, txn_sm->q_cache_read_buffer_reader);
+
+  *count = 0;
+  return manifest ? ManifestParse(&txn_sm->q_arena, manifest, count) : NULL;
+}
+
+int
+state_read_manifest(TSCont contp, TSEvent event, TSVIO vio)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  char **paths = NULL;
+  int n        = 0;
+
+  TSDebug("HTTP_plugin", "enter state_read_manifest");
+
+  switch (event) {
+  case TS_EVENT_VCONN_READ_READY:
+    TSVIOReenable(vio);
+    return TS_SUCCESS;
+
+  case TS_EVENT_VCONN_READ_COMPLETE:
+    paths = take_manifest(txn_sm, &n);
+    break;
+
+  default:
+    break;
+  }
+
+  TSVConnClose(txn_sm->q_cache_vc);
+  txn_sm->q_cache_vc       = NULL;
+  txn_sm->q_cache_read_vio = NULL;
+
+  if (!paths || n == 0)
+    return warm_next_pages(contp);
+
+  txn_sm->filename = paths;
+  txn_sm->number   = n;
+  txn_sm->count    = 0;
+  return check_next_manifest_object(contp);
+}
+
+int
+state_check_manifest_object(TSCont contp, TSEvent event, TSVConn vc)
+{
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+
+  txn_sm->q_pending_action = NULL;
+  cache_lookup_done(txn_sm, event);
+
+  if (event == TS_EVENT_CACHE_OPEN_READ) {
+    TSVConnClose(vc);
+    txn_sm->filename[txn_sm->count] = NULL;
   }
-
-  /* Marshal request */
-  TSIOBufferWrite(txn_sm->q_server_request_buffer, txn_sm->q_client_request, strlen(txn_sm->q_client_request));
-  TSDebug("HTTP_plugin","server name is %s",txn_sm->q_server_name);
-  
-  
-  
-  
-  return begin_transmission_with_server(contp, 0, NULL);
-  
-
-  
+  txn_sm->count++;
+  return check_next_manifest_object(contp);
 }
 
-int 
-begin_transmission_with_server(TSCont contp, TSEvent event ATS_UNUSED, void *data ATS_UNUSED)
-{//以下為用HTTP請求和server要資料
-	
-	
-	TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
-	TSDebug("HTTP_plugin","enter begin_transmission_with_server");
-	
-	int n,sockfd;		
-	struct sockaddr_in serv_addr;   //用來保存socket資訊的資料結構
-	struct hostent *server; 	    // server :存server用
-	
-	char buffer[1024]; 		//暫存部分response
-    char http_response[655360];   //最大存5MB
-	int bytes_read=0;
-	int IOBuffer_size;
-    n = 1;
-	char *http_header_end_ptr=NULL;
-	char *content_length_ptr = NULL; 
-	
-	//create socket
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		TSError("ERROR opening socket");
-	}
-	serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(txn_sm->q_server_port); 
-  
-	//建立server資訊
-	server = gethostbyname(txn_sm->q_server_name);
-	if (server == NULL) {
-        fprintf(stderr,"ERROR, no such host\n");
-        exit(0);
+/* Queue the gzip and brotli variants of the page and of the prefetched
+   objects after the objects themselves, so the prefetch writes store
+   them too. Compression is done here, once per fill, never when a
+   variant is served; it runs on the thread of the prefetch. The
+   page is only encoded if it was kept whole. */
+static void
+add_encoded_variants(TxnSM *txn_sm)
+{
+  char **filename, **server_response;
+  int *response_byte_read;
+  const char *name, *response;
+  char *variant, *variant_name;
+  int capacity, length, variant_length;
+  int i, n;
+  TxnEncoding encoding;
+
+  capacity           = txn_sm->number + (txn_sm->number + 1) * (TXN_ENCODING_COUNT - 1);
+  filename           = (char **)TxnArenaAlloc(&txn_sm->q_arena, sizeof(char *) * capacity);
+  server_response    = (char **)TxnArenaAlloc(&txn_sm->q_arena, sizeof(char *) * capacity);
+  response_byte_read = (int *)TxnArenaAlloc(&txn_sm->q_arena, sizeof(int) * capacity);
+  if (!filename || !server_response || !response_byte_read)
+    return;
+
+  for (n = 0; n < txn_sm->number; n++) {
+    filename[n]           = txn_sm->filename[n];
+    server_response[n]    = txn_sm->server_response[n];
+    response_byte_read[n] = txn_sm->response_byte_read[n];
+  }
+
+  /* i == -1 is the page the client asked for. */
+  for (i = -1; i < txn_sm->number; i++) {
+    if (i < 0) {
+      if (txn_sm->q_page_length == 0 || txn_sm->q_page_length != txn_sm->q_server_response_length)
+        continue;
+      name     = txn_sm->q_file_name;
+      response = txn_sm->q_page;
+      length   = txn_sm->q_page_length;
+    } else {
+      name     = txn_sm->filename[i];
+      response = txn_sm->server_response[i];
+      length   = txn_sm->response_byte_read[i];
     }
-	bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-	
-	//建立連線
-	if(connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0)
-			TSError("connect failed. Error");
-	
-	//送出request
-	n = write(sockfd,txn_sm->q_client_request,strlen(txn_sm->q_client_request));
-	if (n < 0) 
-        TSDebug("HTTP_plugin", "ERROR writing to socket");
-	//接收server-response
-	
-	while(n>0 && !http_header_end_ptr){
-    	bzero(buffer,1024);
-    	n = read(sockfd,buffer,1024);
-		memcpy(http_response+bytes_read,buffer,n);
-		bytes_read = bytes_read + n;    	
-    	http_header_end_ptr = strstr(buffer,"\r\n\r\n");
+    if (length <= 0 || !EncodingCompressible(response))
+      continue;
+
+    for (encoding = TXN_ENCODING_GZIP; encoding < TXN_ENCODING_COUNT; encoding++) {
+      variant      = EncodingCompress(&txn_sm->q_arena, response, length, encoding, &variant_length);
+      variant_name = variant ? EncodingVariantName(&txn_sm->q_arena, name, encoding) : NULL;
+      if (!variant_name)
+        continue;
+      TSDebug("HTTP_plugin", "%s variant of %s: %d -> %d bytes", encoding_name[encoding], name, length, variant_length);
+      filename[n]           = variant_name;
+      server_response[n]    = variant;
+      response_byte_read[n] = variant_length;
+      n++;
     }
-		
-    if(http_header_end_ptr != NULL)
-	{	
-		int header_length = get_header_length(http_response);
-		
-        content_length_ptr = strstr(http_response,"Content-Length");
-		if( content_length_ptr!= NULL)
-		{
-			char *content_length_temp = malloc(sizeof(char)*11);
-			memcpy(content_length_temp,content_length_ptr+16,strcspn(content_length_ptr,"\r")-16);
-			int content_length = atoi(content_length_temp);
-			free(content_length_temp);
-			
-			int all_response_size = content_length + header_length;
-			do{
-				bzero(buffer,1024);
-				n = read(sockfd,buffer,1024);
-				memcpy(http_response+bytes_read,buffer,n);
-				bytes_read = bytes_read + n;
-			
-				}while(n > 0);
-			
-			close(sockfd);
-			TSIOBufferWrite(txn_sm->q_server_response_buffer, http_response, all_response_size);
-			IOBuffer_size = TSIOBufferReaderAvail(txn_sm->q_cache_response_buffer_reader);
-		}
-		else{
-			do{
-				bzero(buffer,1024);
-				n = read(sockfd,buffer,1024);
-				memcpy(http_response+bytes_read,buffer,n);
-				bytes_read = bytes_read + n;
-				}while(n > 0);
-			close(sockfd);
-			TSIOBufferWrite(txn_sm->q_server_response_buffer, http_response, bytes_read);
-			IOBuffer_size = TSIOBufferReaderAvail(txn_sm->q_cache_response_buffer_reader);
-			
-		}
-		
-
-	}
-	else
-	{
-	
-		close(sockfd);
-		TSIOBufferWrite(txn_sm->q_server_response_buffer, http_response, bytes_read);
-		IOBuffer_size = TSIOBufferReaderAvail(txn_sm->q_cache_response_buffer_reader);
-	}
-	
-	
-	//解析response
-	txn_sm->count=0;
-	txn_sm->number=0;
-	int i;
-	char url_parsed[100][200];
-	TSDebug("HTTP_plugin","IOBuffer_size = %d",IOBuffer_size);
-	parsing_request_all_URL(http_response,&url_parsed[0][0],IOBuffer_size,200,&txn_sm->number);
-	
-	TSDebug("HTTP_plugin","txn_sm->number = %d",txn_sm->number);
-	//宣告要存放filename資料的記憶體,並存filename
-		txn_sm->filename =(char **) malloc (sizeof(char *)*txn_sm->number);
-		for(i=0;i<txn_sm->number;i++)
-		{
-			txn_sm->filename[i]=(char*)malloc(sizeof(char)*200);
-			memcpy(txn_sm->filename[i],url_parsed[i],200);
-		}
+  }
 
-	return parse_url_and_send_request_use_pthread(contp, 0, NULL);
+  txn_sm->filename           = filename;
+  txn_sm->server_response    = server_response;
+  txn_sm->response_byte_read = response_byte_read;
+  txn_sm->number             = n;
+  txn_sm->capacity           = capacity;
 }
 
-int
-parse_url_and_send_request_use_pthread(TSCont contp, TSEvent event ATS_UNUSED, void *data ATS_UNUSED)
+/* Open a cache write_vc for the prefetched object txn_sm->count.
+   Objects the origin didn't return are skipped. When there is no
+   object left the transaction is done. */
+static int
+start_prefetch_write(TSCont contp)
 {
-		TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
-		TSDebug("HTTP_plugin","enter parse_url_and_send_request_use_pthread");
-		
-		int thread;
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
 
-		char ori_server[2][20]={"www.cwb.gov.tw","www.cwb.gov.tw"};
-		
-	
-		
-		struct thread_data* thread_array = malloc(txn_sm->number * sizeof(struct thread_data));  //建立txn_sm->number個thread_data 結構
-		pthread_t* thread_handles = malloc(txn_sm->number * sizeof(pthread_t));  //建立txn_sm->number個thread
-		
-		TSDebug("HTTP_plugin","enter 5");
-	
-		for (thread=0; thread<txn_sm->number ; thread++) //存資料到結構並啟動thread
-		{		
-			TSDebug("HTTP_plugin","enter %s create",txn_sm->filename[thread]);
-			thread_array[thread].thread_id = thread;							//定義thread編號
-			thread_array[thread]. thread_portno= 80;							//設port
-			
-			strcpy( thread_array[thread].thread_filename , txn_sm->filename[thread]);	//儲存要請求檔案和路徑
-			strcpy( thread_array[thread].server_IP , ori_server[thread%2]);		//要發送request的serverIP	
-			
-			pthread_create(&thread_handles[thread], NULL, connectSocket, (void*) &thread_array[thread]);   //啟動thread
-		
-			
-		}
-		
-		//合流，跑完thread才能繼續往下執行
-		for(thread = 0; thread < txn_sm->number; thread++){
-			if (pthread_join(thread_handles[thread], NULL) != 0)
-			{
-				return EXIT_FAILURE;
-			}
-		}
-		
-		TSDebug("HTTP_plugin", "All socket finish" );
-				
+  while (txn_sm->count < txn_sm->number && txn_sm->response_byte_read[txn_sm->count] <= 0)
+    txn_sm->count++;
 
-		int i=0;
-		
-		//宣告要存response資料的記憶體
-		txn_sm->server_response =(char **) malloc (sizeof(char *)*txn_sm->number);
-		for(i=0;i<txn_sm->number;i++)
-			txn_sm->server_response[i]=(char*)malloc(sizeof(char)*65535);
-		
-		//宣告存response size資料的記憶體
-		txn_sm->response_byte_read=(int*)malloc(sizeof(int)*txn_sm->number);
-		
-		//把response相關資料存到txn_sm
-		for(i=0;i<txn_sm->number;i++)
-		{
-			memcpy(txn_sm->server_response[i],thread_array[i].thread_server_response,65535);
-			memcpy(txn_sm->filename[i],thread_array[i].thread_filename,200);
-			txn_sm->response_byte_read[i]=thread_array[i].thread_response_byte_read;
-		}
+  if (txn_sm->count >= txn_sm->number)
+    return state_done(contp, 0, NULL);
 
-		//初始化
-		txn_sm->count=0;
-		free(thread_array);
-		free(thread_handles);
-	TSDebug("HTTP_plugin", "end receive");	
-	set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_interface_with_server);
-	txn_sm->q_cache_write_vio = TSVConnWrite(txn_sm->q_cache_vc, contp,txn_sm->q_cache_response_buffer_reader, 
-													TSIOBufferReaderAvail(txn_sm->q_cache_response_buffer_reader));
+  if (txn_sm->q_key)
+    TSCacheKeyDestroy(txn_sm->q_key);
+  TSDebug("HTTP_plugin", "create cachekey is == %s",txn_sm->filename[txn_sm->count]);
+  txn_sm->q_key = (TSCacheKey)CacheKeyCreate(txn_sm->filename[txn_sm->count]);	//利用filename建立cache key
 
-		
-			
-  
-  TSDebug("HTTP_plugin","jesse successfully");
-	return TS_SUCCESS;
-	}
+  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&jeese_test);
+  txn_sm->q_pending_action = TSCacheWrite(contp, txn_sm->q_key);
+  return TS_SUCCESS;
+}
 
 
 
@@ -987,7 +2805,8 @@ state_send_request_to_server(TSCont contp, TSEvent event, TSVIO vio)
   return TS_SUCCESS;
 }
 
-/* Call correct handler according to the vio type. */
+/* Call correct handler according to the vio type. The server read,
+   the cache write and the client write of a miss all run at once. */
 int
 state_interface_with_server(TSCont contp, TSEvent event, TSVIO vio)
 {
@@ -997,18 +2816,21 @@ state_interface_with_server(TSCont contp, TSEvent event, TSVIO vio)
 
   txn_sm->q_pending_action = NULL;
 
-  switch (event) {
-	  
-  /* This is returned from cache_vc. */
-  case TS_EVENT_VCONN_WRITE_READY:
-  
-  case TS_EVENT_VCONN_WRITE_COMPLETE:
+  /* The client request has been read already. */
+  if (vio == txn_sm->q_client_read_vio)
+    return TS_SUCCESS;
+
+  if (vio == txn_sm->q_client_write_vio)
+    return state_stream_response_to_client(contp, event, vio);
 
+  /* This is returned from cache_vc. */
+  if (vio == txn_sm->q_cache_write_vio)
     return state_write_to_cache(contp, event, vio);
-	
+
+  switch (event) {
   /* Otherwise, handle events from server. */
   case TS_EVENT_VCONN_READ_READY:
-  
+
   /* Actually, we shouldn't get READ_COMPLETE because we set bytes
      count to be INT64_MAX. */
   case TS_EVENT_VCONN_READ_COMPLETE:
@@ -1017,6 +2839,8 @@ state_interface_with_server(TSCont contp, TSEvent event, TSVIO vio)
   /* all data of the response come in. */
   case TS_EVENT_VCONN_EOS:
     TSDebug("HTTP_plugin", "get server eos");
+    take_response_data(txn_sm);
+
     /* There is no more use of server_vc, close it. */
     if (txn_sm->q_server_vc) {
       TSVConnClose(txn_sm->q_server_vc);
@@ -1027,57 +2851,48 @@ state_interface_with_server(TSCont contp, TSEvent event, TSVIO vio)
 
     /* Check if the response is good */
     if (txn_sm->q_server_response_length == 0) {
-      /* This is the bad response. Close client_vc. */
-      if (txn_sm->q_client_vc) {
-        TSVConnClose(txn_sm->q_client_vc);
-        txn_sm->q_client_vc = NULL;
-      }
-      txn_sm->q_client_read_vio  = NULL;
-      txn_sm->q_client_write_vio = NULL;
-
-      /* Close cache_vc as well. */
+      /* Don't leave an empty doc in the cache. */
       if (txn_sm->q_cache_vc) {
-        TSVConnClose(txn_sm->q_cache_vc);
+        TSVConnAbort(txn_sm->q_cache_vc, 1);
         txn_sm->q_cache_vc = NULL;
       }
       txn_sm->q_cache_write_vio = NULL;
-      return state_done(contp, 0, NULL);
-    }
 
-    if (txn_sm->q_cache_response_length >= txn_sm->q_server_response_length) {
-      /* Write is complete, close the cache_vc. */
-      TSVConnClose(txn_sm->q_cache_vc);
-      txn_sm->q_cache_vc        = NULL;
-      txn_sm->q_cache_write_vio = NULL;
-      TSIOBufferReaderFree(txn_sm->q_cache_response_buffer_reader);
+      /* Nothing was sent yet: tell the client the origin server
+         failed, the client write sends that instead. */
+      if (!txn_sm->q_client_vc)
+        return state_done(contp, 0, NULL);
+      return send_origin_error(contp, txn_sm->q_fetch ? OriginFetchStatus(txn_sm->q_fetch) : 0);
+    }
 
-      /* Open cache_vc to read data and send to client. */
-  //    set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_lookup);
-  //    txn_sm->q_pending_action = TSCacheRead(contp, txn_sm->q_key);
-	if( (txn_sm->count == 0) && (txn_sm->number != 0) )
-	{//jesse
-			
-		
-			TSCacheKeyDestroy(txn_sm->q_key);
-			txn_sm->q_key =NULL;
-			
-			TSDebug("HTTP_plugin", "create cachekey is == %s",txn_sm->filename[txn_sm->count]);
-			txn_sm->q_key = (TSCacheKey)CacheKeyCreate(txn_sm->filename[txn_sm->count]);	//利用q_file_name建立cache key
-	
-			set_handler(txn_sm->q_current_handler, (TxnSMHandler)&jeese_test);
-			txn_sm->q_pending_action = TSCacheWrite(contp, txn_sm->q_key);
-			
-	return TS_SUCCESS;
-	}
-  
-  
-  
-    } else { /* not done with writing into cache */
+    /* Now the size of the response is known. A write that already
+       sent everything won't be called back, finish it here. */
+    if (txn_sm->q_cache_write_vio) {
+      TSVIONBytesSet(txn_sm->q_cache_write_vio, txn_sm->q_server_response_length);
+      if (TSVIONTodoGet(txn_sm->q_cache_write_vio) > 0) {
+        TSVIOReenable(txn_sm->q_cache_write_vio);
+      } else {
+        TSVConnClose(txn_sm->q_cache_vc);
+        txn_sm->q_cache_vc        = NULL;
+        txn_sm->q_cache_write_vio = NULL;
+      }
+    }
 
-      TSDebug("HTTP_plugin", "cache_response_length is %d, server response length is %d", txn_sm->q_cache_response_length,
-              txn_sm->q_server_response_length);
-      TSVIOReenable(txn_sm->q_cache_write_vio);
+    /* A range response has its own length, known since its header. */
+    if (range_active(txn_sm)) {
+      feed_client_from_server(contp);
+    } else if (txn_sm->q_client_write_vio) {
+      TSVIONBytesSet(txn_sm->q_client_write_vio, txn_sm->q_server_response_length);
+      if (TSVIONTodoGet(txn_sm->q_client_write_vio) > 0) {
+        TSVIOReenable(txn_sm->q_client_write_vio);
+      } else {
+        TSVConnClose(txn_sm->q_client_vc);
+        txn_sm->q_client_vc        = NULL;
+        txn_sm->q_client_read_vio  = NULL;
+        txn_sm->q_client_write_vio = NULL;
+      }
     }
+    return state_handle_response_done(contp);
 
   default:
     break;
@@ -1088,46 +2903,33 @@ state_interface_with_server(TSCont contp, TSEvent event, TSVIO vio)
 
 /* The response comes in. If the origin server finishes writing, it
    will close the socket, so the event returned from the net_vc is
-   TS_EVENT_VCONN_EOS. By this event, TxnSM knows all data of the
-   response arrives and so parse it, save a copy in the cache and
-   send the doc to the client. If reading is not done, reenable the
-   read_vio. */
+   TS_EVENT_VCONN_EOS. Until then, hand each block to the cache write
+   and the client write, and keep reading as long as they keep up. */
 int
 state_read_response_from_server(TSCont contp, TSEvent event ATS_UNUSED, TSVIO vio ATS_UNUSED)
 {
-  TxnSM *txn_sm  = (TxnSM *)TSContDataGet(contp);
-  int bytes_read = 0;
+  TxnSM *txn_sm      = (TxnSM *)TSContDataGet(contp);
+  int64_t bytes_read = 0;
 
   TSDebug("HTTP_plugin", "enter state_read_response_from_server");
 
-  bytes_read = TSIOBufferReaderAvail(txn_sm->q_cache_response_buffer_reader);
+  bytes_read = take_response_data(txn_sm);
 
-  if ((bytes_read > 0) && (txn_sm->q_cache_vc)) {
-    /* If this is the first write, do TSVConnWrite, otherwise, simply
-       reenable q_cache_write_vio. */
-    if (txn_sm->q_server_response_length == 0) {
-		//bytes_read=1024;
-		TSDebug("HTTP_plugin", "q_server_response_length is zero");
-		set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_interface_with_server);
-		txn_sm->q_cache_write_vio = TSVConnWrite(txn_sm->q_cache_vc, contp, txn_sm->q_cache_response_buffer_reader, bytes_read);
-    } else {
-		TSDebug("HTTP_plugin", "q_server_response_length is not zero");
-		TSAssert(txn_sm->q_server_response_length > 0);
-		//TSVIOReenable(txn_sm->q_cache_write_vio);
-		txn_sm->q_block_bytes_read = bytes_read;
-		set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_interface_with_server);
-		txn_sm->q_cache_write_vio = TSVConnWrite (txn_sm->q_cache_vc,contp,txn_sm->q_cache_response_buffer_reader,bytes_read);
-    }
+  if (bytes_read > 0) {
+    if (txn_sm->q_cache_write_vio)
+      TSVIOReenable(txn_sm->q_cache_write_vio);
+    feed_client_from_server(contp);
   }
+  reenable_server_read(txn_sm);
 
-  txn_sm->q_server_response_length += bytes_read;
-  TSDebug("HTTP_plugin", "bytes read is %d, total response length is %d", bytes_read, txn_sm->q_server_response_length);
+  TSDebug("HTTP_plugin", "bytes read is %" PRId64 ", total response length is %" PRId64, bytes_read,
+          txn_sm->q_server_response_length);
 
   return TS_SUCCESS;
 }
 
-/* If the whole doc has been written into the cache, send the response
-   to the client, otherwise, reenable the read_vio. */
+/* The cache took some data, the server may refill the buffer. When
+   the whole doc has been written, close the cache_vc to commit it. */
 int
 state_write_to_cache(TSCont contp, TSEvent event, TSVIO vio)
 {
@@ -1137,62 +2939,63 @@ state_write_to_cache(TSCont contp, TSEvent event, TSVIO vio)
 
   switch (event) {
   case TS_EVENT_VCONN_WRITE_READY:
-	TSDebug("HTTP_plugin","TS_EVENT_VCONN_WRITE_READY TSVIOReenable(txn_sm->q_cache_write_vio);");
-    TSVIOReenable(txn_sm->q_cache_write_vio);
+    reenable_server_read(txn_sm);
     return TS_SUCCESS;
 
   case TS_EVENT_VCONN_WRITE_COMPLETE:
     TSDebug("HTTP_plugin", "nbytes %" PRId64 ", ndone %" PRId64, TSVIONBytesGet(vio), TSVIONDoneGet(vio));
-    /* Since the first write is through TSVConnWrite, which aleady consume
-       the data in cache_buffer_reader, don't consume it again. */
-    if (txn_sm->q_cache_response_length > 0 && txn_sm->q_block_bytes_read > 0){
-		TSDebug("HTTP_plugin", "TSIOBufferReaderConsume(txn_sm->q_cache_response_buffer_reader, txn_sm->q_block_bytes_read);");
-		TSIOBufferReaderConsume(txn_sm->q_cache_response_buffer_reader, txn_sm->q_block_bytes_read);
-	}
+    TSVConnClose(txn_sm->q_cache_vc);
+    txn_sm->q_cache_vc        = NULL;
+    txn_sm->q_cache_write_vio = NULL;
+    CacheFilterAdd(txn_sm->q_file_name);
+    EncodingStored(txn_sm->q_file_name);
+    HotCacheRemove(txn_sm->q_file_name);
+    return state_handle_response_done(contp);
 
-    txn_sm->q_cache_response_length += TSVIONBytesGet(vio);
-	
-	/*TSVConnClose(txn_sm->q_server_vc);
-	txn_sm->q_server_vc = NULL;
-	txn_sm->q_server_read_vio  = NULL;
-    txn_sm->q_server_write_vio = NULL;*/
-	
-    /* If not all data have been read in, we have to reenable the read_vio */
-    if (txn_sm->q_server_vc != NULL) {
-      TSDebug("HTTP_plugin", "re-enable server_read_vio");
-		
-		TSVIOReenable(txn_sm->q_server_read_vio);
-      return TS_SUCCESS;
-    }
+  default:
+    break;
+  }
 
-    if (txn_sm->q_cache_response_length >= txn_sm->q_server_response_length) {
-		if(txn_sm->count == 0){
-					 /* Write is complete, close the cache_vc. */
-			  TSDebug("HTTP_plugin", "close cache_vc, cache_response_length is %d, server_response_lenght is %d",
-					  txn_sm->q_cache_response_length, txn_sm->q_server_response_length);
-			  TSVConnClose(txn_sm->q_cache_vc);
-			  txn_sm->q_cache_vc        = NULL;
-			  txn_sm->q_cache_write_vio = NULL;
-			  TSIOBufferReaderFree(txn_sm->q_cache_response_buffer_reader);
+  /* Something wrong if getting here. */
+  return prepare_to_die(contp);
+}
 
-			  /* Open cache_vc to read data and send to client. */
-			  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_lookup);
-			  txn_sm->q_pending_action = TSCacheRead(contp, txn_sm->q_key);
-		}
-		
-     
-    } else { /* not done with writing into cache */
+/* Same as state_write_to_cache for the client side of a miss. */
+int
+state_stream_response_to_client(TSCont contp, TSEvent event, TSVIO vio)
+{
+  int ret_val;
+  TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
 
-      TSDebug("HTTP_plugin", "re-enable cache_write_vio");
-      TSVIOReenable(txn_sm->q_cache_write_vio);
+  TSDebug("HTTP_plugin", "enter state_stream_response_to_client");
+
+  switch (event) {
+  case TS_EVENT_VCONN_WRITE_READY:
+    /* The client took some of the parts, cut the next ones. */
+    if (range_active(txn_sm)) {
+      feed_client_from_server(contp);
+      if (!txn_sm->q_client_vc)
+        return state_handle_response_done(contp);
     }
+    reenable_server_read(txn_sm);
     return TS_SUCCESS;
+
+  case TS_EVENT_VCONN_WRITE_COMPLETE:
+    ret_val = TSTextLogObjectWrite(protocol_plugin_log, "Send file to client");
+    if (ret_val != TS_SUCCESS)
+      TSError("[protocol] Fail to write into log");
+
+    TSDebug("HTTP_plugin", "write_complete: nbytes %" PRId64 ", ndone %" PRId64, TSVIONBytesGet(vio), TSVIONDoneGet(vio));
+    TSVConnClose(txn_sm->q_client_vc);
+    txn_sm->q_client_vc        = NULL;
+    txn_sm->q_client_read_vio  = NULL;
+    txn_sm->q_client_write_vio = NULL;
+    return state_handle_response_done(contp);
+
   default:
     break;
   }
-  
 
-  /* Something wrong if getting here. */
   return prepare_to_die(contp);
 }
 
@@ -1209,9 +3012,12 @@ jeese_test(TSCont contp, TSEvent event, TSVConn vc)
 	  case TS_EVENT_CACHE_OPEN_WRITE:
 		
 		txn_sm->q_cache_vc = vc;
-		//宣告:
-		txn_sm->q_server_response_buffer       = TSIOBufferCreate();
-		txn_sm->q_cache_response_buffer_reader = TSIOBufferReaderAlloc(txn_sm->q_server_response_buffer);
+		//宣告:依物件大小從pool取buffer
+		release_server_response_buffer(txn_sm);
+		txn_sm->q_server_response_class  = IOBufferClassForSize(txn_sm->response_byte_read[txn_sm->count]);
+		txn_sm->q_server_response_buffer = IOBufferPoolGet(txn_sm->q_server_response_class, &txn_sm->q_cache_response_buffer_reader);
+		if (!txn_sm->q_server_response_buffer)
+			return prepare_to_die(contp);
 		//寫response到buffer
 		TSIOBufferWrite(txn_sm->q_server_response_buffer, txn_sm->server_response[txn_sm->count], 
 														txn_sm->response_byte_read[txn_sm->count]);
@@ -1227,10 +3033,11 @@ jeese_test(TSCont contp, TSEvent event, TSVConn vc)
 		
 		break;
 	  default:
-		TSDebug("HTTP_plugin", "Can't open cache write_vc, aborting txn");
+		//這個檔案寫不進cache(例如正在被別的transaction寫),跳過換下一個
+		TSDebug("HTTP_plugin", "Can't open cache write_vc, skip %s",txn_sm->filename[txn_sm->count]);
 		txn_sm->q_cache_vc = NULL;
-		return prepare_to_die(contp);
-		break;
+		txn_sm->count++;
+		return start_prefetch_write(contp);
 	  }
 	  return prepare_to_die(contp);
 }
@@ -1258,38 +3065,20 @@ jesse_test_write_complete(TSCont contp, TSEvent event, TSVIO vio)
 			  TSVConnClose(txn_sm->q_cache_vc);
 			  txn_sm->q_cache_vc        = NULL;
 			  txn_sm->q_cache_write_vio = NULL;
-			  TSIOBufferReaderFree(txn_sm->q_cache_response_buffer_reader);
+			  release_server_response_buffer(txn_sm);
+		CacheFilterAdd(txn_sm->filename[txn_sm->count]);
+		EncodingStored(txn_sm->filename[txn_sm->count]);	//壓縮版本跟著目前的原始版本
+		//記下這是為哪一類網頁預先抓的,之後看有沒有client要它
+		if (!strchr(txn_sm->filename[txn_sm->count], ' ') && strcmp(txn_sm->filename[txn_sm->count], txn_sm->q_file_name) != 0)
+			PrefetchStatsPrefetched(txn_sm->filename[txn_sm->count], PrefetchTemplate(txn_sm->q_file_name));
+		//新寫入的版本取代RAM裡的舊版本
+		HotCacheInsert(txn_sm->filename[txn_sm->count], txn_sm->server_response[txn_sm->count], txn_sm->response_byte_read[txn_sm->count]);
+
+		//client已經收到response,存完所有prefetch的檔案就結束
+		TSDebug("HTTP_plugin", "enter next file write to cache");
+		txn_sm->count++;
+		return start_prefetch_write(contp);
 
-			  /* Open cache_vc to read data and send to client. */
-			  //set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_lookup);
-			  //txn_sm->q_pending_action = TSCacheRead(contp, txn_sm->q_key);
-		
-		if(txn_sm->count == (txn_sm->number-1)) //如果pthread請求都存完，準備送出第一個response給client
-		{
-			TSCacheKeyDestroy(txn_sm->q_key);
-			txn_sm->q_key =NULL;
-			TSDebug("HTTP_plugin", "create cachekey is == %s",txn_sm->q_file_name);
-			txn_sm->q_key = (TSCacheKey)CacheKeyCreate(txn_sm->q_file_name);	//利用q_file_name建立cache key
-			set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_handle_cache_lookup);
-			txn_sm->q_pending_action = TSCacheRead(contp, txn_sm->q_key);
-		}			
-		else
-		{
-			TSDebug("HTTP_plugin", "enter next file write to cache");
-			txn_sm->count++;
-			
-			TSCacheKeyDestroy(txn_sm->q_key);
-			txn_sm->q_key =NULL;
-			
-			TSDebug("HTTP_plugin", "create cachekey is == %s",txn_sm->filename[txn_sm->count]);
-			txn_sm->q_key = (TSCacheKey)CacheKeyCreate(txn_sm->filename[txn_sm->count]);	//利用q_file_name建立cache key
-	
-			set_handler(txn_sm->q_current_handler, (TxnSMHandler)&jeese_test);
-			txn_sm->q_pending_action = TSCacheWrite(contp, txn_sm->q_key);
-			
-			return TS_SUCCESS;
-		}
-    //return TS_SUCCESS;
   default:
     break;
   }
@@ -1315,6 +3104,9 @@ state_send_response_to_client(TSCont contp, TSEvent event, TSVIO vio)
     TSDebug("HTTP_plugin", " . wr ready");
     TSDebug("HTTP_plugin", "write_ready: nbytes %" PRId64 ", ndone %" PRId64, TSVIONBytesGet(vio), TSVIONDoneGet(vio));
     TSVIOReenable(txn_sm->q_client_write_vio);
+    /* The client took some data, let the cache read refill the buffer. */
+    if (txn_sm->q_cache_read_vio)
+      TSVIOReenable(txn_sm->q_cache_read_vio);
     break;
 
   case TS_EVENT_VCONN_WRITE_COMPLETE:
@@ -1333,12 +3125,18 @@ state_send_response_to_client(TSCont contp, TSEvent event, TSVIO vio)
     }
     txn_sm->q_client_read_vio  = NULL;
     txn_sm->q_client_write_vio = NULL;
+    release_transaction_slot(txn_sm);
+    keep_hot_object(txn_sm);
+    /* The write can complete before the cache read_vio reports it. */
+    if (txn_sm->q_cache_read_vio && txn_sm->q_cache_vc) {
+      TSVConnClose(txn_sm->q_cache_vc);
+      txn_sm->q_cache_vc       = NULL;
+      txn_sm->q_cache_read_vio = NULL;
+    }
 	TSDebug("HTTP_plugin", "txn_sm->count=%d",txn_sm->count);
 	TSDebug("HTTP_plugin", " txn_sm->number=%d ",txn_sm->number );
-	//write here 寫入cache
-	//.............................................................
-	
-    return state_done(contp, 0, NULL);
+	//cache hit:依頁面的manifest補抓不在cache裡的內嵌物件
+    return start_manifest_lookup(contp);
 
   default:
     TSDebug("HTTP_plugin", " . default handler");
@@ -1350,6 +3148,26 @@ state_send_response_to_client(TSCont contp, TSEvent event, TSVIO vio)
   return TS_SUCCESS;
 }
 
+/* Hand the buffer holding the server response (or the prefetched
+   object being written) back to the pool with its reader. */
+static void
+release_server_response_buffer(TxnSM *txn_sm)
+{
+  /* The other readers of the buffer must go first. */
+  if (txn_sm->q_client_response_buffer_reader) {
+    TSIOBufferReaderFree(txn_sm->q_client_response_buffer_reader);
+    txn_sm->q_client_response_buffer_reader = NULL;
+  }
+  if (txn_sm->q_page_reader) {
+    TSIOBufferReaderFree(txn_sm->q_page_reader);
+    txn_sm->q_page_reader = NULL;
+  }
+
+  IOBufferPoolPut(txn_sm->q_server_response_class, txn_sm->q_server_response_buffer, txn_sm->q_cache_response_buffer_reader);
+  txn_sm->q_server_response_buffer       = NULL;
+  txn_sm->q_cache_response_buffer_reader = NULL;
+}
+
 /* There is something wrong, abort client, server and cache vc
    if they exist. */
 int
@@ -1387,35 +3205,22 @@ int
 state_done(TSCont contp, TSEvent event ATS_UNUSED, TSVIO vio ATS_UNUSED)
 {
   TxnSM *txn_sm = (TxnSM *)TSContDataGet(contp);
+  int admitted    = txn_sm->q_admitted;
+  int rejected    = txn_sm->q_rejected;
+  int server_port = txn_sm->q_server_port;
 
   TSDebug("HTTP_plugin", "jesse enter state_done");
 //  TSDebug("HTTP_plugin","txn_sm->count=0 and txn_sm->number=0");
   txn_sm->count=0;
   txn_sm->number=0;
+  txn_sm->capacity=0;
  
- if(txn_sm->server_response != NULL)
-  {
-//	TSDebug("HTTP_plugin", "jesse enter free server_response");
-	//free(txn_sm->server_response);
-	txn_sm->server_response = NULL;
-  }
-  
-  if(txn_sm->filename != NULL)
-  {
-//	TSDebug("HTTP_plugin", "jesse enter free filename");
-	//free(txn_sm->filename);
-	txn_sm->filename = NULL;
- }
-  
-   if(txn_sm->response_byte_read != NULL)
-  {
-//	TSDebug("HTTP_plugin", "jesse enter free response_byte_read");
-//	free(txn_sm->response_byte_read);
-	txn_sm->response_byte_read = NULL;
-  }
-  
-  
-  
+  /* filename, server_response, response_byte_read and the char
+     buffers below live in the arena, released at the end. */
+  txn_sm->server_response    = NULL;
+  txn_sm->filename           = NULL;
+  txn_sm->response_byte_read = NULL;
+
   if (txn_sm->q_pending_action && !TSActionDone(txn_sm->q_pending_action)) {
 //    TSDebug("HTTP_plugin", "cancelling pending action %p", txn_sm->q_pending_action);
     TSActionCancel(txn_sm->q_pending_action);
@@ -1426,76 +3231,51 @@ state_done(TSCont contp, TSEvent event ATS_UNUSED, TSVIO vio ATS_UNUSED)
   txn_sm->q_pending_action = NULL;
   txn_sm->q_mutex          = NULL;
 //TSDebug("HTTP_plugin", "enter state_done  q_client_request_buffer");
-  if (txn_sm->q_client_request_buffer) {
-    if (txn_sm->q_client_request_buffer_reader)
-      TSIOBufferReaderFree(txn_sm->q_client_request_buffer_reader);
-    TSIOBufferDestroy(txn_sm->q_client_request_buffer);
-    txn_sm->q_client_request_buffer        = NULL;
-    txn_sm->q_client_request_buffer_reader = NULL;
-  }
-//TSDebug("HTTP_plugin", "enter state_done q_client_response_buffer");
-  if (txn_sm->q_client_response_buffer) {
-    if (txn_sm->q_client_response_buffer_reader)
-      TSIOBufferReaderFree(txn_sm->q_client_response_buffer_reader);
-
-    TSIOBufferDestroy(txn_sm->q_client_response_buffer);
-    txn_sm->q_client_response_buffer        = NULL;
-    txn_sm->q_client_response_buffer_reader = NULL;
-  }
-//TSDebug("HTTP_plugin", "enter state_done q_cache_read_buffer");
-  if (txn_sm->q_cache_read_buffer) {
-    if (txn_sm->q_cache_read_buffer_reader)
-      TSIOBufferReaderFree(txn_sm->q_cache_read_buffer_reader);
-    TSIOBufferDestroy(txn_sm->q_cache_read_buffer);
-    txn_sm->q_cache_read_buffer        = NULL;
-    txn_sm->q_cache_read_buffer_reader = NULL;
-  }
-//TSDebug("HTTP_plugin", "enter state_done q_server_request_buffer");
-  if (txn_sm->q_server_request_buffer) {
-    if (txn_sm->q_server_request_buffer_reader)
-      TSIOBufferReaderFree(txn_sm->q_server_request_buffer_reader);
-    TSIOBufferDestroy(txn_sm->q_server_request_buffer);
-    txn_sm->q_server_request_buffer        = NULL;
-    txn_sm->q_server_request_buffer_reader = NULL;
-  }
-//TSDebug("HTTP_plugin", "enter state_done q_server_response_buffer");
-  if (txn_sm->q_server_response_buffer) {
-    TSIOBufferDestroy(txn_sm->q_server_response_buffer);
-    txn_sm->q_server_response_buffer = NULL;
-  }
-//TSDebug("HTTP_plugin", "enter state_done q_server_name");
-  if (txn_sm->q_server_name) {
-	  TSDebug("HTTP_plugin", "enter state_done free q_server_name");
-    //free(txn_sm->q_server_name);
-	TSDebug("HTTP_plugin", "enter state_done q_server_name null");
-    txn_sm->q_server_name = NULL;
-  }
-//TSDebug("HTTP_plugin", "enter state_done q_file_name");
-  if (txn_sm->q_file_name) {
-    //free(txn_sm->q_file_name);
-    txn_sm->q_file_name = NULL;
-  }
+  /* All the buffers go back to the pool with their reader. */
+  IOBufferPoolPut(TXN_BUFFER_REQUEST, txn_sm->q_client_request_buffer, txn_sm->q_client_request_buffer_reader);
+  txn_sm->q_client_request_buffer        = NULL;
+  txn_sm->q_client_request_buffer_reader = NULL;
+
+  release_cache_read_buffer(txn_sm);
+
+  IOBufferPoolPut(TXN_BUFFER_LARGE, txn_sm->q_range_buffer, txn_sm->q_range_buffer_reader);
+  txn_sm->q_range_buffer        = NULL;
+  txn_sm->q_range_buffer_reader = NULL;
+  RangeInit(&txn_sm->q_range);
+
+  IOBufferPoolPut(TXN_BUFFER_REQUEST, txn_sm->q_server_request_buffer, txn_sm->q_server_request_buffer_reader);
+  txn_sm->q_server_request_buffer        = NULL;
+  txn_sm->q_server_request_buffer_reader = NULL;
+
+  release_server_response_buffer(txn_sm);
+  txn_sm->q_server_name    = NULL;
+  txn_sm->q_file_name      = NULL;
+  txn_sm->q_client_request = NULL;
+  txn_sm->q_server_response = NULL;
 //TSDebug("HTTP_plugin", "enter state_done q_key");
-  if (txn_sm->q_key)
+  if (txn_sm->q_key) {
     TSCacheKeyDestroy(txn_sm->q_key);
-//TSDebug("HTTP_plugin", "enter state_done q_client_request");
-  if (txn_sm->q_client_request) {
-    //free(txn_sm->q_client_request);
-    txn_sm->q_client_request = NULL;
-  }
-//TSDebug("HTTP_plugin", "enter state_done q_server_response");
-  if (txn_sm->q_server_response) {
-    //free(txn_sm->q_server_response);
-    txn_sm->q_server_response = NULL;
+    txn_sm->q_key = NULL;
   }
- // TSDebug("HTTP_plugin", "enter state_done txn_sm");
-  if (txn_sm) {
-    txn_sm->q_magic = TXN_SM_DEAD;
-    //free(txn_sm);
+  if (txn_sm->q_fetch) {
+    OriginFetchRelease(txn_sm->q_fetch);
+    txn_sm->q_fetch = NULL;
   }
-  //TSDebug("HTTP_plugin", "enter state_done TSContDestroy");
+
   TSContDestroy(contp);
- // TSDebug("HTTP_plugin", "enter state_done TS_EVENT_NONE");
+
+  /* Release all the memory of the transaction in one shot and
+     recycle the TxnSM for the next accepted connection. */
+  txn_sm->q_magic = TXN_SM_DEAD;
+  TxnArenaReset(&txn_sm->q_arena);
+  TxnSMPoolPut(txn_sm);
+
+  /* The slot goes to the next connection waiting for one, unless it
+     went when the client was closed. */
+  if (rejected)
+    OverloadAnswered();
+  if (admitted)
+    start_waiting_transaction(server_port);
   
   	int ret_val;
 	ret_val = TSTextLogObjectWrite(protocol_plugin_log, "Close all connect");
@@ -1505,29 +3285,30 @@ state_done(TSCont contp, TSEvent event ATS_UNUSED, TSVIO vio ATS_UNUSED)
   return TS_EVENT_NONE;
 }
 
-/* Write the data into the client_vc. */
+/* Start writing response_len bytes from reader into the client_vc.
+   The data doesn't have to be there yet, the producer of the buffer
+   reenables the write_vio as it comes in. The current handler is left
+   alone, it must pass the client write_vio events on to
+   state_send_response_to_client. */
 int
-send_response_to_client(TSCont contp)
+send_response_to_client(TSCont contp, TSIOBufferReader reader, int64_t response_len)
 {
   TxnSM *txn_sm;
-  int response_len;
 
   TSDebug("HTTP_plugin", "enter send_response_to_client");
 
-  txn_sm       = (TxnSM *)TSContDataGet(contp);
-  response_len = TSIOBufferReaderAvail(txn_sm->q_client_response_buffer_reader);
+  txn_sm = (TxnSM *)TSContDataGet(contp);
 
-  TSDebug("HTTP_plugin", " . resp_len is %d", response_len);
+  TSDebug("HTTP_plugin", " . resp_len is %" PRId64, response_len);
 
-  set_handler(txn_sm->q_current_handler, (TxnSMHandler)&state_interface_with_client);
-  txn_sm->q_client_write_vio =
-    TSVConnWrite(txn_sm->q_client_vc, (TSCont)contp, txn_sm->q_client_response_buffer_reader, response_len);
+  txn_sm->q_client_write_vio = TSVConnWrite(txn_sm->q_client_vc, (TSCont)contp, reader, response_len);
   return TS_SUCCESS;
 }
 
-/* Read data out through the_reader and save it in a char buffer. */
+/* Read data out through the_reader and save it in a NUL terminated
+   char buffer allocated from the transaction arena. */
 char *
-get_info_from_buffer(TSIOBufferReader the_reader)
+get_info_from_buffer(TxnArena *arena, TSIOBufferReader the_reader)
 {
   char *info;
   char *info_start;
@@ -1541,9 +3322,10 @@ get_info_from_buffer(TSIOBufferReader the_reader)
 
   read_avail = TSIOBufferReaderAvail(the_reader);
 
-  info = (char *)malloc(sizeof(char) * read_avail);
+  info = (char *)TxnArenaAlloc(arena, sizeof(char) * (read_avail + 1));
   if (info == NULL)
     return NULL;
+  info[read_avail] = '\0';
   info_start = info;
 
   /* Read the data out of the reader */
@@ -1577,7 +3359,7 @@ CacheKeyCreate(char *file_name)
 }
 
 char* get_http_header_field_value(char* cilent_request,char* header_field_name){
-	static char http_header_field_value[100] = "";
+	static __thread char http_header_field_value[100] = "";
 	char* http_header_ptr = NULL;
 	int http_header_field_value_length = 0;
 	int http_header_field_name_length = 0;
@@ -1590,29 +3372,40 @@ char* get_http_header_field_value(char* cilent_request,char* header_field_name){
 	
 	http_header_field_value_length = strcspn(http_header_ptr,"\r");	//取得header_value的長度
 	if(http_header_field_value_length == 0)return NULL;	//如果找不到該欄位,回傳NULL
+	if(http_header_field_value_length >= (int)sizeof(http_header_field_value))
+		http_header_field_value_length = sizeof(http_header_field_value) - 1;
 	
 	memcpy(http_header_field_value ,http_header_ptr ,http_header_field_value_length);	//取得http_header_field_value的資料
+	http_header_field_value[http_header_field_value_length] = '\0';
 	return http_header_field_value;
 }
 
-char** get_http_request_info(char* cilent_request){
+//回傳request line的method,path,version,記憶體由arena配置
+char** get_http_request_info(TxnArena *arena, char* cilent_request){
 	int http_request_length = 0;
 	int i=0;
 	char http_request[200] = "";
 	char *tmp = NULL;
-	static char *parsed_http_request[3];
+	char *save_ptr = NULL;
+	char **parsed_http_request;
+	
+	parsed_http_request = (char **)TxnArenaAlloc(arena, sizeof(char *) * 3);
+	if(parsed_http_request == NULL)return NULL;
     for(i=0;i<3;i++)
     {
-        parsed_http_request[i] = malloc(sizeof(char) * 100);
+        parsed_http_request[i] = "";
     }
 	http_request_length = strcspn(cilent_request,"\r");
+	if(http_request_length >= (int)sizeof(http_request))
+		http_request_length = sizeof(http_request) - 1;
 	memcpy(http_request,cilent_request,http_request_length);
-	tmp = strtok(http_request," ");
+	tmp = strtok_r(http_request," ",&save_ptr);
 	i=0;
-	while (tmp != NULL)
+	while (tmp != NULL && i < 3)
     {
-        strcpy(parsed_http_request[i],tmp);
-        tmp = strtok (NULL, " ");
+        parsed_http_request[i] = TxnArenaStrndup(arena,tmp,strlen(tmp));
+        if(parsed_http_request[i] == NULL)return NULL;
+        tmp = strtok_r (NULL, " ",&save_ptr);
         i+=1;
     }
     return parsed_http_request;
@@ -1641,44 +3434,52 @@ int get_header_length(char http_response[]){
 
 
 
-void parsing_request_all_URL(char *server_respone,char *result_parsing_url , int response_size,int array_size, int *num)
-{		
-	int count=0,url_num=0;
-	char *front_ptr_url,*end_ptr_url;
-	char temp[100][200];
-	
+//存放解析結果的二維陣列
+typedef struct {
+	const char *host;	//網頁所在的主機
+	const char *base;	//網頁的路徑,相對網址以它為基準
+	char *result;
+	int array_size;
+	int max_num;
+	int num;
+} parsed_url_list;
 
-	while( count < response_size  )
-	{
-		if( strncmp(server_respone,"src=\"/",6) == 0)
-		{
-			front_ptr_url=strstr(server_respone,"=\"");
-			front_ptr_url+=2;
-			end_ptr_url=strchr(front_ptr_url,'\"');
-			memcpy( temp[url_num++],front_ptr_url,end_ptr_url-front_ptr_url);	
-		}
-		else if(strncmp(server_respone,"src='/",6) == 0)
-		{
-			front_ptr_url=strstr(server_respone,"='");
-			front_ptr_url+=2;
-			end_ptr_url=strchr(front_ptr_url,'\'');
-			memcpy( temp[url_num++],front_ptr_url,end_ptr_url-front_ptr_url);
-			
-		}
-		
-		server_respone++;
-		count++;
+//UrlExtract每找到一個網址就呼叫一次:依RFC 3986解析成同主機的絕對路徑並正規化,
+//所以"../js/a.js"、"https://主機/V7/js/a.js"、"/V7/js/%61.js"都會變成同一個"/V7/js/a.js",重複的不收
+static void parsed_url_add(const char *url, int length, void *data)
+{
+	parsed_url_list *list = (parsed_url_list *)data;
+	char *slot;
+	int i;
+
+	if (list->num >= list->max_num)
+		return;
+
+	slot = list->result + list->num * list->array_size;
+	if (UrlResolve(list->host, list->base, url, length, slot, list->array_size) < 0)	//別的主機、別的scheme或太長
+		return;
+
+	for (i = 0; i < list->num; i++) {
+		if (strcmp(list->result + i * list->array_size, slot) == 0)
+			return;
 	}
+	list->num++;
+}
+
+void parsing_request_all_URL(char *server_respone,const char *host,const char *base,char *result_parsing_url , int response_size,int array_size, int max_num, int *num)
+{
+	parsed_url_list list;
 
+	list.host       = host;
+	list.base       = base;
+	list.result     = result_parsing_url;
+	list.array_size = array_size;
+	list.max_num    = max_num;
+	list.num        = 0;
+
+	//一次掃過整個網頁,src、srcset、<link href>、url()、@import都在UrlExtract的表裡
+	UrlExtract(server_respone, response_size, parsed_url_add, &list);
 
 	//把解析出的網址數量存到num 
-	*num=url_num;	
-	
-	//把解析出來的每個網址存到二維陣列中 
-	for(count=0;count<url_num;count++)
-	{	
-		memcpy(result_parsing_url,temp[count],200);	
-		result_parsing_url+=array_size;
-		
-	}
+	*num = list.num;
 }
@@ -0,0 +1,291 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#ifndef URL_EXTRACT_H
+#define URL_EXTRACT_H
+
+/* Called for each reference found, url is not NUL terminated. */
+typedef void (*UrlFoundFunc)(const char *url, int length, void *data);
+
+void UrlExtract(const char *buf, int length, UrlFoundFunc found, void *data);
+void UrlExtractAnchors(const char *buf, int length, UrlFoundFunc found, void *data);
+
+#endif /* URL_EXTRACT_H */
+
+typedef enum {
+  URL_PATTERN_SRC,    /* src="..." of img, script, iframe, source */
+  URL_PATTERN_SRCSET, /* srcset="a.png 1x, b.png 2x" */
+  URL_PATTERN_HREF,   /* href="..." of a <link> or an <a> */
+  URL_PATTERN_REL,    /* rel="..." of a <link> */
+  URL_PATTERN_CSS,    /* url(...) of css */
+  URL_PATTERN_IMPORT, /* @import "..." of css */
+} UrlPatternKind;
+
+typedef struct {
+  const char *token;
+  int length;
+  UrlPatternKind kind;
+  int attribute; /* only at the start of an attribute of a tag */
+} UrlPattern;
+
+/* Everything the extractor knows is in this table. Tokens are matched
+   without case, attributes must be followed by '='. */
+static const UrlPattern url_patterns[] = {
+  {"src", 3, URL_PATTERN_SRC, 1},     {"srcset", 6, URL_PATTERN_SRCSET, 1},  {"href", 4, URL_PATTERN_HREF, 1},
+  {"rel", 3, URL_PATTERN_REL, 1},     {"url(", 4, URL_PATTERN_CSS, 0},       {"@import", 7, URL_PATTERN_IMPORT, 0},
+  {NULL, 0, URL_PATTERN_SRC, 0},
+};
+
+/* Link types that make the browser fetch the href. */
+static const char *url_link_rels[] = {"stylesheet", "preload", "modulepreload", "icon", "prefetch", NULL};
+
+typedef struct {
+  const char *buf;
+  int length;
+  int pos;
+  int in_tag;
+  int in_link;
+  int in_anchor;
+  int anchors; /* only the href of the <a> tags */
+  const char *link_href;
+  int link_href_length;
+  int link_rel_ok;
+  UrlFoundFunc found;
+  void *data;
+} UrlScanner;
+
+static void
+url_skip_space(UrlScanner *scan)
+{
+  while (scan->pos < scan->length && isspace((unsigned char)scan->buf[scan->pos]))
+    scan->pos++;
+}
+
+/* Read a quoted or bare value at pos. A bare value ends at a space,
+   '>' or any of the extra stop characters. */
+static const char *
+url_read_value(UrlScanner *scan, const char *stop, int *value_length)
+{
+  const char *value;
+  char quote = scan->buf[scan->pos];
+  int start;
+
+  if (quote == '"' || quote == '\'') {
+    start = ++scan->pos;
+    while (scan->pos < scan->length && scan->buf[scan->pos] != quote)
+      scan->pos++;
+    if (scan->pos >= scan->length) {
+      scan->pos = start;
+      return NULL;
+    }
+    value         = scan->buf + start;
+    *value_length = scan->pos - start;
+    scan->pos++;
+    return value;
+  }
+
+  start = scan->pos;
+  while (scan->pos < scan->length && !isspace((unsigned char)scan->buf[scan->pos]) && scan->buf[scan->pos] != '>' &&
+         !strchr(stop, scan->buf[scan->pos]))
+    scan->pos++;
+  value         = scan->buf + start;
+  *value_length = scan->pos - start;
+  return *value_length > 0 ? value : NULL;
+}
+
+/* Each candidate of a srcset is a url and an optional descriptor. */
+static void
+url_emit_srcset(UrlScanner *scan, const char *value, int length)
+{
+  int i = 0, start;
+
+  while (i < length) {
+    while (i < length && (isspace((unsigned char)value[i]) || value[i] == ','))
+      i++;
+    start = i;
+    while (i < length && !isspace((unsigned char)value[i]) && value[i] != ',')
+      i++;
+    if (i > start)
+      scan->found(value + start, i - start, scan->data);
+    /* skip the descriptor */
+    while (i < length && value[i] != ',')
+      i++;
+  }
+}
+
+static int
+url_link_rel_ok(const char *value, int length)
+{
+  int i, n;
+  const char *p;
+
+  for (p = value; p < value + length; p += n) {
+    while (p < value + length && isspace((unsigned char)*p))
+      p++;
+    for (n = 0; p + n < value + length && !isspace((unsigned char)p[n]); n++)
+      ;
+    for (i = 0; url_link_rels[i]; i++) {
+      if ((int)strlen(url_link_rels[i]) == n && strncasecmp(p, url_link_rels[i], n) == 0)
+        return 1;
+    }
+    if (n == 0)
+      break;
+  }
+  return 0;
+}
+
+/* Try the patterns of the table at pos. Returns 1 and moves pos past
+   what was matched, or 0. */
+static int
+url_match(UrlScanner *scan)
+{
+  const UrlPattern *pattern;
+  const char *value;
+  int value_length;
+  int start = scan->pos;
+
+  for (pattern = url_patterns; pattern->token; pattern++) {
+    if (pattern->attribute && !scan->in_tag)
+      continue;
+    if (scan->anchors && pattern->kind != URL_PATTERN_HREF)
+      continue;
+    if (scan->length - start < pattern->length || strncasecmp(scan->buf + start, pattern->token, pattern->length) != 0)
+      continue;
+
+    scan->pos = start + pattern->length;
+    if (pattern->attribute) {
+      /* "src" must not be the end of "data-src", nor the start of "srcset" */
+      if (start > 0 && !isspace((unsigned char)scan->buf[start - 1]))
+        continue;
+      url_skip_space(scan);
+      if (scan->pos >= scan->length || scan->buf[scan->pos] != '=')
+        continue;
+      scan->pos++;
+      url_skip_space(scan);
+    }
+
+    switch (pattern->kind) {
+    case URL_PATTERN_CSS:
+      url_skip_space(scan);
+      value = url_read_value(scan, ")", &value_length);
+      break;
+    case URL_PATTERN_IMPORT:
+      url_skip_space(scan);
+      /* @import url(...) is found by the url( pattern */
+      if (scan->pos < scan->length && scan->buf[scan->pos] != '"' && scan->buf[scan->pos] != '\'')
+        return 1;
+      value = url_read_value(scan, ";", &value_length);
+      break;
+    default:
+      value = url_read_value(scan, "", &value_length);
+      break;
+    }
+    if (value == NULL)
+      return 1;
+
+    switch (pattern->kind) {
+    case URL_PATTERN_SRCSET:
+      url_emit_srcset(scan, value, value_length);
+      break;
+    case URL_PATTERN_HREF:
+      /* <a href> is a link to follow, not a part of the page */
+      if (scan->anchors) {
+        if (scan->in_anchor)
+          scan->found(value, value_length, scan->data);
+      } else if (scan->in_link) {
+        scan->link_href        = value;
+        scan->link_href_length = value_length;
+      }
+      break;
+    case URL_PATTERN_REL:
+      if (scan->in_link)
+        scan->link_rel_ok = url_link_rel_ok(value, value_length);
+      break;
+    default:
+      scan->found(value, value_length, scan->data);
+      break;
+    }
+    return 1;
+  }
+
+  scan->pos = start;
+  return 0;
+}
+
+static void
+url_scan(const char *buf, int length, UrlFoundFunc found, void *data, int anchors)
+{
+  UrlScanner scan;
+  char c;
+
+  memset(&scan, 0, sizeof(scan));
+  scan.buf     = buf;
+  scan.length  = length;
+  scan.found   = found;
+  scan.data    = data;
+  scan.anchors = anchors;
+
+  while (scan.pos < scan.length) {
+    c = scan.buf[scan.pos];
+
+    if (c == '<') {
+      scan.pos++;
+      scan.in_tag  = 1;
+      scan.in_link = scan.length - scan.pos > 4 && strncasecmp(scan.buf + scan.pos, "link", 4) == 0 &&
+                     isspace((unsigned char)scan.buf[scan.pos + 4]);
+      scan.in_anchor = scan.length - scan.pos > 1 && (scan.buf[scan.pos] == 'a' || scan.buf[scan.pos] == 'A') &&
+                       isspace((unsigned char)scan.buf[scan.pos + 1]);
+      scan.link_href        = NULL;
+      scan.link_href_length = 0;
+      scan.link_rel_ok      = 0;
+      continue;
+    }
+
+    if (c == '>' && scan.in_tag) {
+      if (scan.in_link && scan.link_href && scan.link_rel_ok)
+        scan.found(scan.link_href, scan.link_href_length, scan.data);
+      scan.in_tag    = 0;
+      scan.in_link   = 0;
+      scan.in_anchor = 0;
+      scan.pos++;
+      continue;
+    }
+
+    if (!url_match(&scan))
+      scan.pos++;
+  }
+}
+
+/* Find the objects a page or a stylesheet refers to, in one pass over
+   buf: src and srcset of any tag, href of the <link> elements the
+   browser loads, url() and @import of css, inline or not. */
+void
+UrlExtract(const char *buf, int length, UrlFoundFunc found, void *data)
+{
+  url_scan(buf, length, found, data, 0);
+}
+
+/* Find the links of a page, the href of its <a> tags. */
+void
+UrlExtractAnchors(const char *buf, int length, UrlFoundFunc found, void *data)
+{
+  url_scan(buf, length, found, data, 1);
+}
@@ -0,0 +1,284 @@
+/** @file
+  A brief file description
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#ifndef URL_RESOLVE_H
+#define URL_RESOLVE_H
+
+/* Longest reference resolved, before normalization. */
+#define URL_RESOLVE_MAX_LENGTH 2048
+
+int UrlResolve(const char *host, const char *base, const char *ref, int length, char *out, int out_size);
+int UrlNormalizePath(const char *host, char *path, int size);
+
+#endif /* URL_RESOLVE_H */
+
+/* remove_dot_segments of RFC 3986 5.2.4, in place. path starts with
+   '/'. */
+static void
+url_remove_dot_segments(char *path)
+{
+  char *in  = path;
+  char *out = path;
+
+  while (*in) {
+    if (strncmp(in, "/./", 3) == 0) {
+      in += 2;
+    } else if (strcmp(in, "/.") == 0) {
+      in[1] = '\0';
+    } else if (strncmp(in, "/../", 4) == 0 || strcmp(in, "/..") == 0) {
+      /* drop the last segment written */
+      while (out > path && *--out != '/')
+        ;
+      in += 3;
+      if (*in == '\0') {
+        *out++ = '/';
+        break;
+      }
+    } else {
+      do {
+        *out++ = *in++;
+      } while (*in && *in != '/');
+    }
+  }
+  if (out == path)
+    *out++ = '/';
+  *out = '\0';
+}
+
+static int
+url_unreserved(int c)
+{
+  return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/* Percent-encoding normalization of RFC 3986 6.2.2.2: escapes of
+   unreserved characters are decoded, the others get upper case hex
+   digits, and bytes that can't be in a request line are escaped.
+   Returns the length written, or -1 if out is too small. */
+static int
+url_normalize_escapes(const char *in, int length, char *out, int out_size)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  unsigned char c;
+  int i, n = 0;
+
+  for (i = 0; i < length; i++) {
+    c = (unsigned char)in[i];
+    if (c == '%' && i + 2 < length && isxdigit((unsigned char)in[i + 1]) && isxdigit((unsigned char)in[i + 2])) {
+      int value = (isdigit((unsigned char)in[i + 1]) ? in[i + 1] - '0' : (toupper((unsigned char)in[i + 1]) - 'A' + 10)) * 16 +
+                  (isdigit((unsigned char)in[i + 2]) ? in[i + 2] - '0' : (toupper((unsigned char)in[i + 2]) - 'A' + 10));
+
+      i += 2;
+      if (url_unreserved(value)) {
+        if (n + 1 >= out_size)
+          return -1;
+        out[n++] = value;
+        continue;
+      }
+      c = value;
+    } else if (c > 0x20 && c < 0x7f && c != '%') {
+      if (n + 1 >= out_size)
+        return -1;
+      out[n++] = c;
+      continue;
+    }
+
+    if (n + 3 >= out_size)
+      return -1;
+    out[n++] = '%';
+    out[n++] = hex[c >> 4];
+    out[n++] = hex[c & 0xf];
+  }
+  out[n] = '\0';
+  return n;
+}
+
+/* Length of the scheme of ref ("http" of "http://..."), 0 if ref is a
+   relative reference. */
+static int
+url_scheme_length(const char *ref, int length)
+{
+  int i;
+
+  if (length == 0 || !isalpha((unsigned char)ref[0]))
+    return 0;
+  for (i = 1; i < length; i++) {
+    if (ref[i] == ':')
+      return i;
+    if (!isalnum((unsigned char)ref[i]) && ref[i] != '+' && ref[i] != '-' && ref[i] != '.')
+      return 0;
+  }
+  return 0;
+}
+
+/* The authority of a network path reference must name host, on the
+   default port. Returns the length of the authority, or -1. */
+static int
+url_same_host(const char *host, const char *authority, int length)
+{
+  const char *at, *port;
+  int n, host_length;
+
+  for (n = 0; n < length && authority[n] != '/' && authority[n] != '?'; n++)
+    ;
+  if (host == NULL)
+    return -1;
+
+  /* drop the userinfo */
+  at = memchr(authority, '@', n);
+  if (at) {
+    host_length = n - (at + 1 - authority);
+    authority   = at + 1;
+  } else {
+    host_length = n;
+  }
+
+  port = memchr(authority, ':', host_length);
+  if (port) {
+    int port_length = host_length - (port + 1 - authority);
+
+    if (port_length > 0 && !(port_length == 2 && strncmp(port + 1, "80", 2) == 0) &&
+        !(port_length == 3 && strncmp(port + 1, "443", 3) == 0))
+      return -1;
+    host_length = port - authority;
+  }
+
+  if ((int)strlen(host) != host_length || strncasecmp(host, authority, host_length) != 0)
+    return -1;
+  return n;
+}
+
+/* Resolve ref, found in the object at path base of host, into a
+   normalized path (RFC 3986 5.2 and 6.2.2) written to out. Absolute
+   http and https references to host are turned into their path. The
+   fragment is dropped. Returns the length of the path, or -1 if ref
+   is empty, points to another host or scheme, or doesn't fit. */
+int
+UrlResolve(const char *host, const char *base, const char *ref, int length, char *out, int out_size)
+{
+  char merged[URL_RESOLVE_MAX_LENGTH + 1];
+  const char *base_end;
+  char *query;
+  int scheme, authority, dir_length, n;
+
+  while (length > 0 && isspace((unsigned char)*ref)) {
+    ref++;
+    length--;
+  }
+  while (length > 0 && isspace((unsigned char)ref[length - 1]))
+    length--;
+  for (n = 0; n < length && ref[n] != '#'; n++)
+    ;
+  length = n;
+  if (length == 0)
+    return -1;
+
+  scheme = url_scheme_length(ref, length);
+  if (scheme > 0) {
+    if (!(scheme == 4 && strncasecmp(ref, "http", 4) == 0) && !(scheme == 5 && strncasecmp(ref, "https", 5) == 0))
+      return -1;
+    ref += scheme + 1;
+    length -= scheme + 1;
+    if (length < 2 || ref[0] != '/' || ref[1] != '/')
+      return -1;
+  }
+
+  if (length >= 2 && ref[0] == '/' && ref[1] == '/') {
+    authority = url_same_host(host, ref + 2, length - 2);
+    if (authority < 0)
+      return -1;
+    ref += 2 + authority;
+    length -= 2 + authority;
+    if (length == 0 || ref[0] != '/') {
+      merged[0] = '/';
+      n         = 1;
+    } else {
+      n = 0;
+    }
+    if (n + length > URL_RESOLVE_MAX_LENGTH)
+      return -1;
+    memcpy(merged + n, ref, length);
+    n += length;
+  } else if (ref[0] == '/') {
+    if (length > URL_RESOLVE_MAX_LENGTH)
+      return -1;
+    memcpy(merged, ref, length);
+    n = length;
+  } else {
+    /* merge with the base: its whole path for a query only reference,
+       its directory otherwise */
+    base_end = base + strcspn(base, "?");
+    if (ref[0] != '?') {
+      while (base_end > base && base_end[-1] != '/')
+        base_end--;
+    }
+    dir_length = base_end - base;
+    if (dir_length == 0 || base[0] != '/') {
+      merged[0]  = '/';
+      dir_length = 1;
+    } else {
+      if (dir_length > URL_RESOLVE_MAX_LENGTH)
+        return -1;
+      memcpy(merged, base, dir_length);
+    }
+    if (dir_length + length > URL_RESOLVE_MAX_LENGTH)
+      return -1;
+    memcpy(merged + dir_length, ref, length);
+    n = dir_length + length;
+  }
+  merged[n] = '\0';
+
+  n = url_normalize_escapes(merged, n, out, out_size);
+  if (n < 0)
+    return -1;
+
+  /* dot segments are only in the path, not in the query */
+  query = strchr(out, '?');
+  if (query) {
+    char saved[URL_RESOLVE_MAX_LENGTH * 3 + 1];
+
+    snprintf(saved, sizeof(saved), "%s", query);
+    *query = '\0';
+    url_remove_dot_segments(out);
+    n = strlen(out);
+    memmove(out + n, saved, strlen(saved) + 1);
+  } else {
+    url_remove_dot_segments(out);
+  }
+  return strlen(out);
+}
+
+/* Normalize the path a client asked for in place, so it maps to the
+   same cache key as the links that point to it. Left alone if it
+   can't be normalized. */
+int
+UrlNormalizePath(const char *host, char *path, int size)
+{
+  char normalized[URL_RESOLVE_MAX_LENGTH * 3 + 1];
+  int n;
+
+  n = UrlResolve(host, "/", path, strlen(path), normalized, sizeof(normalized));
+  if (n < 0 || n >= size)
+    return -1;
+  memcpy(path, normalized, n + 1);
+  return n;
+}
@@ -0,0 +1,161 @@
+/** @file
+  Origin HTTP/2 against a stub server, see run_tests.sh
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+/* Usage: h2_test origin.conf ca_file site docroot
+          h2_test -fallback origin.conf ca_file site
+
+   origin.conf has one "Origin:" line to the stub server, whose
+   certificate is for site and signed by ca_file. The stub serves the
+   files of docroot over HTTP/2, or with -fallback doesn't speak it.
+   docroot has big.bin, under RESPONSE_SIZE, and huge.bin, over. */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <ts/ts.h>
+
+#define MAX_SERVER_NAME_LENGTH 1024
+#define MAX_REQUEST_LENGTH 2050
+
+#include "../Overload.c"
+#include "../OriginHealth.c"
+#include "../OriginTls.c"
+#include "../OriginFetch.c"
+#include "../OriginH2.c"
+
+#define RESPONSE_SIZE 1000000
+
+TSHRTime
+TShrtime(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (TSHRTime)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void
+TSDebug(const char *tag, const char *format, ...)
+{
+}
+
+void
+TSError(const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+TSVConn
+TSVConnFdCreate(int fd)
+{
+  return NULL;
+}
+
+void
+TSVConnClose(TSVConn vc)
+{
+}
+
+static int failures;
+
+static void
+check(int ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  if (!ok)
+    failures++;
+}
+
+/* 1 if response is a 200 whose body is the file docroot/path. */
+static int
+same_as_file(OriginH2Stream *stream, const char *docroot)
+{
+  char path[1024], length[64], *body;
+  static char file[RESPONSE_SIZE];
+  size_t size;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s%s", docroot, stream->path);
+  f = fopen(path, "rb");
+  if (f == NULL)
+    return 0;
+  size = fread(file, 1, sizeof(file), f);
+  fclose(f);
+
+  stream->response[stream->length] = '\0';
+  body = strstr(stream->response, "\r\n\r\n");
+  snprintf(length, sizeof(length), "\r\nContent-Length: %zu\r\n", size);
+  return strncmp(stream->response, "HTTP/1.1 200 OK\r\n", 17) == 0 && body && strstr(stream->response, length) &&
+         (size_t)(stream->response + stream->length - body - 4) == size && memcmp(body + 4, file, size) == 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  OriginH2Stream streams[] = {
+    {"/style.css", NGHTTP2_MAX_WEIGHT}, {"/app.js", NGHTTP2_DEFAULT_WEIGHT},
+    {"/big.bin", NGHTTP2_DEFAULT_WEIGHT}, {"/missing.png", NGHTTP2_DEFAULT_WEIGHT},
+    {"/huge.bin", NGHTTP2_DEFAULT_WEIGHT},
+  };
+  int count = sizeof(streams) / sizeof(streams[0]);
+  int fallback = argc == 5 && strcmp(argv[1], "-fallback") == 0;
+  const char *site, *docroot;
+  int i;
+
+  if (argc != 5) {
+    fprintf(stderr, "Usage: %s [-fallback] origin.conf ca_file site [docroot]\n", argv[0]);
+    return 2;
+  }
+  argv += fallback;
+  site    = argv[3];
+  docroot = argv[4];
+  if (OriginInit(argv[1]) < 0 || origin_configured_count != 1 ||
+      (origin_servers[0].tls && OriginTlsInit(argv[2]) < 0)) {
+    fprintf(stderr, "can't set up the origin of %s\n", argv[1]);
+    return 2;
+  }
+  for (i = 0; i < count; i++) {
+    streams[i].response = malloc(RESPONSE_SIZE + 1);
+    streams[i].size     = RESPONSE_SIZE;
+  }
+
+  if (fallback) {
+    check(OriginH2Fetch(site, 443, streams, count) < 0, "HTTP/1.1 origin declined");
+    check(origin_servers[0].h2 < 0, "HTTP/1.1 origin remembered");
+    check(OriginH2Fetch(site, 443, streams, count) < 0, "HTTP/1.1 origin declined again");
+    check(origin_tls_handshakes == 1, "no second connection");
+    check(origin_servers[0].state == ORIGIN_CLOSED, "origin still healthy");
+    return failures ? 1 : 0;
+  }
+
+  check(OriginH2Fetch(site, 443, streams, count) == 0, "spoken to in HTTP/2");
+  check(same_as_file(&streams[0], docroot), "stylesheet whole");
+  check(same_as_file(&streams[1], docroot), "script whole");
+  check(same_as_file(&streams[2], docroot), "large object whole, past the flow control windows");
+  check(strstr(streams[0].response, "\r\nDate: ") != NULL, "header names capitalized");
+  check(streams[3].length > 0 && strncmp(streams[3].response, "HTTP/1.1 404 Not Found\r\n", 24) == 0, "missing object 404");
+  check(streams[4].length == 0, "object larger than its buffer dropped");
+  check(origin_servers[0].h2 == 1, "HTTP/2 origin remembered");
+  check(origin_servers[0].state == ORIGIN_CLOSED, "origin healthy");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Build the tests of HTTP_plugin and run them against stub origin
+# servers on the loopback.
+#
+#   TS_INCLUDE  directory holding ts/ts.h (default /usr/local/include)
+#   CC, CFLAGS, LDFLAGS as usual
+#
+# Needs openssl(1), nghttpd(1) and the OpenSSL and nghttp2 development
+# files.
+
+set -e
+
+cd "$(dirname "$0")"
+TS_INCLUDE=${TS_INCLUDE:-/usr/local/include}
+CC=${CC:-cc}
+WORK=$(mktemp -d)
+PORT=${PORT:-18443}
+SITE=www.example.test
+SERVER=
+
+cleanup() {
+  [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# A CA and a certificate for SITE signed by it.
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=test CA" \
+  -keyout "$WORK/ca.key" -out "$WORK/ca.crt" 2>/dev/null
+openssl req -newkey rsa:2048 -nodes -subj "/CN=$SITE" \
+  -keyout "$WORK/site.key" -out "$WORK/site.csr" 2>/dev/null
+printf 'subjectAltName=DNS:%s\n' "$SITE" > "$WORK/site.ext"
+openssl x509 -req -in "$WORK/site.csr" -CA "$WORK/ca.crt" -CAkey "$WORK/ca.key" -CAcreateserial \
+  -days 1 -extfile "$WORK/site.ext" -out "$WORK/site.crt" 2>/dev/null
+printf '%s\nOrigin: https://127.0.0.1:%s\n' "$SITE" "$PORT" > "$WORK/origin.conf"
+printf '%s\nOrigin: h2c://127.0.0.1:%s\n' "$SITE" "$PORT" > "$WORK/h2c.conf"
+
+# What the HTTP/2 origin serves.
+mkdir "$WORK/docroot"
+echo 'body { background: url(bg.png) }' > "$WORK/docroot/style.css"
+echo 'document.title = "test";' > "$WORK/docroot/app.js"
+head -c 900000 /dev/urandom > "$WORK/docroot/big.bin"
+head -c 1500000 /dev/urandom > "$WORK/docroot/huge.bin"
+
+for test in tls_test h2_test; do
+  $CC $CFLAGS -I"$TS_INCLUDE" -o "$WORK/$test" $test.c $LDFLAGS -lnghttp2 -lssl -lcrypto -lpthread
+done
+
+# start_server command...: run the stub origin in the background.
+start_server() {
+  "$@" > "$WORK/server.log" 2>&1 &
+  SERVER=$!
+  sleep 1
+}
+
+stop_server() {
+  kill "$SERVER"
+  wait "$SERVER" 2>/dev/null || true
+  SERVER=
+}
+
+# Stub origin: one response per connection, stateful sessions, which
+# TLS 1.3 resumes once only.
+for version in -tls1_3 -tls1_2; do
+  echo "== TLS origin, $version"
+  start_server openssl s_server -quiet -www -no_ticket $version -accept "$PORT" \
+    -cert "$WORK/site.crt" -key "$WORK/site.key"
+  "$WORK/tls_test" "$WORK/origin.conf" "$WORK/ca.crt" "$SITE"
+  stop_server
+done
+
+# The stylesheet must go with the highest weight, the others with the
+# default one, which isn't sent.
+check_weights() {
+  if grep -A 3 ':path: /style.css' "$WORK/server.log" | grep -q 'weight=256'; then
+    echo "ok: stylesheet weighted"
+  else
+    echo "FAILED: stylesheet weighted"
+    exit 1
+  fi
+}
+
+echo "== HTTP/2 origin over TLS"
+start_server nghttpd -v -d "$WORK/docroot" "$PORT" "$WORK/site.key" "$WORK/site.crt"
+"$WORK/h2_test" "$WORK/origin.conf" "$WORK/ca.crt" "$SITE" "$WORK/docroot"
+stop_server
+check_weights
+
+echo "== HTTP/2 origin without TLS"
+start_server nghttpd -v --no-tls -d "$WORK/docroot" "$PORT"
+"$WORK/h2_test" "$WORK/h2c.conf" "$WORK/ca.crt" "$SITE" "$WORK/docroot"
+stop_server
+check_weights
+
+echo "== HTTP/1.1 origin over TLS"
+start_server openssl s_server -quiet -www -accept "$PORT" -cert "$WORK/site.crt" -key "$WORK/site.key"
+"$WORK/h2_test" -fallback "$WORK/origin.conf" "$WORK/ca.crt" "$SITE"
+stop_server
@@ -0,0 +1,158 @@
+/** @file
+  Origin TLS against a stub server, see run_tests.sh
+  @section license License
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+      http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+/* Usage: tls_test origin.conf ca_file site
+
+   origin.conf has one "Origin: https://..." line to the stub server,
+   whose certificate is for site and signed by ca_file. The stub answers
+   one request per connection and gives single-use sessions. */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <ts/ts.h>
+
+#define MAX_SERVER_NAME_LENGTH 1024
+#define MAX_REQUEST_LENGTH 2050
+
+#include "../Overload.c"
+#include "../OriginHealth.c"
+#include "../OriginTls.c"
+#include "../OriginFetch.c"
+
+TSHRTime
+TShrtime(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (TSHRTime)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void
+TSDebug(const char *tag, const char *format, ...)
+{
+}
+
+void
+TSError(const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+TSVConn
+TSVConnFdCreate(int fd)
+{
+  return NULL;
+}
+
+void
+TSVConnClose(TSVConn vc)
+{
+}
+
+static int failures;
+
+static void
+check(int ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  if (!ok)
+    failures++;
+}
+
+/* Request / from the stub, 1 if it answered 200. */
+static int
+fetch(const char *site)
+{
+  char request[256], buffer[4096];
+  OriginConn conn;
+  int length, ok;
+  ssize_t n;
+
+  snprintf(request, sizeof(request), "GET / HTTP/1.0\r\nHost: %s\r\n\r\n", site);
+  if (OriginOpen(site, 443, request, 0, buffer, sizeof(buffer) - 1, &length, &conn) < 0)
+    return 0;
+  buffer[length] = '\0';
+  ok             = strncmp(buffer, "HTTP/1.0 200", 12) == 0;
+  /* The tickets of TLS 1.3 come after the handshake, with the data. */
+  while ((n = origin_read(&conn, buffer, sizeof(buffer), 2000)) > 0)
+    ;
+  OriginClose(&conn);
+  return ok;
+}
+
+/* Handshake and close, 1 if the session was resumed. */
+static int
+handshake(const char *site)
+{
+  OriginServer *server = &origin_servers[0];
+  int fd, resumed;
+  SSL *ssl;
+
+  fd = origin_connect(server->host, server->port);
+  if (fd < 0)
+    return 0;
+  ssl     = OriginTlsConnect(fd, server, site, 2000, 0);
+  resumed = ssl && SSL_session_reused(ssl);
+  if (ssl) {
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+  }
+  close(fd);
+  return resumed;
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *site;
+
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s origin.conf ca_file site\n", argv[0]);
+    return 2;
+  }
+  site = argv[3];
+  if (OriginInit(argv[1]) < 0 || origin_configured_count != 1 || !origin_servers[0].tls || OriginTlsInit(argv[2]) < 0) {
+    fprintf(stderr, "can't set up the origin of %s\n", argv[1]);
+    return 2;
+  }
+
+  check(fetch(site), "full handshake and response");
+  check(origin_tls_resumed == 0, "first handshake not resumed");
+  check(origin_servers[0].tls_session_count > 0, "session kept");
+
+  /* A connection that never reads takes a TLS 1.3 session and gives
+     none back: the next one still has another to resume. */
+  check(handshake(site), "second connection resumed");
+  check(fetch(site), "third connection answered");
+  check(origin_tls_resumed == 2, "third connection resumed");
+
+  check(fetch(site), "fourth connection answered");
+  check(origin_tls_resumed == 3, "fourth connection resumed");
+  check(origin_servers[0].tls_session_count <= ORIGIN_TLS_SESSIONS, "sessions bounded");
+
+  printf("%d of %d handshakes resumed, %d sessions kept\n", origin_tls_resumed, origin_tls_handshakes,
+         origin_servers[0].tls_session_count);
+  return failures ? 1 : 0;
+}